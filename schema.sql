@@ -1,9 +1,23 @@
+--- ENTRY
+
+-- content hash of every imported entry, used to only rewrite changed
+-- entries when updating an existing database
+CREATE TABLE jmdict_entry (
+    seqnum      INTEGER PRIMARY KEY,
+    hash        INTEGER NOT NULL
+);
+
 --- KANJI
 
+-- norm is the text as it is searched for: width folded, katakana as
+-- hiragana and long vowel marks spelled out, rnorm the same reversed
+-- character by character so patterns can be looked up by their suffix
 CREATE TABLE jmdict_kanji (
     id          INTEGER PRIMARY KEY,
     seqnum      INTEGER NOT NULL,
-    text        TINYTEXT NOT NULL
+    text        TINYTEXT NOT NULL,
+    norm        TINYTEXT NOT NULL,
+    rnorm       TINYTEXT NOT NULL
 );
 
 CREATE TABLE jmdict_kanji_tag (
@@ -19,6 +33,8 @@ CREATE TABLE jmdict_reading (
     id          INTEGER PRIMARY KEY,
     seqnum      INTEGER NOT NULL,
     text        TINYTEXT NOT NULL,
+    norm        TINYTEXT NOT NULL,
+    rnorm       TINYTEXT NOT NULL,
     truereading BOOLEAN NOT NULL DEFAULT TRUE
 );
 
@@ -79,6 +95,16 @@ CREATE TABLE jmdict_sense_misc (
     text        TEXT NOT NULL
 );
 
+-- full text index over the glosses, rebuilt from jmdict_sense_gloss after a
+-- full import and kept up to date row by row by updates
+CREATE VIRTUAL TABLE jmdict_sense_gloss_fts USING fts5(
+    text,
+    content='jmdict_sense_gloss',
+    content_rowid='id',
+    tokenize='unicode61 remove_diacritics 2',
+    prefix='2 3'
+);
+
 -- TODO implement the following
 --CREATE TABLE jmdict_sense_example (
 --    id          INTEGER PRIMARY KEY,
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+// An arena hands out memory from large blocks by bumping an offset, and
+// takes it all back at once. Blocks are kept when it's reset, so an arena
+// that is reset after every lookup stops allocating once it has grown to
+// what a lookup needs.
+
+struct arena_block {
+    arena_block_t *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+#define ARENA_ALIGN(n) (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+arena_t arena_new(size_t block_size)
+{
+    return (arena_t){ .block_size = block_size };
+}
+
+// returns size bytes aligned for any type, or NULL when out of memory
+void *arena_alloc(arena_t *a, size_t size)
+{
+    size = ARENA_ALIGN(size > 0 ? size : 1);
+
+    // blocks after cur were used before the last reset, and are reused
+    // from the start; one that is too small is passed over
+    while (a->cur != NULL && a->cur->size - a->cur->used < size && a->cur->next != NULL) {
+        a->cur = a->cur->next;
+        a->cur->used = 0;
+    }
+
+    if (a->cur == NULL || a->cur->size - a->cur->used < size) {
+        size_t block_size = a->block_size > 0 ? a->block_size : ARENA_BLOCK;
+        if (block_size < size) {
+            block_size = size;
+        }
+
+        arena_block_t *b = malloc(sizeof(arena_block_t) + block_size);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->next = NULL;
+        b->size = block_size;
+        b->used = 0;
+
+        if (a->cur != NULL) {
+            a->cur->next = b;
+        } else {
+            a->first = b;
+        }
+        a->cur = b;
+    }
+
+    void *ptr = a->cur->data + a->cur->used;
+    a->cur->used += size;
+
+    return ptr;
+}
+
+// zeroed memory for n elements of size bytes; without an arena it's calloc,
+// for code that fills in both things owned by an arena and things that aren't
+void *arena_calloc(arena_t *a, size_t n, size_t size)
+{
+    if (a == NULL) {
+        return calloc(n, size);
+    }
+
+    if (size != 0 && n > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    void *ptr = arena_alloc(a, n * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, n * size);
+    }
+
+    return ptr;
+}
+
+// takes back everything allocated from the arena at once
+void arena_reset(arena_t *a)
+{
+    a->cur = a->first;
+    if (a->cur != NULL) {
+        a->cur->used = 0;
+    }
+}
+
+void arena_free(arena_t *a)
+{
+    arena_block_t *b = a->first;
+
+    while (b != NULL) {
+        arena_block_t *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    a->first = NULL;
+    a->cur = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdlib.h>
+
+// size of the blocks an arena allocates from, unless asked for more at once
+#define ARENA_BLOCK (64 * 1024)
+
+typedef struct arena_block arena_block_t;
+
+// a zeroed arena is an empty one with blocks of ARENA_BLOCK bytes
+typedef struct {
+    arena_block_t *first;
+    arena_block_t *cur;
+    size_t block_size;
+} arena_t;
+
+arena_t arena_new(size_t);
+void *arena_alloc(arena_t *, size_t);
+void *arena_calloc(arena_t *, size_t, size_t);
+void arena_reset(arena_t *);
+void arena_free(arena_t *);
+
+#endif // __ARENA_H__
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "array.h"
 
@@ -14,21 +16,82 @@ array_t array_new(size_t isize, size_t tsize)
     return arr;
 }
 
+// make sure there's room for nsize bytes, growing at least twofold so
+// appending an element at a time takes amortized constant time
 int array_check(array_t *arr, size_t nsize)
 {
     if (arr->asize < nsize) {
-        void *new = realloc(arr->ptr, arr->asize * 2);
+        size_t asize = arr->asize * 2 > nsize ? arr->asize * 2 : nsize;
+
+        void *new = realloc(arr->ptr, asize);
         if (new == NULL) {
             return 0;
         }
 
         arr->ptr = new;
-        arr->asize *= 2;
+        arr->asize = asize;
     }
 
     return 1;
 }
 
+// make room for n more elements
+int array_reserve(array_t *arr, size_t n)
+{
+    return array_check(arr, (arr->size + n) * arr->tsize);
+}
+
+// the growth of an ARRAY_TYPE array, shared by all of them: makes room for
+// want elements of tsize bytes, moving the size elements in the nsmall
+// inline ones to the heap when they no longer fit
+int array_grow(void **heap, const void *small, size_t *cap, size_t nsmall, size_t size, size_t want, size_t tsize)
+{
+    size_t have = *heap != NULL ? *cap : nsmall;
+    if (want <= have) {
+        return 1;
+    }
+
+    size_t ncap = have * 2 > want ? have * 2 : want;
+    if (ncap > SIZE_MAX / tsize) {
+        return 0;
+    }
+
+    void *new = realloc(*heap, ncap * tsize);
+    if (new == NULL) {
+        return 0;
+    }
+    if (*heap == NULL) {
+        memcpy(new, small, size * tsize);
+    }
+
+    *heap = new;
+    *cap = ncap;
+    return 1;
+}
+
+// gives back the memory an ARRAY_TYPE array has no use for, moving its
+// elements back inline when they fit
+void array_shrink(void **heap, void *small, size_t *cap, size_t nsmall, size_t size, size_t tsize)
+{
+    if (*heap == NULL || *cap == size) {
+        return;
+    }
+
+    if (size <= nsmall) {
+        memcpy(small, *heap, size * tsize);
+        free(*heap);
+        *heap = NULL;
+        *cap = 0;
+        return;
+    }
+
+    void *new = realloc(*heap, size * tsize);
+    if (new != NULL) {
+        *heap = new;
+        *cap = size;
+    }
+}
+
 void array_free(array_t *arr, array_free_func f)
 {
     if (arr != NULL && arr->ptr != NULL) {
@@ -14,8 +14,68 @@ typedef void (*array_free_func)(void *ptr);
 
 array_t array_new(size_t, size_t);
 int array_check(array_t *, size_t);
+int array_reserve(array_t *, size_t);
 void array_free(array_t *, array_free_func f);
 #define ARRAY(x, type) ((type*)(x->ptr))
 
+int array_grow(void **, const void *, size_t *, size_t, size_t, size_t, size_t);
+void array_shrink(void **, void *, size_t *, size_t, size_t, size_t);
+
+// ARRAY_TYPE(name, type, n) defines name_t, an array of type that keeps up
+// to n elements inline and moves to the heap once it outgrows them, along
+// with name_data, name_capacity, name_reserve, name_push, name_shrink and
+// name_free. A zeroed one is empty. It has no pointers into itself, so it
+// can be moved around (sorted, say) like any other struct.
+#define ARRAY_TYPE(name, type, n)                                               \
+    typedef struct {                                                            \
+        size_t size;                                                            \
+        size_t cap;                                                             \
+        type *heap;                                                             \
+        type small[n];                                                          \
+    } name##_t;                                                                 \
+                                                                                \
+    static inline type *name##_data(const name##_t *a)                          \
+    {                                                                           \
+        return a->heap != NULL ? a->heap : (type *)a->small;                    \
+    }                                                                           \
+                                                                                \
+    static inline size_t name##_capacity(const name##_t *a)                     \
+    {                                                                           \
+        return a->heap != NULL ? a->cap : (n);                                  \
+    }                                                                           \
+                                                                                \
+    /* makes room for more elements, returns 0 when out of memory */            \
+    static inline int name##_reserve(name##_t *a, size_t more)                  \
+    {                                                                           \
+        return array_grow((void **)&a->heap, a->small, &a->cap, (n),            \
+                a->size, a->size + more, sizeof(type));                         \
+    }                                                                           \
+                                                                                \
+    /* appends a zeroed element and returns it, or NULL when out of memory */   \
+    static inline type *name##_push(name##_t *a)                                \
+    {                                                                           \
+        if (a->size >= name##_capacity(a) && !name##_reserve(a, 1)) {           \
+            return NULL;                                                        \
+        }                                                                       \
+                                                                                \
+        type *e = name##_data(a) + a->size++;                                   \
+        *e = (type){ 0 };                                                       \
+        return e;                                                               \
+    }                                                                           \
+                                                                                \
+    static inline void name##_shrink(name##_t *a)                               \
+    {                                                                           \
+        array_shrink((void **)&a->heap, a->small, &a->cap, (n),                 \
+                a->size, sizeof(type));                                         \
+    }                                                                           \
+                                                                                \
+    static inline void name##_free(name##_t *a)                                 \
+    {                                                                           \
+        free(a->heap);                                                          \
+        a->heap = NULL;                                                         \
+        a->size = 0;                                                            \
+        a->cap = 0;                                                             \
+    }
+
 #endif // __ARRAY_H__
 
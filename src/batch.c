@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "jmdict.h"
+#include "util.h"
+#include "batch.h"
+
+// Queries are read by the calling thread and looked up by a pool of
+// threads that lives as long as the batch. Results are written in input
+// order as soon as every query before them is done, by whichever thread
+// finishes the query they were waiting for, so a batch fed through a pipe
+// answers every line as it comes.
+
+// number of queries read ahead of the first one not written yet
+#define BATCH_WINDOW 4096
+
+typedef struct {
+    char *text;
+    // results, written to a buffer of their own so they can be put back in order
+    char *out;
+    size_t len;
+    int count;
+    int done;
+} query_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    // signaled whenever a query is read, done or written
+    pthread_cond_t cond;
+    // queries are numbered in input order, by the number read, taken by a
+    // thread to be looked up and written so far; query i is in slot
+    // i % BATCH_WINDOW
+    long long nread;
+    long long ntaken;
+    long long nwritten;
+    int eof;
+    // the first query that failed, neither it nor any after it is written
+    long long failed_at;
+    // set while a thread is writing results, the others leave them to it
+    int writing;
+    const jdic_t *p;
+    FILE *out;
+    int nfound;
+    query_t queries[BATCH_WINDOW];
+} batch_t;
+
+typedef struct {
+    pthread_t tid;
+    jdic_t p;
+    search_mode_t mode;
+    batch_t *b;
+} batch_worker_t;
+
+static void write_query(batch_t *b, query_t *q)
+{
+    // the other formats have the query on every entry
+    if (b->p->format == OUTPUT_TEXT) {
+        fprintf(b->out, "=== %s\n", q->text);
+    }
+    fwrite(q->out, 1, q->len, b->out);
+
+    if (q->count == 0 && b->p->verbose) {
+        fprintf(stderr, "No results found for \"%s\"\n", q->text);
+    }
+    if (q->count > 0) b->nfound++;
+
+    free(q->text);
+    free(q->out);
+    *q = (query_t){ 0 };
+}
+
+// writes the results that are done and have nothing before them still
+// being looked up, called and returns with b->lock held
+static void write_results(batch_t *b)
+{
+    if (b->writing) {
+        return;
+    }
+
+    b->writing = 1;
+    while (b->nwritten < b->ntaken && b->nwritten < b->failed_at) {
+        query_t *q = &b->queries[b->nwritten % BATCH_WINDOW];
+        if (!q->done) {
+            break;
+        }
+
+        pthread_mutex_unlock(&b->lock);
+        write_query(b, q);
+        pthread_mutex_lock(&b->lock);
+        b->nwritten++;
+    }
+    // caught up with the input, whoever feeds it may be waiting for these
+    if (b->nwritten == b->nread) {
+        fflush(b->out);
+    }
+    b->writing = 0;
+
+    pthread_cond_broadcast(&b->cond);
+}
+
+// returns 1 if the query couldn't be looked up
+static int look_up(batch_worker_t *w, query_t *q)
+{
+    FILE *out = open_memstream(&q->out, &q->len);
+    if (out == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for results\n");
+
+        return 1;
+    }
+
+    q->count = jdic_lookup(&w->p, w->mode, q->text, out);
+    return fclose(out) != 0 || q->count < 0;
+}
+
+static void *batch_thread(void *arg)
+{
+    batch_worker_t *w = arg;
+    batch_t *b = w->b;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (b->ntaken == b->nread && !b->eof && b->failed_at == LLONG_MAX) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+        if (b->ntaken == b->nread || b->failed_at != LLONG_MAX) {
+            break;
+        }
+
+        long long i = b->ntaken++;
+        query_t *q = &b->queries[i % BATCH_WINDOW];
+        pthread_mutex_unlock(&b->lock);
+
+        int failed = look_up(w, q);
+
+        pthread_mutex_lock(&b->lock);
+        q->done = 1;
+        if (failed && i < b->failed_at) {
+            b->failed_at = i;
+        }
+        write_results(b);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return NULL;
+}
+
+// reads the next non-empty line, returns NULL at the end of in
+static char *read_query(FILE *in)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, in)) > 0) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            return line;
+        }
+    }
+
+    free(line);
+    return NULL;
+}
+
+// looks up every line of in on nthreads threads, printing the results of each
+// query under a header line with the query, in the order of the input; with
+// more than one thread every thread opens a connection to db of its own
+int batch_run(jdic_t *p, const char *db, search_mode_t mode, FILE *in, FILE *out, int nthreads)
+{
+    long long start = mstime();
+    batch_t *b = calloc(1, sizeof(batch_t));
+    batch_worker_t *workers = calloc((size_t)nthreads, sizeof(batch_worker_t));
+    // a single thread uses p itself, more need connections of their own
+    int own = nthreads > 1;
+    int ret = 0;
+
+    if (b == NULL || workers == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for batch\n");
+
+        free(b);
+        free(workers);
+        return 1;
+    }
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->failed_at = LLONG_MAX;
+    b->p = p;
+    b->out = out;
+
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].p = *p;
+        workers[i].mode = mode;
+        workers[i].b = b;
+
+        if (own && jmdict_open_reader(&workers[i].p, db)) {
+            nthreads = i;
+            ret = 1;
+            break;
+        }
+    }
+
+    int nstarted = 0;
+    for (; !ret && nstarted < nthreads; nstarted++) {
+        if (pthread_create(&workers[nstarted].tid, NULL, batch_thread, &workers[nstarted]) != 0) {
+            fprintf(stderr, "Failed to start batch thread\n");
+            break;
+        }
+    }
+    // the queries are picked up by whichever threads did start
+    if (nstarted == 0) {
+        ret = 1;
+    }
+
+    char *text;
+    while (!ret && (text = read_query(in)) != NULL) {
+        pthread_mutex_lock(&b->lock);
+        while (b->nread - b->nwritten == BATCH_WINDOW && b->failed_at == LLONG_MAX) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+        if (b->failed_at != LLONG_MAX) {
+            pthread_mutex_unlock(&b->lock);
+            free(text);
+            break;
+        }
+        b->queries[b->nread++ % BATCH_WINDOW] = (query_t){ .text = text };
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->eof = 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+
+    for (int i = 0; i < nstarted; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    // what the failed query and those read after it left behind
+    for (long long i = b->nwritten; i < b->nread; i++) {
+        query_t *q = &b->queries[i % BATCH_WINDOW];
+
+        free(q->text);
+        free(q->out);
+    }
+    ret = ret || b->failed_at != LLONG_MAX;
+
+    if (!own) {
+        memcpy(p->stmts, workers[0].p.stmts, sizeof(p->stmts));
+        p->data_version = workers[0].p.data_version;
+        p->arena = workers[0].p.arena;
+    } else {
+        for (int i = 0; i < nthreads; i++) {
+            jmdict_close(&workers[i].p);
+        }
+    }
+
+    fflush(out);
+    if (p->verbose) {
+        fprintf(stderr, "Looked up %lli queries in %.3fs on %i thread(s), %i had results\n",
+                b->nread, (double)(mstime() - start) / 1000.0, nthreads, b->nfound);
+        jdic_cache_report(p, stderr);
+    }
+
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+    free(workers);
+    return ret;
+}
@@ -0,0 +1,10 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdio.h>
+
+#include "jdic.h"
+
+int batch_run(jdic_t *, const char *, search_mode_t, FILE *, FILE *, int);
+
+#endif // __BATCH_H__
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "cache.h"
+
+// A bounded least recently used cache, shared by every thread doing
+// lookups. It is split into shards by the hash of the key, each with a lock,
+// a hash table and a list of its items from most to least recently used.
+//
+// Items are reference counted: the cache holds one reference for as long as
+// the item is in it, and every get or put hands out one more. An item that
+// is evicted while in use is only freed once the last reference is released.
+
+struct cache_item {
+    // next item in the same bucket
+    cache_item_t *next;
+    cache_item_t *newer;
+    cache_item_t *older;
+    unsigned long long hash;
+    int refs;
+    void *value;
+    size_t len;
+    unsigned char key[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    cache_item_t **buckets;
+    // a power of two, at least the capacity
+    size_t nbuckets;
+    size_t count;
+    size_t capacity;
+    cache_item_t *newest;
+    cache_item_t *oldest;
+} shard_t;
+
+struct cache {
+    shard_t shards[CACHE_SHARDS];
+    void (*free_value)(void *);
+    atomic_ullong hits;
+    atomic_ullong misses;
+};
+
+#define SHARD(c, h) (&(c)->shards[(h) & (CACHE_SHARDS - 1)])
+// the low bits pick the shard already
+#define BUCKET(s, h) (&(s)->buckets[((h) / CACHE_SHARDS) & ((s)->nbuckets - 1)])
+
+// a cache of about capacity items, free_value is called on the value of
+// every item once it's no longer used
+cache_t *cache_new(size_t capacity, void (*free_value)(void *))
+{
+    cache_t *c = calloc(1, sizeof(cache_t));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->free_value = free_value;
+    atomic_init(&c->hits, 0);
+    atomic_init(&c->misses, 0);
+
+    size_t per_shard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    size_t nbuckets = 1;
+    while (nbuckets < per_shard) {
+        nbuckets *= 2;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+
+        pthread_mutex_init(&s->lock, NULL);
+        s->capacity = per_shard > 0 ? per_shard : 1;
+        s->nbuckets = nbuckets;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        c->shards[i].buckets = calloc(nbuckets, sizeof(cache_item_t *));
+        if (c->shards[i].buckets == NULL) {
+            cache_free(c);
+            return NULL;
+        }
+    }
+
+    return c;
+}
+
+static void item_free(cache_t *c, cache_item_t *it)
+{
+    if (c->free_value != NULL) {
+        c->free_value(it->value);
+    }
+    free(it);
+}
+
+// takes an item out of its shard, returns whether that was its last reference
+static int unlink_item(shard_t *s, cache_item_t *it)
+{
+    cache_item_t **b = BUCKET(s, it->hash);
+    while (*b != it) {
+        b = &(*b)->next;
+    }
+    *b = it->next;
+
+    if (it->newer != NULL) it->newer->older = it->older; else s->newest = it->older;
+    if (it->older != NULL) it->older->newer = it->newer; else s->oldest = it->newer;
+    it->newer = it->older = NULL;
+    s->count--;
+
+    return --it->refs == 0;
+}
+
+static void make_newest(shard_t *s, cache_item_t *it)
+{
+    if (s->newest == it) {
+        return;
+    }
+
+    // unlink from the list, it's not the newest so it has a newer item
+    it->newer->older = it->older;
+    if (it->older != NULL) it->older->newer = it->newer; else s->oldest = it->newer;
+
+    it->older = s->newest;
+    it->newer = NULL;
+    s->newest->newer = it;
+    s->newest = it;
+}
+
+static cache_item_t *find(shard_t *s, unsigned long long hash, const void *key, size_t len)
+{
+    for (cache_item_t *it = *BUCKET(s, hash); it != NULL; it = it->next) {
+        if (it->hash == hash && it->len == len && !memcmp(it->key, key, len)) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+// returns a reference to the item with key, or NULL when it isn't cached
+cache_item_t *cache_get(cache_t *c, const void *key, size_t len)
+{
+    unsigned long long hash = fnv1a(FNV1A_INIT, key, len);
+    shard_t *s = SHARD(c, hash);
+
+    pthread_mutex_lock(&s->lock);
+    cache_item_t *it = find(s, hash, key, len);
+    if (it != NULL) {
+        make_newest(s, it);
+        it->refs++;
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    atomic_fetch_add_explicit(it != NULL ? &c->hits : &c->misses, 1, memory_order_relaxed);
+    return it;
+}
+
+// adds value under key, evicting the least recently used item of its shard
+// when full, and returns a reference to it. When another thread cached the
+// same key in the meantime, value is freed and its item returned instead.
+// Returns NULL without taking value when out of memory.
+cache_item_t *cache_put(cache_t *c, const void *key, size_t len, void *value)
+{
+    unsigned long long hash = fnv1a(FNV1A_INIT, key, len);
+    shard_t *s = SHARD(c, hash);
+    cache_item_t *evicted = NULL;
+
+    cache_item_t *it = malloc(sizeof(cache_item_t) + len);
+    if (it == NULL) {
+        return NULL;
+    }
+    *it = (cache_item_t){ .hash = hash, .refs = 2, .value = value, .len = len };
+    memcpy(it->key, key, len);
+
+    pthread_mutex_lock(&s->lock);
+    cache_item_t *old = find(s, hash, key, len);
+    if (old != NULL) {
+        make_newest(s, old);
+        old->refs++;
+    } else {
+        cache_item_t **b = BUCKET(s, hash);
+        it->next = *b;
+        *b = it;
+
+        it->older = s->newest;
+        if (s->newest != NULL) s->newest->newer = it; else s->oldest = it;
+        s->newest = it;
+        s->count++;
+
+        cache_item_t *oldest = s->oldest;
+        if (s->count > s->capacity && unlink_item(s, oldest)) {
+            evicted = oldest;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (old != NULL) {
+        item_free(c, it);
+        return old;
+    }
+    if (evicted != NULL) {
+        item_free(c, evicted);
+    }
+
+    return it;
+}
+
+void *cache_value(const cache_item_t *it)
+{
+    return it->value;
+}
+
+void cache_release(cache_t *c, cache_item_t *it)
+{
+    shard_t *s = SHARD(c, it->hash);
+
+    pthread_mutex_lock(&s->lock);
+    int last = --it->refs == 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (last) {
+        item_free(c, it);
+    }
+}
+
+// drops every item, the ones still in use stay valid until released
+void cache_clear(cache_t *c)
+{
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+        cache_item_t *unused = NULL;
+
+        pthread_mutex_lock(&s->lock);
+        while (s->oldest != NULL) {
+            cache_item_t *it = s->oldest;
+
+            if (unlink_item(s, it)) {
+                it->next = unused;
+                unused = it;
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        while (unused != NULL) {
+            cache_item_t *next = unused->next;
+            item_free(c, unused);
+            unused = next;
+        }
+    }
+}
+
+// frees the cache, every item has to be released already
+void cache_free(cache_t *c)
+{
+    if (c == NULL) {
+        return;
+    }
+
+    cache_clear(c);
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        free(c->shards[i].buckets);
+        pthread_mutex_destroy(&c->shards[i].lock);
+    }
+    free(c);
+}
+
+void cache_report(cache_t *c, const char *name, FILE *out)
+{
+    unsigned long long hits = atomic_load(&c->hits);
+    unsigned long long misses = atomic_load(&c->misses);
+    size_t count = 0;
+    size_t capacity = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&c->shards[i].lock);
+        count += c->shards[i].count;
+        capacity += c->shards[i].capacity;
+        pthread_mutex_unlock(&c->shards[i].lock);
+    }
+
+    fprintf(out, "%s cache: %llu hits, %llu misses (%.1f%% hit rate), %zu of %zu items\n",
+            name, hits, misses, hits + misses > 0 ? 100.0 * (double)hits / (double)(hits + misses) : 0.0,
+            count, capacity);
+}
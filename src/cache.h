@@ -0,0 +1,22 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// number of independently locked parts of a cache, must be a power of two
+#define CACHE_SHARDS 16
+
+typedef struct cache cache_t;
+typedef struct cache_item cache_item_t;
+
+cache_t *cache_new(size_t, void (*)(void *));
+void cache_free(cache_t *);
+cache_item_t *cache_get(cache_t *, const void *, size_t);
+cache_item_t *cache_put(cache_t *, const void *, size_t, void *);
+void *cache_value(const cache_item_t *);
+void cache_release(cache_t *, cache_item_t *);
+void cache_clear(cache_t *);
+void cache_report(cache_t *, const char *, FILE *);
+
+#endif // __CACHE_H__
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#include "queue.h"
+#include "decompress.h"
+
+// compressed input read buffer size
+#define DECOMP_INSIZ (1 << 16)
+// size of a single chunk of decompressed output
+#define DECOMP_CHUNKSIZ (1 << 20)
+// number of chunks in flight between the decompressor and the reader
+#define DECOMP_CHUNKS 4
+
+typedef struct {
+    char *data;
+    size_t len;
+} chunk_t;
+
+// decompression runs on its own thread, handing filled chunks to the reader
+// through `full` and getting them back through `empty` once parsed
+struct decompress {
+    FILE *fp;
+    compression_t comp;
+    unsigned char prefix[16];
+    size_t nprefix;
+
+    pthread_t tid;
+    queue_t full;
+    queue_t empty;
+    chunk_t chunks[DECOMP_CHUNKS];
+    chunk_t *cur;
+    int eof;
+
+    atomic_int stop;
+    atomic_int failed;
+};
+
+compression_t compression_detect(const unsigned char *buf, size_t len)
+{
+    if (len >= 2 && buf[0] == 0x1f && buf[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+
+    if (len >= 6 && !memcmp(buf, "\xfd" "7zXZ\0", 6)) {
+        return COMPRESSION_XZ;
+    }
+
+    return COMPRESSION_NONE;
+}
+
+// bytes already consumed for detection are handed out before the rest of the file
+static size_t read_input(decompress_t *dc, unsigned char *buf, size_t size)
+{
+    if (dc->nprefix > 0) {
+        size_t n = dc->nprefix < size ? dc->nprefix : size;
+        memcpy(buf, dc->prefix, n);
+        memmove(dc->prefix, dc->prefix + n, dc->nprefix - n);
+        dc->nprefix -= n;
+
+        return n;
+    }
+
+    return fread(buf, 1, size, dc->fp);
+}
+
+// chunks are only ever pushed onto `empty` by the reader (the queue has a
+// single producer), a chunk dropped here is simply freed with the rest
+static chunk_t *next_chunk(decompress_t *dc)
+{
+    chunk_t *c = queue_pop(&dc->empty);
+    if (atomic_load(&dc->stop)) {
+        return NULL;
+    }
+
+    c->len = 0;
+    return c;
+}
+
+// hand a (partially) filled chunk to the reader
+static void emit_chunk(decompress_t *dc, chunk_t *c, size_t len)
+{
+    c->len = len;
+    if (len > 0) {
+        queue_push(&dc->full, c);
+    }
+}
+
+#ifdef HAVE_ZLIB
+static int inflate_gzip(decompress_t *dc)
+{
+    unsigned char in[DECOMP_INSIZ];
+    z_stream zs = {0};
+    chunk_t *c = NULL;
+    int ended = 0;
+    int ret = 0;
+
+    // 15 + 32 lets zlib detect the gzip header by itself
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        fprintf(stderr, "Failed to initialize zlib\n");
+
+        return 1;
+    }
+
+    for (;;) {
+        if (zs.avail_in == 0) {
+            size_t n = read_input(dc, in, sizeof(in));
+            if (n == 0) {
+                if (ferror(dc->fp)) {
+                    fprintf(stderr, "Read error\n");
+
+                    ret = 1;
+                } else if (!ended) {
+                    fprintf(stderr, "Unexpected end of gzip stream\n");
+
+                    ret = 1;
+                }
+                break;
+            }
+
+            zs.next_in = in;
+            zs.avail_in = (uInt)n;
+        }
+
+        if (c == NULL) {
+            if ((c = next_chunk(dc)) == NULL) {
+                break;
+            }
+
+            zs.next_out = (Bytef *)c->data;
+            zs.avail_out = DECOMP_CHUNKSIZ;
+        }
+
+        int rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            // there may be more gzip members after this one
+            inflateReset(&zs);
+            ended = 1;
+        } else if (rc == Z_OK || rc == Z_BUF_ERROR) {
+            ended = 0;
+        } else {
+            fprintf(stderr, "Failed to decompress gzip stream: %s\n", zs.msg != NULL ? zs.msg : "unknown error");
+
+            ret = 1;
+            break;
+        }
+
+        if (zs.avail_out == 0) {
+            emit_chunk(dc, c, DECOMP_CHUNKSIZ);
+            c = NULL;
+        }
+    }
+
+    if (c != NULL) {
+        emit_chunk(dc, c, ret ? 0 : DECOMP_CHUNKSIZ - zs.avail_out);
+    }
+
+    inflateEnd(&zs);
+    return ret;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int inflate_xz(decompress_t *dc)
+{
+    unsigned char in[DECOMP_INSIZ];
+    lzma_stream ls = LZMA_STREAM_INIT;
+    lzma_action action = LZMA_RUN;
+    chunk_t *c = NULL;
+    int ret = 0;
+
+    if (lzma_stream_decoder(&ls, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+        fprintf(stderr, "Failed to initialize liblzma\n");
+
+        return 1;
+    }
+
+    for (;;) {
+        if (ls.avail_in == 0 && action == LZMA_RUN) {
+            size_t n = read_input(dc, in, sizeof(in));
+            if (n == 0) {
+                if (ferror(dc->fp)) {
+                    fprintf(stderr, "Read error\n");
+
+                    ret = 1;
+                    break;
+                }
+
+                action = LZMA_FINISH;
+            }
+
+            ls.next_in = in;
+            ls.avail_in = n;
+        }
+
+        if (c == NULL) {
+            if ((c = next_chunk(dc)) == NULL) {
+                break;
+            }
+
+            ls.next_out = (uint8_t *)c->data;
+            ls.avail_out = DECOMP_CHUNKSIZ;
+        }
+
+        lzma_ret rc = lzma_code(&ls, action);
+        if (rc != LZMA_OK && rc != LZMA_STREAM_END) {
+            fprintf(stderr, "Failed to decompress xz stream: %i\n", rc);
+
+            ret = 1;
+            break;
+        }
+
+        if (ls.avail_out == 0 || rc == LZMA_STREAM_END) {
+            emit_chunk(dc, c, DECOMP_CHUNKSIZ - ls.avail_out);
+            c = NULL;
+        }
+
+        if (rc == LZMA_STREAM_END) {
+            break;
+        }
+    }
+
+    if (c != NULL) {
+        emit_chunk(dc, c, ret ? 0 : DECOMP_CHUNKSIZ - ls.avail_out);
+    }
+
+    lzma_end(&ls);
+    return ret;
+}
+#endif
+
+static void *decompress_thread(void *p)
+{
+    decompress_t *dc = (decompress_t *)p;
+    int ret = 1;
+
+    switch (dc->comp) {
+#ifdef HAVE_ZLIB
+        case COMPRESSION_GZIP:
+            ret = inflate_gzip(dc);
+            break;
+#endif
+#ifdef HAVE_LZMA
+        case COMPRESSION_XZ:
+            ret = inflate_xz(dc);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    atomic_store(&dc->failed, ret);
+    queue_push(&dc->full, NULL);
+
+    return NULL;
+}
+
+decompress_t *decompress_start(FILE *fp, compression_t comp, const unsigned char *prefix, size_t nprefix)
+{
+#ifndef HAVE_ZLIB
+    if (comp == COMPRESSION_GZIP) {
+        fprintf(stderr, "Not compiled with gzip support!\n");
+
+        return NULL;
+    }
+#endif
+#ifndef HAVE_LZMA
+    if (comp == COMPRESSION_XZ) {
+        fprintf(stderr, "Not compiled with xz support!\n");
+
+        return NULL;
+    }
+#endif
+
+    decompress_t *dc = calloc(1, sizeof(decompress_t));
+    if (dc == NULL || nprefix > sizeof(dc->prefix)) {
+        free(dc);
+
+        return NULL;
+    }
+
+    dc->fp = fp;
+    dc->comp = comp;
+    memcpy(dc->prefix, prefix, nprefix);
+    dc->nprefix = nprefix;
+    atomic_init(&dc->stop, 0);
+    atomic_init(&dc->failed, 0);
+    queue_init(&dc->full);
+    queue_init(&dc->empty);
+
+    for (int i = 0; i < DECOMP_CHUNKS; i++) {
+        dc->chunks[i].data = malloc(DECOMP_CHUNKSIZ);
+        if (dc->chunks[i].data == NULL) {
+            goto fail;
+        }
+        queue_push(&dc->empty, &dc->chunks[i]);
+    }
+
+    if (pthread_create(&dc->tid, NULL, decompress_thread, dc) != 0) {
+        goto fail;
+    }
+
+    return dc;
+
+fail:
+    for (int i = 0; i < DECOMP_CHUNKS; i++) {
+        free(dc->chunks[i].data);
+    }
+    free(dc);
+
+    return NULL;
+}
+
+// points buf at the next chunk of decompressed data, which stays valid until
+// the next call. returns its length, 0 at the end of the input or -1 on error
+long decompress_read(decompress_t *dc, const char **buf)
+{
+    if (dc->cur != NULL) {
+        queue_push(&dc->empty, dc->cur);
+        dc->cur = NULL;
+    }
+
+    if (dc->eof) {
+        return atomic_load(&dc->failed) ? -1 : 0;
+    }
+
+    chunk_t *c = queue_pop(&dc->full);
+    if (c == NULL) {
+        dc->eof = 1;
+
+        return atomic_load(&dc->failed) ? -1 : 0;
+    }
+
+    dc->cur = c;
+    *buf = c->data;
+    return (long)c->len;
+}
+
+// stops decompression (if it is still running) and frees everything,
+// returns non-zero if decompression failed
+int decompress_finish(decompress_t *dc)
+{
+    atomic_store(&dc->stop, 1);
+
+    // give every chunk back so the decompressor can't block on an empty queue
+    if (dc->cur != NULL) {
+        queue_push(&dc->empty, dc->cur);
+        dc->cur = NULL;
+    }
+    while (!dc->eof) {
+        chunk_t *c = queue_pop(&dc->full);
+        if (c == NULL) {
+            dc->eof = 1;
+        } else {
+            queue_push(&dc->empty, c);
+        }
+    }
+
+    pthread_join(dc->tid, NULL);
+
+    int ret = atomic_load(&dc->failed);
+    for (int i = 0; i < DECOMP_CHUNKS; i++) {
+        free(dc->chunks[i].data);
+    }
+    free(dc);
+
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef __DECOMPRESS_H__
+#define __DECOMPRESS_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef enum {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_GZIP,
+    COMPRESSION_XZ,
+} compression_t;
+
+typedef struct decompress decompress_t;
+
+compression_t compression_detect(const unsigned char *, size_t);
+decompress_t *decompress_start(FILE *, compression_t, const unsigned char *, size_t);
+long decompress_read(decompress_t *, const char **);
+int decompress_finish(decompress_t *);
+
+#endif // __DECOMPRESS_H__
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "deinflect.h"
+
+// Conjugated words are turned back into the dictionary forms they could
+// have come from by undoing one inflection at a time. A rule replaces an
+// ending of a word of a certain kind with the ending of the word it was
+// inflected from, so 食べなかった becomes 食べない (an i-adjective, as far
+// as inflecting goes) and then 食べる (an ichidan verb). The candidates are
+// only guesses, the dictionary decides which of them are words.
+//
+// The endings are compiled into a trie keyed by their bytes from last to
+// first, so the rules that apply to a word are found by walking back from
+// its end once.
+
+typedef struct {
+    const char *from;
+    const char *to;
+    // kinds of word the rule applies to, and the kind it makes
+    unsigned in;
+    unsigned out;
+    const char *reason;
+} rule_t;
+
+static const rule_t rules[] = {
+    // past
+    { "た", "る", DI_INITIAL, DI_V1, "past" },
+    { "った", "う", DI_INITIAL, DI_V5, "past" },
+    { "いた", "く", DI_INITIAL, DI_V5, "past" },
+    { "いだ", "ぐ", DI_INITIAL, DI_V5, "past" },
+    { "した", "す", DI_INITIAL, DI_V5, "past" },
+    { "った", "つ", DI_INITIAL, DI_V5, "past" },
+    { "んだ", "ぬ", DI_INITIAL, DI_V5, "past" },
+    { "んだ", "ぶ", DI_INITIAL, DI_V5, "past" },
+    { "んだ", "む", DI_INITIAL, DI_V5, "past" },
+    { "った", "る", DI_INITIAL, DI_V5, "past" },
+    { "行った", "行く", DI_INITIAL, DI_V5, "past" },
+    { "いった", "いく", DI_INITIAL, DI_V5, "past" },
+    { "した", "する", DI_INITIAL, DI_VS, "past" },
+    { "きた", "くる", DI_INITIAL, DI_VK, "past" },
+    { "来た", "来る", DI_INITIAL, DI_VK, "past" },
+
+    // te form
+    { "て", "る", DI_TE, DI_V1, "te" },
+    { "って", "う", DI_TE, DI_V5, "te" },
+    { "いて", "く", DI_TE, DI_V5, "te" },
+    { "いで", "ぐ", DI_TE, DI_V5, "te" },
+    { "して", "す", DI_TE, DI_V5, "te" },
+    { "って", "つ", DI_TE, DI_V5, "te" },
+    { "んで", "ぬ", DI_TE, DI_V5, "te" },
+    { "んで", "ぶ", DI_TE, DI_V5, "te" },
+    { "んで", "む", DI_TE, DI_V5, "te" },
+    { "って", "る", DI_TE, DI_V5, "te" },
+    { "行って", "行く", DI_TE, DI_V5, "te" },
+    { "いって", "いく", DI_TE, DI_V5, "te" },
+    { "して", "する", DI_TE, DI_VS, "te" },
+    { "きて", "くる", DI_TE, DI_VK, "te" },
+    { "来て", "来る", DI_TE, DI_VK, "te" },
+
+    // i-adjectives, past and te form
+    { "かった", "い", DI_INITIAL, DI_ADJ_I, "past" },
+    { "くて", "い", DI_TE, DI_ADJ_I, "te" },
+
+    // negative, inflecting like an i-adjective
+    { "ない", "る", DI_ADJ_I, DI_V1, "negative" },
+    { "わない", "う", DI_ADJ_I, DI_V5, "negative" },
+    { "かない", "く", DI_ADJ_I, DI_V5, "negative" },
+    { "がない", "ぐ", DI_ADJ_I, DI_V5, "negative" },
+    { "さない", "す", DI_ADJ_I, DI_V5, "negative" },
+    { "たない", "つ", DI_ADJ_I, DI_V5, "negative" },
+    { "なない", "ぬ", DI_ADJ_I, DI_V5, "negative" },
+    { "ばない", "ぶ", DI_ADJ_I, DI_V5, "negative" },
+    { "まない", "む", DI_ADJ_I, DI_V5, "negative" },
+    { "らない", "る", DI_ADJ_I, DI_V5, "negative" },
+    { "しない", "する", DI_ADJ_I, DI_VS, "negative" },
+    { "こない", "くる", DI_ADJ_I, DI_VK, "negative" },
+    { "来ない", "来る", DI_ADJ_I, DI_VK, "negative" },
+    { "くない", "い", DI_ADJ_I, DI_ADJ_I, "negative" },
+
+    // polite
+    { "ます", "る", DI_MASU, DI_V1, "polite" },
+    { "います", "う", DI_MASU, DI_V5, "polite" },
+    { "きます", "く", DI_MASU, DI_V5, "polite" },
+    { "ぎます", "ぐ", DI_MASU, DI_V5, "polite" },
+    { "します", "す", DI_MASU, DI_V5, "polite" },
+    { "ちます", "つ", DI_MASU, DI_V5, "polite" },
+    { "にます", "ぬ", DI_MASU, DI_V5, "polite" },
+    { "びます", "ぶ", DI_MASU, DI_V5, "polite" },
+    { "みます", "む", DI_MASU, DI_V5, "polite" },
+    { "ります", "る", DI_MASU, DI_V5, "polite" },
+    { "します", "する", DI_MASU, DI_VS, "polite" },
+    { "きます", "くる", DI_MASU, DI_VK, "polite" },
+    { "来ます", "来る", DI_MASU, DI_VK, "polite" },
+    { "ました", "ます", DI_INITIAL, DI_MASU, "past" },
+    { "まして", "ます", DI_TE, DI_MASU, "te" },
+    { "ません", "ます", DI_INITIAL, DI_MASU, "negative" },
+    { "ませんでした", "ます", DI_INITIAL, DI_MASU, "negative past" },
+    { "ましょう", "ます", DI_INITIAL, DI_MASU, "volitional" },
+
+    // want to, inflecting like an i-adjective
+    { "たい", "る", DI_ADJ_I, DI_V1, "want" },
+    { "いたい", "う", DI_ADJ_I, DI_V5, "want" },
+    { "きたい", "く", DI_ADJ_I, DI_V5, "want" },
+    { "ぎたい", "ぐ", DI_ADJ_I, DI_V5, "want" },
+    { "したい", "す", DI_ADJ_I, DI_V5, "want" },
+    { "ちたい", "つ", DI_ADJ_I, DI_V5, "want" },
+    { "にたい", "ぬ", DI_ADJ_I, DI_V5, "want" },
+    { "びたい", "ぶ", DI_ADJ_I, DI_V5, "want" },
+    { "みたい", "む", DI_ADJ_I, DI_V5, "want" },
+    { "りたい", "る", DI_ADJ_I, DI_V5, "want" },
+    { "したい", "する", DI_ADJ_I, DI_VS, "want" },
+    { "きたい", "くる", DI_ADJ_I, DI_VK, "want" },
+    { "来たい", "来る", DI_ADJ_I, DI_VK, "want" },
+
+    // i-adjectives
+    { "く", "い", DI_INITIAL, DI_ADJ_I, "adverb" },
+    { "さ", "い", DI_INITIAL, DI_ADJ_I, "noun" },
+    { "ければ", "い", DI_INITIAL, DI_ADJ_I, "conditional" },
+    { "かろう", "い", DI_INITIAL, DI_ADJ_I, "volitional" },
+
+    // conditional
+    { "えば", "う", DI_INITIAL, DI_V5, "conditional" },
+    { "けば", "く", DI_INITIAL, DI_V5, "conditional" },
+    { "げば", "ぐ", DI_INITIAL, DI_V5, "conditional" },
+    { "せば", "す", DI_INITIAL, DI_V5, "conditional" },
+    { "てば", "つ", DI_INITIAL, DI_V5, "conditional" },
+    { "ねば", "ぬ", DI_INITIAL, DI_V5, "conditional" },
+    { "べば", "ぶ", DI_INITIAL, DI_V5, "conditional" },
+    { "めば", "む", DI_INITIAL, DI_V5, "conditional" },
+    { "れば", "る", DI_INITIAL, DI_V1 | DI_V5, "conditional" },
+    { "すれば", "する", DI_INITIAL, DI_VS, "conditional" },
+    { "くれば", "くる", DI_INITIAL, DI_VK, "conditional" },
+    { "来れば", "来る", DI_INITIAL, DI_VK, "conditional" },
+
+    // volitional
+    { "よう", "る", DI_INITIAL, DI_V1, "volitional" },
+    { "おう", "う", DI_INITIAL, DI_V5, "volitional" },
+    { "こう", "く", DI_INITIAL, DI_V5, "volitional" },
+    { "ごう", "ぐ", DI_INITIAL, DI_V5, "volitional" },
+    { "そう", "す", DI_INITIAL, DI_V5, "volitional" },
+    { "とう", "つ", DI_INITIAL, DI_V5, "volitional" },
+    { "のう", "ぬ", DI_INITIAL, DI_V5, "volitional" },
+    { "ぼう", "ぶ", DI_INITIAL, DI_V5, "volitional" },
+    { "もう", "む", DI_INITIAL, DI_V5, "volitional" },
+    { "ろう", "る", DI_INITIAL, DI_V5, "volitional" },
+    { "しよう", "する", DI_INITIAL, DI_VS, "volitional" },
+    { "こよう", "くる", DI_INITIAL, DI_VK, "volitional" },
+    { "来よう", "来る", DI_INITIAL, DI_VK, "volitional" },
+
+    // imperative
+    { "ろ", "る", DI_INITIAL, DI_V1, "imperative" },
+    { "え", "う", DI_INITIAL, DI_V5, "imperative" },
+    { "け", "く", DI_INITIAL, DI_V5, "imperative" },
+    { "げ", "ぐ", DI_INITIAL, DI_V5, "imperative" },
+    { "せ", "す", DI_INITIAL, DI_V5, "imperative" },
+    { "て", "つ", DI_INITIAL, DI_V5, "imperative" },
+    { "ね", "ぬ", DI_INITIAL, DI_V5, "imperative" },
+    { "べ", "ぶ", DI_INITIAL, DI_V5, "imperative" },
+    { "め", "む", DI_INITIAL, DI_V5, "imperative" },
+    { "れ", "る", DI_INITIAL, DI_V5, "imperative" },
+    { "しろ", "する", DI_INITIAL, DI_VS, "imperative" },
+    { "こい", "くる", DI_INITIAL, DI_VK, "imperative" },
+
+    // potential, passive and causative, all of them inflecting like ichidan verbs
+    { "られる", "る", DI_V1, DI_V1 | DI_V5, "potential or passive" },
+    { "える", "う", DI_V1, DI_V5, "potential" },
+    { "ける", "く", DI_V1, DI_V5, "potential" },
+    { "げる", "ぐ", DI_V1, DI_V5, "potential" },
+    { "せる", "す", DI_V1, DI_V5, "potential" },
+    { "てる", "つ", DI_V1, DI_V5, "potential" },
+    { "ねる", "ぬ", DI_V1, DI_V5, "potential" },
+    { "べる", "ぶ", DI_V1, DI_V5, "potential" },
+    { "める", "む", DI_V1, DI_V5, "potential" },
+    { "われる", "う", DI_V1, DI_V5, "passive" },
+    { "かれる", "く", DI_V1, DI_V5, "passive" },
+    { "がれる", "ぐ", DI_V1, DI_V5, "passive" },
+    { "される", "す", DI_V1, DI_V5, "passive" },
+    { "たれる", "つ", DI_V1, DI_V5, "passive" },
+    { "なれる", "ぬ", DI_V1, DI_V5, "passive" },
+    { "ばれる", "ぶ", DI_V1, DI_V5, "passive" },
+    { "まれる", "む", DI_V1, DI_V5, "passive" },
+    { "れる", "る", DI_V1, DI_V5, "potential" },
+    { "させる", "る", DI_V1, DI_V1, "causative" },
+    { "わせる", "う", DI_V1, DI_V5, "causative" },
+    { "かせる", "く", DI_V1, DI_V5, "causative" },
+    { "がせる", "ぐ", DI_V1, DI_V5, "causative" },
+    { "させる", "す", DI_V1, DI_V5, "causative" },
+    { "たせる", "つ", DI_V1, DI_V5, "causative" },
+    { "なせる", "ぬ", DI_V1, DI_V5, "causative" },
+    { "ばせる", "ぶ", DI_V1, DI_V5, "causative" },
+    { "ませる", "む", DI_V1, DI_V5, "causative" },
+    { "らせる", "る", DI_V1, DI_V5, "causative" },
+    { "させる", "する", DI_V1, DI_VS, "causative" },
+    { "される", "する", DI_V1, DI_VS, "passive" },
+    { "こさせる", "くる", DI_V1, DI_VK, "causative" },
+    { "来させる", "来る", DI_V1, DI_VK, "causative" },
+
+    // progressive
+    { "ている", "て", DI_V1, DI_TE, "progressive" },
+    { "てる", "て", DI_V1, DI_TE, "progressive" },
+    { "でいる", "で", DI_V1, DI_TE, "progressive" },
+    { "でる", "で", DI_V1, DI_TE, "progressive" },
+};
+
+#define NRULES (sizeof(rules) / sizeof(*rules))
+// no more nodes than bytes in all of the endings
+#define MAX_NODES 2048
+
+typedef struct {
+    unsigned char byte;
+    short child;
+    short sibling;
+    // first rule ending here, -1 for none
+    short rule;
+} node_t;
+
+static node_t nodes[MAX_NODES];
+static short next_rule[NRULES];
+static pthread_once_t compiled = PTHREAD_ONCE_INIT;
+
+static void compile(void)
+{
+    int nnodes = 1;
+
+    nodes[0] = (node_t){ .child = -1, .sibling = -1, .rule = -1 };
+
+    for (size_t i = 0; i < NRULES; i++) {
+        const char *from = rules[i].from;
+        int node = 0;
+
+        for (size_t j = strlen(from); j-- > 0;) {
+            unsigned char byte = (unsigned char)from[j];
+            int c = nodes[node].child;
+
+            while (c >= 0 && nodes[c].byte != byte) {
+                c = nodes[c].sibling;
+            }
+            if (c < 0) {
+                c = nnodes++;
+                nodes[c] = (node_t){ byte, -1, nodes[node].child, -1 };
+                nodes[node].child = (short)c;
+            }
+            node = c;
+        }
+
+        next_rule[i] = nodes[node].rule;
+        nodes[node].rule = (short)i;
+    }
+}
+
+// index of the candidate with text, or -1
+static int find(const deinflection_t *out, int n, const char *text)
+{
+    for (int i = 0; i < n; i++) {
+        if (!strcmp(out[i].text, text)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// fills out, which has room for DEINFLECT_MAX candidates, with word and
+// the forms it could be an inflection of, returns the number of candidates
+int deinflect(const char *word, deinflection_t *out)
+{
+    size_t wlen = strlen(word);
+    int n = 1;
+
+    pthread_once(&compiled, compile);
+
+    if (wlen >= DEINFLECT_MAX_LEN) {
+        return 0;
+    }
+    memcpy(out[0].text, word, wlen + 1);
+    out[0].type = DI_ANY;
+    out[0].reason[0] = '\0';
+
+    // candidates are taken in the order they are found, so the ones with
+    // the fewest inflections undone come first
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(out[i].text);
+        int node = 0;
+
+        for (size_t j = len; j-- > 0;) {
+            unsigned char byte = (unsigned char)out[i].text[j];
+            int c = nodes[node].child;
+
+            while (c >= 0 && nodes[c].byte != byte) {
+                c = nodes[c].sibling;
+            }
+            if (c < 0) {
+                break;
+            }
+            node = c;
+
+            for (int r = nodes[node].rule; r >= 0; r = next_rule[r]) {
+                const rule_t *rule = &rules[r];
+                size_t tlen = strlen(rule->to);
+
+                if (!(out[i].type & rule->in) || j + tlen >= DEINFLECT_MAX_LEN) {
+                    continue;
+                }
+
+                char text[DEINFLECT_MAX_LEN];
+                memcpy(text, out[i].text, j);
+                memcpy(text + j, rule->to, tlen + 1);
+
+                int k = find(out, n, text);
+                if (k >= 0) {
+                    out[k].type |= rule->out;
+                    continue;
+                }
+                if (n == DEINFLECT_MAX) {
+                    continue;
+                }
+
+                char reason[DEINFLECT_MAX_LEN];
+                snprintf(reason, sizeof(reason), "%s%s%s",
+                        rule->reason, out[i].reason[0] != '\0' ? ", " : "", out[i].reason);
+
+                deinflection_t *d = &out[n++];
+                memcpy(d->text, text, j + tlen + 1);
+                memcpy(d->reason, reason, sizeof(reason));
+                d->type = rule->out;
+            }
+        }
+    }
+
+    return n;
+}
+
+// part of speech descriptions, as JMdict names them, of every kind of word
+static const struct {
+    unsigned type;
+    const char *pos;
+} pos_names[] = {
+    { DI_V1, "Ichidan verb" },
+    { DI_V5, "Godan verb" },
+    { DI_VK, "Kuru verb" },
+    { DI_VS, "suru verb" },
+    { DI_VS, "takes the aux. verb suru" },
+    { DI_ADJ_I, "adjective (keiyoushi)" },
+};
+
+// whether pos has a part of speech of one of the kinds in type
+int deinflect_pos_ok(unsigned type, const char *pos)
+{
+    for (size_t i = 0; i < sizeof(pos_names) / sizeof(*pos_names); i++) {
+        if ((type & pos_names[i].type) && strstr(pos, pos_names[i].pos) != NULL) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int hit_cmp(const void *a, const void *b)
+{
+    const deinflect_hit_t *ha = a;
+    const deinflect_hit_t *hb = b;
+
+    if (ha->candidate != hb->candidate) {
+        return ha->candidate - hb->candidate;
+    }
+
+    return ha->seqnum < hb->seqnum ? -1 : ha->seqnum > hb->seqnum;
+}
+
+// stores a page of the entries found for the candidates in a, those for
+// the candidates with the fewest inflections undone first
+int deinflect_rank(array_t *hits, const deinflection_t *cands, int verbose, int skip, int limit, int *a)
+{
+    deinflect_hit_t *h = ARRAY(hits, deinflect_hit_t);
+    int count = 0;
+    int last = -1;
+
+    qsort(h, hits->size, sizeof(deinflect_hit_t), hit_cmp);
+
+    for (size_t i = 0; i < hits->size && count < limit; i++) {
+        int dup = 0;
+        for (size_t j = 0; j < i && !dup; j++) {
+            dup = h[j].seqnum == h[i].seqnum;
+        }
+        if (dup) {
+            continue;
+        }
+
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+
+        if (verbose && h[i].candidate != last) {
+            const deinflection_t *d = &cands[h[i].candidate];
+            fprintf(stderr, "Deinflected to %s (%s)\n", d->text, d->reason);
+            last = h[i].candidate;
+        }
+        a[count++] = h[i].seqnum;
+    }
+
+    return count;
+}
@@ -0,0 +1,39 @@
+#ifndef __DEINFLECT_H__
+#define __DEINFLECT_H__
+
+#include "array.h"
+
+// most candidates a word deinflects to, the word itself included
+#define DEINFLECT_MAX 64
+#define DEINFLECT_MAX_LEN 128
+
+// the kinds of word a candidate can be
+#define DI_V1     (1 << 0)  // ichidan verb
+#define DI_V5     (1 << 1)  // godan verb
+#define DI_VK     (1 << 2)  // kuru
+#define DI_VS     (1 << 3)  // suru
+#define DI_ADJ_I  (1 << 4)  // i-adjective, and forms inflecting like one
+#define DI_MASU   (1 << 5)  // polite form
+#define DI_TE     (1 << 6)  // te form
+#define DI_INITIAL (1 << 7) // the word as it was looked up
+#define DI_ANY    0xff
+// kinds that are dictionary forms
+#define DI_DICTIONARY (DI_V1 | DI_V5 | DI_VK | DI_VS | DI_ADJ_I)
+
+typedef struct {
+    char text[DEINFLECT_MAX_LEN];
+    unsigned type;
+    // the inflections undone, outermost last
+    char reason[DEINFLECT_MAX_LEN];
+} deinflection_t;
+
+typedef struct {
+    int candidate;
+    int seqnum;
+} deinflect_hit_t;
+
+int deinflect(const char *, deinflection_t *);
+int deinflect_pos_ok(unsigned, const char *);
+int deinflect_rank(array_t *, const deinflection_t *, int, int, int, int *);
+
+#endif // __DEINFLECT_H__
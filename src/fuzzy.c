@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "util.h"
+#include "fuzzy.h"
+
+// Fuzzy matching runs a Levenshtein automaton, in the form of one row of
+// the edit distance table per character, along a sorted list of keys. Keys
+// sharing a prefix share its rows, and once every value in a row is over
+// the distance no key with that prefix can match, so they are skipped.
+
+// keys can't be within the distance once they are longer than this
+#define FUZZY_MAX_DEPTH (FUZZY_MAX_LEN + FUZZY_MAX_DISTANCE)
+
+static int min3(int a, int b, int c)
+{
+    int m = a < b ? a : b;
+
+    return m < c ? m : c;
+}
+
+// adds the keys within k edits of query to hits, returns 1 if the query is too long
+int fuzzy_walk(const char *query, int k, key_source_t *src, array_t *hits)
+{
+    uint32_t q[FUZZY_MAX_LEN];
+    int m = 0;
+
+    for (const char *c = query; *c != '\0';) {
+        if (m == FUZZY_MAX_LEN) {
+            return 1;
+        }
+        q[m++] = utf8_decode(&c);
+    }
+
+    unsigned char rows[FUZZY_MAX_DEPTH + 1][FUZZY_MAX_LEN + 1];
+    // the characters the rows are for, and their length in bytes at each depth
+    char prefix[FUZZY_MAX_DEPTH * 4];
+    size_t offs[FUZZY_MAX_DEPTH + 1] = { 0 };
+    int depth = 0;
+
+    for (int i = 0; i <= m; i++) {
+        rows[0][i] = (unsigned char)i;
+    }
+
+    const char *key;
+    int id;
+    while ((key = src->next(src->ctx, &id)) != NULL) {
+        while (depth > 0 && strncmp(key, prefix, offs[depth]) != 0) {
+            depth--;
+        }
+
+        const char *c = key + offs[depth];
+        int pruned = 0;
+        while (*c != '\0') {
+            if (depth == FUZZY_MAX_DEPTH) {
+                pruned = 1;
+                break;
+            }
+
+            const char *start = c;
+            uint32_t ch = utf8_decode(&c);
+            const unsigned char *prev = rows[depth];
+            unsigned char *row = rows[depth + 1];
+            int best = depth + 1;
+
+            row[0] = (unsigned char)(depth + 1);
+            for (int i = 1; i <= m; i++) {
+                row[i] = (unsigned char)min3(prev[i] + 1, row[i - 1] + 1, prev[i - 1] + (q[i - 1] != ch));
+                if (row[i] < best) best = row[i];
+            }
+
+            memcpy(prefix + offs[depth], start, (size_t)(c - start));
+            offs[depth + 1] = offs[depth] + (size_t)(c - start);
+            depth++;
+
+            if (best > k) {
+                pruned = 1;
+                break;
+            }
+        }
+
+        if (pruned) {
+            src->skip(src->ctx, prefix, offs[depth]);
+            continue;
+        }
+
+        if (rows[depth][m] <= k) {
+            if (!array_reserve(hits, 1)) {
+                return 1;
+            }
+            ARRAY(hits, fuzzy_hit_t)[hits->size++] = (fuzzy_hit_t){ rows[depth][m], id };
+        }
+    }
+
+    return 0;
+}
+
+static int hit_id_cmp(const void *a, const void *b)
+{
+    const fuzzy_hit_t *ha = a;
+    const fuzzy_hit_t *hb = b;
+
+    if (ha->id != hb->id) {
+        return ha->id < hb->id ? -1 : 1;
+    }
+
+    return ha->distance - hb->distance;
+}
+
+static int hit_distance_cmp(const void *a, const void *b)
+{
+    const fuzzy_hit_t *ha = a;
+    const fuzzy_hit_t *hb = b;
+
+    if (ha->distance != hb->distance) {
+        return ha->distance - hb->distance;
+    }
+
+    return ha->id < hb->id ? -1 : ha->id > hb->id;
+}
+
+// keeps the closest hit for every id, closest first and by id after that
+void fuzzy_rank(array_t *hits)
+{
+    fuzzy_hit_t *h = ARRAY(hits, fuzzy_hit_t);
+    size_t n = 0;
+
+    qsort(h, hits->size, sizeof(fuzzy_hit_t), hit_id_cmp);
+    for (size_t i = 0; i < hits->size; i++) {
+        if (n == 0 || h[n - 1].id != h[i].id) {
+            h[n++] = h[i];
+        }
+    }
+    hits->size = n;
+
+    qsort(h, n, sizeof(fuzzy_hit_t), hit_distance_cmp);
+}
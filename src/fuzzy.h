@@ -0,0 +1,27 @@
+#ifndef __FUZZY_H__
+#define __FUZZY_H__
+
+#include "array.h"
+
+// longest query, in characters
+#define FUZZY_MAX_LEN 32
+#define FUZZY_MAX_DISTANCE 3
+
+typedef struct {
+    int distance;
+    int id;
+} fuzzy_hit_t;
+
+// keys in sorted order, walked by fuzzy_walk
+typedef struct {
+    void *ctx;
+    // returns the next key and its id, NULL after the last one
+    const char *(*next)(void *ctx, int *id);
+    // moves past every key starting with the first len bytes of prefix
+    void (*skip)(void *ctx, const char *prefix, size_t len);
+} key_source_t;
+
+int fuzzy_walk(const char *, int, key_source_t *, array_t *);
+void fuzzy_rank(array_t *);
+
+#endif // __FUZZY_H__
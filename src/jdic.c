@@ -4,30 +4,51 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
-#include <sys/time.h>
 
 #include <sqlite3.h>
 
 #include "jdic.h"
+#include "util.h"
 #include "jmdict.h"
-
-typedef enum {
-    SEARCH_AUTO = 0,
-    SEARCH_KANJI,
-    SEARCH_READING,
-    SEARCH_BOTH,
-} search_mode_t;
+#include "snapshot.h"
+#include "server.h"
+#include "batch.h"
+#include "scan.h"
+#include "fuzzy.h"
+#include "romaji.h"
+#include "normalize.h"
+#include "cache.h"
+#include "output.h"
+
+// entries and search results kept when serving or looking up batches
+#define CACHE_SIZE 4096
 
 static void usage(const char *);
-static void print_kanji_info(jdic_t *, int);
+static void entry_free(void *);
+static int search_kanji(jdic_t *, const char *, int *);
+static int search_reading(jdic_t *, const char *, int *);
+static int search_definition(jdic_t *, const char *, int *);
+static int search_fuzzy(jdic_t *, const char *, int *);
+static int search_deinflected(jdic_t *, const char *, int *);
+static int print_entries(jdic_t *, const char *, const int *, int, FILE *);
 
 int main(int argc, char **argv)
 {
     int ret = EXIT_SUCCESS;
     int iflag = 0; 
     char *ival = NULL;
+    int xflag = 0;
+    char *xval = NULL;
+    int sflag = 0;
+    char *sval = NULL;
     int dflag = 0;
     char *dval = NULL;
+    char *lval = NULL;
+    char *cval = NULL;
+    char *bval = NULL;
+    char *tval = NULL;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int cache_size = CACHE_SIZE;
     jdic_t p = {
         .limit = 5,
         .page = 1,
@@ -41,7 +62,7 @@ int main(int argc, char **argv)
     }
 
     char c;
-    while ((c = (char)getopt(argc, argv, ":hvfkrd:i:m:p:l:")) != -1) {
+    while ((c = (char)getopt(argc, argv, ":hvfkreSBud:i:x:s:L:C:j:c:b:t:m:p:a:z:l:o:")) != -1) {
         switch (c) {
             case 'v':
                 p.verbose++;
@@ -58,6 +79,27 @@ int main(int argc, char **argv)
             case 'r':
                 search_mode = SEARCH_READING;
                 break;
+            case 'e':
+                search_mode = SEARCH_DEFINITION;
+                break;
+            case 'z':
+                search_mode = SEARCH_FUZZY;
+                p.distance = atoi(optarg);
+                if (p.distance < 0 || p.distance > FUZZY_MAX_DISTANCE) {
+                    fprintf(stderr, "Edit distance has to be between 0 and %i\n", FUZZY_MAX_DISTANCE);
+
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'S':
+                p.serial = 1;
+                break;
+            case 'B':
+                p.bulk = 1;
+                break;
+            case 'u':
+                p.update = 1;
+                break;
             case 'd':
                 dflag = 1;
                 dval = optarg;
@@ -66,15 +108,51 @@ int main(int argc, char **argv)
                 iflag = 1;
                 ival = optarg;
                 break;
+            case 'x':
+                xflag = 1;
+                xval = optarg;
+                break;
+            case 's':
+                sflag = 1;
+                sval = optarg;
+                break;
+            case 'L':
+                lval = optarg;
+                break;
+            case 'C':
+                cval = optarg;
+                break;
+            case 'b':
+                bval = optarg;
+                break;
+            case 't':
+                tval = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'c':
+                cache_size = atoi(optarg);
+                break;
             case 'm':
                 p.limit = atoi(optarg);
                 break;
             case 'p':
                 p.page = atoi(optarg);
                 break;
+            case 'a':
+                p.after = atoi(optarg);
+                break;
             case 'l':
                 strcpy(p.lang, optarg);
                 break;
+            case 'o':
+                if (output_parse_format(optarg, &p.format)) {
+                    fprintf(stderr, "Unknown output format: %s, has to be text, json or tsv\n", optarg);
+
+                    return EXIT_FAILURE;
+                }
+                break;
             case ':':
                 fprintf(stderr, "Missing required argument for -%c\n", optopt);
 
@@ -95,19 +173,118 @@ int main(int argc, char **argv)
         }
     }
 
-    int ec = sqlite3_open(dflag && dval != NULL ? dval : "db.sqlite3", &p.db);
-    if (ec != SQLITE_OK) {
-        fprintf(stderr, "Failed to open SQLite3 database\n");
-        return EXIT_FAILURE;
+    p.trace = p.verbose;
+
+    const char *db = dflag && dval != NULL ? dval : "db.sqlite3";
+
+    // lookups from a snapshot or through a server don't need the database at all
+    if ((!sflag && cval == NULL) || iflag || xflag) {
+        int ec = sqlite3_open(db, &p.db);
+        if (ec != SQLITE_OK) {
+            fprintf(stderr, "Failed to open SQLite3 database\n");
+            return EXIT_FAILURE;
+        }
     }
 
     if (iflag) {
+        if (p.bulk && p.update) {
+            fprintf(stderr, "-B and -u can't be combined, a bulk import isn't safe for concurrent readers\n");
+
+            jmdict_close(&p);
+            return EXIT_FAILURE;
+        }
+
         ret = jmdict_import(&p, ival);
         if (ret) {
             return ret;
         }
     }
 
+    if (xflag) {
+        ret = snapshot_export(&p, xval);
+        if (ret || (argc - optind <= 0 && lval == NULL && bval == NULL && tval == NULL)) {
+            jmdict_close(&p);
+            return ret;
+        }
+    }
+
+    if (sflag) {
+        p.snap = snapshot_open(sval);
+        if (p.snap == NULL) {
+            jmdict_close(&p);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // serving and batches look up the same entries over and over, from the
+    // database that is, the snapshot needs no cache
+    if ((lval != NULL || bval != NULL) && !sflag && cache_size > 0) {
+        p.entries = cache_new((size_t)cache_size, entry_free);
+        p.searches = cache_new((size_t)cache_size, free);
+        if (p.entries == NULL || p.searches == NULL) {
+            fprintf(stderr, "Failed to allocate memory for caches\n");
+
+            cache_free(p.entries);
+            cache_free(p.searches);
+            jmdict_close(&p);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (lval != NULL) {
+        // workers open connections of their own
+        jmdict_close(&p);
+
+        ret = server_run(&p, db, lval, threads > 0 ? threads : 1);
+
+        cache_free(p.entries);
+        cache_free(p.searches);
+        snapshot_close(p.snap);
+        return ret;
+    }
+
+    if (bval != NULL) {
+        FILE *in = strcmp(bval, "-") ? fopen(bval, "r") : stdin;
+        if (in == NULL) {
+            fprintf(stderr, "Failed to open file: %s\n", bval);
+
+            ret = EXIT_FAILURE;
+        } else if (cval != NULL) {
+            fprintf(stderr, "-b can't be combined with -C, batches are looked up locally\n");
+
+            ret = EXIT_FAILURE;
+        } else {
+            ret = batch_run(&p, db, search_mode, in, stdout, threads > 0 ? threads : 1);
+        }
+
+        if (in != NULL && in != stdin) fclose(in);
+        cache_free(p.entries);
+        cache_free(p.searches);
+        jmdict_close(&p);
+        snapshot_close(p.snap);
+        return ret;
+    }
+
+    if (tval != NULL) {
+        FILE *in = strcmp(tval, "-") ? fopen(tval, "rb") : stdin;
+        if (in == NULL) {
+            fprintf(stderr, "Failed to open file: %s\n", tval);
+
+            ret = EXIT_FAILURE;
+        } else if (cval != NULL) {
+            fprintf(stderr, "-t can't be combined with -C, text is scanned locally\n");
+
+            ret = EXIT_FAILURE;
+        } else {
+            ret = scan_run(&p, in, stdout);
+        }
+
+        if (in != NULL && in != stdin) fclose(in);
+        jmdict_close(&p);
+        snapshot_close(p.snap);
+        return ret;
+    }
+
     if (argc - optind <= 0) {
         fprintf(stderr, "No search query provided, aborting!\n");
 
@@ -133,420 +310,370 @@ int main(int argc, char **argv)
         }
     }
 
-    if (p.verbose) printf("Searching for \"%s\"...\n", arg);
-
-    int *seqnums = calloc((size_t)p.limit, sizeof(int));
-    int count = -1;
+    // the other formats are for tools, nothing but entries goes between them
+    if (p.verbose && p.format == OUTPUT_TEXT) printf("Searching for \"%s\"...\n", arg);
 
-    // TODO change these into iterators that take print_kanji_info as an argument,
-    //      this means we don't have to store seqnums
-    // ALTERNATIVELY
-    //      also combine queries so we don't have to query jmdict_kanji and jmdict_reading twice
-    if (search_mode == SEARCH_AUTO) {
-        count = jmdict_search_kanji(&p, arg, seqnums);
-        if (count <= 0) {
-            if (p.verbose) {
-                fprintf(stderr, "No kanji results, trying reading...\n");
-            }
-            count = jmdict_search_reading(&p, arg, seqnums);
+    int count = cval != NULL
+        ? client_lookup(&p, cval, search_mode, arg, stdout)
+        : jdic_lookup(&p, search_mode, arg, stdout);
+    if (count == 0) {
+        switch (search_mode) {
+            case SEARCH_KANJI:
+                fprintf(stderr, "No kanji results found...\n");
+                break;
+            case SEARCH_READING:
+                fprintf(stderr, "No reading results found...\n");
+                break;
+            case SEARCH_DEFINITION:
+                fprintf(stderr, "No definition results found...\n");
+                break;
+            case SEARCH_FUZZY:
+                fprintf(stderr, "No readings found within %i edit(s)...\n", p.distance);
+                break;
+            default:
+                fprintf(stderr, "No results found...\n");
+                break;
         }
+    } else if (count > 0 && p.verbose && p.format == OUTPUT_TEXT) {
+        printf("Found %i match(es)\n", count);
+    }
 
-        if (count <= 0) {
-            if (p.verbose) {
-                fprintf(stderr, "No reading results found either! aborting...\n");
-            }
-            fprintf(stderr, "No results found...\n");
+    jmdict_close(&p);
+    snapshot_close(p.snap);
 
-            goto cleanup;
-        }
-    } else if (search_mode == SEARCH_KANJI) {
-        count = jmdict_search_kanji(&p, arg, seqnums);
-        if (count <= 0) {
-            fprintf(stderr, "No kanji results found...\n");
+    free(arg);
+    return ret;
+}
 
-            goto cleanup;
-        }
-    } else if (search_mode == SEARCH_READING) {
-        count = jmdict_search_reading(&p, arg, seqnums);
-        if (count <= 0) {
-            fprintf(stderr, "No reading results found...\n");
+// results of a kanji or reading search, as cached
+typedef struct {
+    int count;
+    int seqnums[];
+} cached_search_t;
 
-            goto cleanup;
-        }
+// looks up the results of a database search in the cache before searching
+static int cached_search(jdic_t *p, int kind, int (*search)(jdic_t *, const char *, int *), const char *query, int *a)
+{
+    if (p->searches == NULL) {
+        return search(p, query, a);
     }
 
-    if (count > 0) {
-        for (int i = 0; i < count; i++) {
-            print_kanji_info(&p, seqnums[i]);
-        }
-        if (p.verbose) printf("Found %i match(es)\n", count);
+    // the results depend on nothing but these and the query
+    int head[] = { kind, p->limit, p->page, p->after };
+    size_t len = strlen(query);
+    char *key = arena_alloc(&p->arena, sizeof(head) + len);
+    if (key == NULL) {
+        return search(p, query, a);
     }
+    memcpy(key, head, sizeof(head));
+    memcpy(key + sizeof(head), query, len);
 
-cleanup:
-    sqlite3_close(p.db);
+    int count;
+    cache_item_t *it = cache_get(p->searches, key, sizeof(head) + len);
+    if (it != NULL) {
+        const cached_search_t *r = cache_value(it);
 
-    free(seqnums);
-    free(arg);
-    return ret;
-}
+        count = r->count;
+        memcpy(a, r->seqnums, (size_t)count * sizeof(int));
+    } else {
+        count = search(p, query, a);
 
-typedef struct {
-    int id;
-    char lang[4];
-    char type[5];
-    char *text;
-    char *info;
-    char *misc;
-} definition_t;
+        cached_search_t *r = malloc(sizeof(cached_search_t) + (size_t)count * sizeof(int));
+        if (r != NULL) {
+            r->count = count;
+            memcpy(r->seqnums, a, (size_t)count * sizeof(int));
 
-typedef struct {
-    char *kanji;
-    char *tags;
-    char *reading;
-    bool true_reading;
-} kanji_t;
+            it = cache_put(p->searches, key, sizeof(head) + len, r);
+            if (it == NULL) {
+                free(r);
+            }
+        }
+    }
+
+    if (it != NULL) {
+        cache_release(p->searches, it);
+    }
 
-static long long mstime()
+    return count;
+}
+
+static int search_kanji(jdic_t *p, const char *query, int *a)
 {
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    long long s1 = (long long)(time.tv_sec) * 1000;
-    long long s2 = (time.tv_usec / 1000);
-    return s1 + s2;
+    return p->snap != NULL ? snapshot_search_kanji(p, query, a) : cached_search(p, 'k', jmdict_search_kanji, query, a);
 }
 
-// TODO swap count queries for dynamic arrays
-void print_kanji_info(jdic_t *p, int seqnum)
+static int search_reading(jdic_t *p, const char *query, int *a)
 {
-    struct sqlite3_stmt *st = NULL;
-    int nkanji = 0;
-    kanji_t *kanji = NULL;
+    return p->snap != NULL ? snapshot_search_reading(p, query, a) : cached_search(p, 'r', jmdict_search_reading, query, a);
+}
 
-    if (p->verbose >= 2) {
-        printf("[%i] ", seqnum);
+// anything cached is stale once another connection has updated the database
+static void check_caches(jdic_t *p)
+{
+    if (p->entries == NULL || p->db == NULL) {
+        return;
     }
 
-    long long then = mstime();
+    int version = jmdict_data_version(p);
+    if (version == p->data_version) {
+        return;
+    }
 
-    // TODO replace with dynamic array
-    {
-        const char *sql =
-            "SELECT count(*) "
-            "FROM ("
-                "SELECT * FROM jmdict_kanji WHERE seqnum = ?"
-            ") k "
-                "LEFT JOIN jmdict_reading_for f ON f.kanji = k.id "
-                "LEFT JOIN jmdict_reading r ON r.id = f.reading OR ("
-                    "r.seqnum = k.seqnum AND NOT EXISTS("
-                        "SELECT * FROM jmdict_reading_for WHERE kanji = k.id"
-                    ")"
-                ")";
-        sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, seqnum);
-
-        int ec = sqlite3_step(st);
-        if (ec == SQLITE_ROW) {
-            nkanji = sqlite3_column_int(st, 0);
-        } else if (ec != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to get kanji count\n");
-
-            goto cleanup;
+    if (p->data_version != 0) {
+        if (p->trace) {
+            fprintf(stderr, "Database changed, clearing caches\n");
         }
-
-        sqlite3_finalize(st);
-        st = NULL;
+        cache_clear(p->entries);
+        cache_clear(p->searches);
     }
+    p->data_version = version;
+}
 
-    if (nkanji == 0) {
-        {
-            const char *sql = "SELECT count(*) FROM jmdict_reading WHERE seqnum = ?";
-            sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, seqnum);
+void jdic_cache_report(jdic_t *p, FILE *out)
+{
+    if (p->entries != NULL) {
+        cache_report(p->entries, "Entry", out);
+        cache_report(p->searches, "Search", out);
+    }
+}
 
-            int ec = sqlite3_step(st);
-            if (ec == SQLITE_ROW) {
-                nkanji = sqlite3_column_int(st, 0);
-            } else if (ec != SQLITE_DONE) {
-                fprintf(stderr, "ERR! Failed to get kanji count\n");
+// look up query and print the entries found to out, returns the number of
+// entries found or -1 if something went wrong. Everything the lookup needs
+// on the way comes from p->arena, and is taken back at once when it's done.
+int jdic_lookup(jdic_t *p, search_mode_t mode, const char *text, FILE *out)
+{
+    int *seqnums = arena_calloc(&p->arena, (size_t)p->limit, sizeof(int));
+    size_t len = strlen(text);
+    size_t size = ROMAJI_KANA_SIZE(len);
+    char *query = arena_alloc(&p->arena, NORMALIZE_SIZE(len));
+    char *kana = arena_alloc(&p->arena, size);
+    int count = 0;
+
+    if (seqnums == NULL || query == NULL || kana == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for results\n");
+
+        arena_reset(&p->arena);
+        return -1;
+    }
 
-                goto cleanup;
-            }
+    check_caches(p);
 
-            sqlite3_finalize(st);
-            st = NULL;
-        }
+    // the index only has normalized texts
+    normalize(text, query);
 
-        kanji = calloc((size_t)nkanji, sizeof(kanji_t));
+    // readings are searched in kana, whether or not the query was in romaji,
+    // romaji in capitals becomes katakana which has to be normalized again
+    const char *reading = query;
+    if (!romaji_to_kana(query, kana, size)) {
+        normalize(kana, kana);
+        reading = kana;
+    }
 
-        {
-            const char *sql = "SELECT text FROM jmdict_reading WHERE seqnum = ?";
-            sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, seqnum);
+    // TODO change these into iterators that take print_entries as an argument,
+    //      this means we don't have to store seqnums
+    // kanji and reading results come in seqnum order and can be paged with p->after
+    int ordered = 1;
 
-            int ec = SQLITE_FAIL;
-            for (int i = 0; (ec = sqlite3_step(st)) == SQLITE_ROW; i++) {
-                kanji_t *k = &kanji[i];
+    if (mode == SEARCH_AUTO) {
+        count = search_kanji(p, query, seqnums);
+        if (count <= 0) {
+            if (p->trace) {
+                fprintf(stderr, "No kanji results, trying reading...\n");
+            }
+            count = search_reading(p, query, seqnums);
+        }
 
-                k->reading = strdup((const char *)sqlite3_column_text(st, 0));
-                k->true_reading = false;
+        if (count <= 0) {
+            if (p->trace) {
+                fprintf(stderr, "No reading results, trying deinflections...\n");
+            }
+            count = search_deinflected(p, query, seqnums);
+            ordered = 0;
+        }
 
-                if (i == 0) {
-                    printf("%s\n", k->reading);
-                }
+        if (count <= 0) {
+            if (p->trace) {
+                fprintf(stderr, "No deinflected results, trying definitions...\n");
             }
-            if (ec != SQLITE_DONE) {
-                fprintf(stderr, "ERR! Failed to parse all readings: %i\n", ec);
+            count = search_definition(p, query, seqnums);
+            ordered = 0;
+        }
 
-                goto cleanup;
+        // romaji last, plenty of English words are valid romaji too
+        if (count <= 0 && reading != query) {
+            if (p->trace) {
+                fprintf(stderr, "No definition results, trying reading as romaji...\n");
             }
+            count = search_reading(p, reading, seqnums);
+            ordered = 1;
 
-            sqlite3_finalize(st);
-            st = NULL;
-        }
-    } else {
-        kanji = calloc((size_t)nkanji, sizeof(kanji_t));
-
-        const char *sql =
-            "SELECT k.text, r.text, r.truereading, group_concat(t.text, ', ') "
-            "FROM ("
-                "SELECT * FROM jmdict_kanji WHERE seqnum = ?"
-            ") k "
-                "LEFT JOIN jmdict_kanji_tag t ON t.kanji = k.id "
-                "LEFT JOIN jmdict_reading_for f ON f.kanji = k.id "
-                "LEFT JOIN jmdict_reading r ON r.id = f.reading OR ("
-                    "r.seqnum = k.seqnum AND NOT EXISTS("
-                        "SELECT * FROM jmdict_reading_for WHERE kanji = k.id"
-                    ")"
-                ") "
-            "GROUP BY k.id, r.id";
-
-        sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, seqnum);
-
-        int ec = SQLITE_FAIL;
-        for (int i = 0; (ec = sqlite3_step(st)) == SQLITE_ROW; i++) {
-            kanji_t *k = &kanji[i];
-
-            k->kanji = strdup((const char *)sqlite3_column_text(st, 0));
-            k->reading = strdup((const char *)sqlite3_column_text(st, 1));
-            k->true_reading = sqlite3_column_int(st, 2);
-            const char *tags = (const char *)sqlite3_column_text(st, 3);
-            if (tags != NULL) k->tags = strdup(tags);
-
-            if (i == 0) {
-                if (k->true_reading) {
-                    printf("%s【%s】\n", k->kanji, k->reading);
-                } else {
-                    printf("%s\n", k->reading);
-                }
+            if (count <= 0) {
+                count = search_deinflected(p, reading, seqnums);
+                ordered = 0;
             }
         }
-        if (ec != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to parse all kanji: %i\n", ec);
 
-            goto cleanup;
+        if (count <= 0 && p->trace) {
+            fprintf(stderr, "No definition results found either! aborting...\n");
         }
+    } else if (mode == SEARCH_KANJI) {
+        count = search_kanji(p, query, seqnums);
+    } else if (mode == SEARCH_READING) {
+        count = search_reading(p, reading, seqnums);
+    } else if (mode == SEARCH_DEFINITION) {
+        count = search_definition(p, query, seqnums);
+        ordered = 0;
+    } else if (mode == SEARCH_FUZZY) {
+        count = search_fuzzy(p, reading, seqnums);
+        ordered = 0;
+    }
 
-        sqlite3_finalize(st);
-        st = NULL;
+    if (count > 0 && print_entries(p, text, seqnums, count, out)) {
+        count = -1;
     }
 
-    if (p->verbose >= 3) {
-        printf("     kanji query time = %llims\n", mstime() - then);
-        then = mstime();
+    if (ordered && count == p->limit && p->verbose && p->format == OUTPUT_TEXT) {
+        fprintf(out, "More results after -a %i\n", seqnums[count - 1]);
     }
 
-    {
-        {
-            const char *sql =
-#if !FAST
-                "SELECT g.sense, g.type, g.text, group_concat(i.text, ', '), group_concat(m.text, ', ') "
-#else
-                "SELECT g.sense, g.type, g.text, group_concat(i.text, ', ') "
-#endif
-                "FROM (SELECT * FROM jmdict_sense_gloss WHERE seqnum = ? AND lang = ?) g "
-                    "LEFT JOIN jmdict_sense_info i ON i.seqnum = g.seqnum AND i.sense = g.sense "
-#if !FAST
-                    // FIXME for some reason this join slows down the query by a LOT (~50ms, 2x slower)
-                    "LEFT JOIN jmdict_sense_misc m ON m.seqnum = g.seqnum AND m.sense = g.sense "
-#endif
-                "GROUP BY g.id, g.sense";
-            sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, seqnum);
-            sqlite3_bind_text(st, 2, p->lang, 3, SQLITE_TRANSIENT);
-        }
+    arena_reset(&p->arena);
+    return count;
+}
 
-        struct sqlite3_stmt *st2 = NULL;
-        struct sqlite3_stmt *st3 = NULL;
-        int xrefid = 0;
-        const char *xrefstr = NULL;
-        char *lastinfo = NULL;
-
-        if (p->fast < 1) {
-            // FIXME both of these queries are REALLY slow for some reason...
-            //       Could possibly combine them into a single query?
-            {
-                const char *sql =
-                    "SELECT sense, group_concat(text, ', ') "
-                    "FROM jmdict_sense_pos WHERE seqnum = ? "
-                    "GROUP BY sense";
-                sqlite3_prepare_v2(p->db, sql, -1, &st2, NULL);
-                sqlite3_bind_int(st2, 1, seqnum);
-            }
+static int search_definition(jdic_t *p, const char *query, int *a)
+{
+    if (p->snap != NULL) {
+        return snapshot_search_definition(p, query, a);
+    }
 
-            {
-                const char *sql =
-                    "SELECT sense, group_concat(text, ', ') "
-                    "FROM jmdict_sense_xref WHERE seqnum = ? "
-                    "GROUP BY sense";
-                sqlite3_prepare_v2(p->db, sql, -1, &st3, NULL);
-                sqlite3_bind_int(st3, 1, seqnum);
+    return jmdict_search_definition(p, query, a);
+}
 
-                int ec = sqlite3_step(st3);
-                if (ec != SQLITE_ROW && ec != SQLITE_DONE) {
-                    fprintf(stderr, "ERR! Failed to get xref: %i\n", ec);
+static int search_fuzzy(jdic_t *p, const char *query, int *a)
+{
+    return p->snap != NULL ? snapshot_search_fuzzy(p, query, a) : jmdict_search_fuzzy(p, query, a);
+}
 
-                    goto d_cleanup;
-                }
+static int search_deinflected(jdic_t *p, const char *query, int *a)
+{
+    return p->snap != NULL ? snapshot_search_deinflected(p, query, a) : jmdict_search_deinflected(p, query, a);
+}
 
-                xrefid = sqlite3_column_int(st3, 0);
-                xrefstr = (const char *)sqlite3_column_text(st3, 1);
-            }
-        }
+static void entry_free(void *e)
+{
+    jmdict_entry_free(e);
+    free(e);
+}
 
-        if (p->verbose >= 3) {
-            printf("       def query time = %llims\n", mstime() - then);
-        }
+// everything that changes what is fetched for an entry
+typedef struct {
+    int seqnum;
+    int fast;
+    char lang[4];
+} entry_key_t;
 
-        int lastid = 0;
-        int ec = SQLITE_FAIL;
-        for (int i = 0; (ec = sqlite3_step(st)) == SQLITE_ROW; i++) {
-            definition_t def = {
-                .id = sqlite3_column_int(st, 0),
-                .text = (char *)sqlite3_column_text(st, 2),
-                .info = (char *)sqlite3_column_text(st, 3),
-                .misc = (char *)sqlite3_column_text(st, 4),
-            };
-            const char *type = (const char *)sqlite3_column_text(st, 1);
-            if (type != NULL) strcpy(def.type, type);
-
-            if (lastinfo != NULL) free(lastinfo);
-            if (def.info != NULL) lastinfo = strdup(def.info);
-            else lastinfo = NULL;
-
-            if (def.id != lastid) {
-                if (i > 0) {
-                    if (lastinfo != NULL) printf("       %s.\n", lastinfo);
-
-                    if (p->fast < 1 && xrefid == lastid) {
-                        if (xrefstr != NULL) printf("       See also %s\n", xrefstr);
-                        xrefid = 0;
-                        xrefstr = NULL;
-
-                        int ec2 = sqlite3_step(st3);
-                        if (ec2 == SQLITE_ROW) {
-                            xrefid = sqlite3_column_int(st3, 0);
-                            xrefstr = (const char *)sqlite3_column_text(st3, 1);
-                        } else if (ec2 != SQLITE_DONE) {
-                            fprintf(stderr, "ERR! Failed to get xref: %i\n", ec2);
-                        }
-                    }
-
-                    putchar('\n');
-                }
+// fetches the entries of the database that aren't cached yet, and caches
+// them. items[i] gets a reference to entry i if it's cached, entries[i] is
+// only filled in when it couldn't be.
+static int fetch_cached(jdic_t *p, const int *seqnums, int count, jmdict_entry_t *entries, cache_item_t **items)
+{
+    entry_key_t *keys = arena_calloc(&p->arena, (size_t)count, sizeof(entry_key_t));
+    int *missing = arena_alloc(&p->arena, (size_t)count * sizeof(int));
+    int *where = arena_alloc(&p->arena, (size_t)count * sizeof(int));
+    jmdict_entry_t *fetched = arena_calloc(&p->arena, (size_t)count, sizeof(jmdict_entry_t));
+    int n = 0;
 
-                if (p->fast < 1) {
-                    int ec2 = sqlite3_step(st2);
-                    if (ec2 == SQLITE_ROW) {
-                        printf("    %s.", sqlite3_column_text(st2, 1));
-                    } else if (ec2 != SQLITE_DONE) {
-                        fprintf(stderr, "ERR! Failed to get part of speech: %i\n", ec2);
-                    }
-                } else {
-                    printf("    ");
-                }
+    if (keys == NULL || missing == NULL || where == NULL || fetched == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for entries\n");
 
-                if (def.misc != NULL) printf(" %s", def.misc);
-                putchar('\n');
+        return 1;
+    }
 
-                printf("    %2i) %s\n", def.id, def.text);
-            } else {
-                printf("        %s\n", def.text);
-            }
-            lastid = def.id;
-        }
-        if (ec != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to parse all definitions: %i\n", ec);
-            goto d_cleanup;
-        }
-        if (lastinfo != NULL) {
-            printf("       %s.\n", lastinfo);
-            free(lastinfo);
+    for (int i = 0; i < count; i++) {
+        keys[i].seqnum = seqnums[i];
+        keys[i].fast = p->fast > 0;
+        memcpy(keys[i].lang, p->lang, sizeof(keys[i].lang));
+
+        items[i] = cache_get(p->entries, &keys[i], sizeof(entry_key_t));
+        if (items[i] == NULL) {
+            missing[n] = seqnums[i];
+            where[n++] = i;
         }
+    }
 
-        if (p->fast < 1 && xrefstr != NULL && xrefid == lastid) {
-            printf("       See also %s\n", xrefstr);
+    // cached entries outlive the lookup, so they can't come from the arena
+    if (n > 0 && jmdict_fetch_entries(p, missing, n, p->lang, fetched, NULL)) {
+        for (int i = 0; i < count; i++) {
+            if (items[i] != NULL) {
+                cache_release(p->entries, items[i]);
+                items[i] = NULL;
+            }
         }
 
-    d_cleanup:
-        sqlite3_finalize(st);
-        if (st2 != NULL) sqlite3_finalize(st2);
-        if (st3 != NULL) sqlite3_finalize(st3);
-        st = NULL;
+        return 1;
     }
 
-    if (p->verbose >= 3) {
-        printf("definition query time = %llims\n", mstime() - then);
+    for (int j = 0; j < n; j++) {
+        int i = where[j];
+        jmdict_entry_t *e = malloc(sizeof(jmdict_entry_t));
+
+        if (e != NULL) {
+            *e = fetched[j];
+            items[i] = cache_put(p->entries, &keys[i], sizeof(entry_key_t), e);
+        }
+        if (items[i] == NULL) {
+            entries[i] = fetched[j];
+            free(e);
+        }
     }
 
-    if (nkanji > 1) {
-        printf("\n    Other forms:\n        ");
-        for (int i = 1; i < nkanji; i++) {
-            kanji_t *k = &kanji[i];
+    return 0;
+}
 
-            if (k->true_reading) {
-                printf("%s【%s】", k->kanji, k->reading);
-            } else {
-                printf("%s", k->reading);
-            }
+// entries and everything in them come from p->arena, except the ones that
+// go through the cache, and so does the buffer they are formatted into
+int print_entries(jdic_t *p, const char *query, const int *seqnums, int count, FILE *out)
+{
+    output_t *o = arena_alloc(&p->arena, sizeof(output_t));
+    jmdict_entry_t *entries = arena_calloc(&p->arena, (size_t)count, sizeof(jmdict_entry_t));
+    cache_item_t **items = arena_calloc(&p->arena, (size_t)count, sizeof(cache_item_t *));
+    if (o == NULL || entries == NULL || items == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for entries\n");
 
-            if (i != nkanji-1) {
-                printf("、");
-            }
-        }
-        putchar('\n');
+        return 1;
     }
 
-    if (nkanji > 0) {
-        bool first = true;
-        for (int i = 0; i < nkanji; i++) {
-            kanji_t *k = &kanji[i];
-
-            if (k->tags != NULL) {
-                if (first) {
-                    printf("\n    Notes\n");
-                    first = false;
-                }
+    long long then = ustime();
 
-                printf("        %s: %s\n", k->kanji, k->tags);
-            }
-        }
+    int ec;
+    if (p->snap != NULL) {
+        ec = snapshot_fetch_entries(p, seqnums, count, p->lang, entries, &p->arena);
+    } else if (p->entries != NULL) {
+        ec = fetch_cached(p, seqnums, count, entries, items);
+    } else {
+        ec = jmdict_fetch_entries(p, seqnums, count, p->lang, entries, &p->arena);
+    }
+    if (ec) {
+        return 1;
     }
 
-    putchar('\n');
+    if (p->verbose >= 3 && p->format == OUTPUT_TEXT) {
+        fprintf(out, "entry query time = %llius (%i entries)\n", ustime() - then, count);
+    }
 
-cleanup:
-    if (st != NULL) sqlite3_finalize(st);
-    if (kanji != NULL) {
-        for (int i = 0; i < nkanji; i++) {
-            kanji_t *k = &kanji[i];
+    output_init(o, out);
+    for (int i = 0; i < count; i++) {
+        const jmdict_entry_t *e = items[i] != NULL ? cache_value(items[i]) : &entries[i];
 
-            if (k->kanji != NULL) free(k->kanji);
-            if (k->reading != NULL) free(k->reading);
-            if (k->tags != NULL) free(k->tags);
+        output_entry(o, p, query, e);
+        if (items[i] != NULL) {
+            cache_release(p->entries, items[i]);
+        } else {
+            jmdict_entry_free(&entries[i]);
         }
-        free(kanji);
-    };
+    }
+
+    return output_flush(o);
 }
 
 
@@ -558,12 +685,27 @@ void usage(const char *fn)
             "\t-v\t\tEnable verbose output\n"
             "\t-f\t\tOmit extra info for faster output\n"
             "\t-k\t\tSearch kanji\n"
-            "\t-r\t\tSearch reading (kana)\n"
+            "\t-r\t\tSearch reading (kana or romaji, katakana and hiragana match alike)\n"
+            "\t-e\t\tSearch definitions, words ending in * match as a prefix\n"
+            "\t-z <edits>\tSearch readings within a number of edits, closest first\n"
             "\t-d <db.sqlite>\tUse specified database\n"
             "\t-i <file>\tImport dictionary file\n"
+            "\t-S\t\tImport on a single thread\n"
+            "\t-B\t\tBulk import, faster but not crash safe\n"
+            "\t-u\t\tOnly write entries that changed since the last import\n"
+            "\t-x <file>\tExport the database to a snapshot file\n"
+            "\t-s <file>\tLook up entries in a snapshot file instead of the database\n"
+            "\t-L <socket>\tServe lookups on a unix socket\n"
+            "\t-C <socket>\tLook up entries through a server listening on a unix socket\n"
+            "\t-b <file>\tLook up every line of a file, - reads from stdin\n"
+            "\t-t <file>\tSplit the text in a file into the longest dictionary forms, - reads from stdin\n"
+            "\t-j <threads>\tNumber of threads serving lookups, defaults to the number of CPUs\n"
+            "\t-c <entries>\tNumber of entries and search results to cache when serving or in batches, defaults to %i, 0 disables\n"
             "\t-m <max>\tMaximum number of entries to display, defaults to 4\n"
-            "\t-p <page>\tPage number to display\n",
-            fn
+            "\t-p <page>\tPage number to display\n"
+            "\t-a <seqnum>\tOnly display kanji and reading results after this entry\n"
+            "\t-o <format>\tPrint entries as text (the default), json (one object per line) or tsv\n",
+            fn, CACHE_SIZE
     );
 }
 
@@ -1,20 +1,69 @@
 #ifndef __JDIC_H__
 #define __JDIC_H__
 
+#include <stdio.h>
 #include <sqlite3.h>
 
+#include "arena.h"
+
 #ifndef FAST
 #define FAST false
 #endif
 
+// number of lookup statements kept prepared per connection
+#define STMT_CACHE_SIZE 16
+
+typedef enum {
+    SEARCH_AUTO = 0,
+    SEARCH_KANJI,
+    SEARCH_READING,
+    SEARCH_BOTH,
+    SEARCH_DEFINITION,
+    SEARCH_FUZZY,
+} search_mode_t;
+
+typedef enum {
+    OUTPUT_TEXT = 0,
+    OUTPUT_JSON,
+    OUTPUT_TSV,
+} output_format_t;
+
 typedef struct {
     int verbose;
+    // verbosity of what a lookup prints to stderr, the same as verbose
+    // except in the lookups a server does for its clients
+    int trace;
     int fast;
+    int serial;
+    int bulk;
+    int update;
     sqlite3 *db;
+    // most recently used first
+    sqlite3_stmt *stmts[STMT_CACHE_SIZE];
+    // set when looking up entries in a snapshot instead of the database
+    struct snapshot *snap;
 
     char lang[4];
     int page;
     int limit;
+    // kanji and reading searches only return entries with a higher seqnum,
+    // paging by the last seqnum seen doesn't rescan the earlier pages
+    int after;
+    // edits allowed between the query and a reading in fuzzy searches
+    int distance;
+    output_format_t format;
+
+    // shared by every thread looking up entries in the database, NULL when
+    // not caching: entries by seqnum, kanji and reading results by query
+    struct cache *entries;
+    struct cache *searches;
+    // PRAGMA data_version of db when the caches were last checked, 0 before that
+    int data_version;
+    // everything a lookup allocates, reset once it's done
+    arena_t arena;
 } jdic_t;
 
+int jdic_lookup(jdic_t *, search_mode_t, const char *, FILE *);
+void jdic_cache_report(jdic_t *, FILE *);
+
 #endif // __JDIC_H__
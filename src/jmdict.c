@@ -1,658 +1,2504 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sqlite3.h>
 #include <expat.h>
+#include "array.h"
+#include "decompress.h"
+#include "queue.h"
 #include "util.h"
+#include "fuzzy.h"
+#include "deinflect.h"
+#include "normalize.h"
 #include "jmdict.h"
 
 // xml file read buffer size
 #define XMLBUFSIZ 1 << 15
-// commit sqlite db every X entries
+// size of the chunks of a mapped xml file passed to the parser at once
+#define MMAPCHUNKSIZ ((size_t)1 << 24)
+// commit sqlite db every X entries or Y bytes of text, whichever comes first
 #define COMMIT_FREQ 50000
+#define COMMIT_BYTES (1 << 26)
+// same, but for bulk imports where there is no journal to keep small
+#define BULK_COMMIT_FREQ 500000
+#define BULK_COMMIT_BYTES (1 << 28)
+// number of entries handed to the writer at once
+#define BATCH_ENTRIES 256
+// number of rows written by a single multi-row INSERT
+#define MULTI_ROWS 32
+// number of entries fetched by a single set of queries
+#define FETCH_BATCH 256
+
+// statements used during import, prepared once per jmdict_import run
+typedef enum {
+    ST_BEGIN = 0,
+    ST_COMMIT,
+    ST_ROLLBACK,
+    // everything from here on is an INSERT
+    ST_KANJI,
+    ST_READING,
+    ST_KANJI_TAG,
+    ST_READING_TAG,
+    ST_READING_FOR,
+    ST_GLOSS,
+    ST_POS,
+    ST_XREF,
+    ST_INFO,
+    ST_MISC,
+    ST_ENTRY,
+    ST_COUNT,
+} import_stmt_t;
+
+#define ST_FIRST_INSERT ST_KANJI
+
+// kanji and reading ids are assigned by the importer, so rows referencing
+// them never have to ask SQLite for the id of the row they belong to
+static const char *import_sql[ST_COUNT] = {
+    [ST_BEGIN] = "BEGIN",
+    [ST_COMMIT] = "COMMIT",
+    [ST_ROLLBACK] = "ROLLBACK",
+    [ST_KANJI] = "INSERT INTO jmdict_kanji (id, seqnum, text, norm, rnorm) VALUES (?, ?, ?, ?, ?)",
+    [ST_READING] = "INSERT INTO jmdict_reading (id, seqnum, text, norm, rnorm, truereading) VALUES (?, ?, ?, ?, ?, ?)",
+    [ST_KANJI_TAG] = "INSERT INTO jmdict_kanji_tag (kanji, text) VALUES (?, ?)",
+    [ST_READING_TAG] = "INSERT INTO jmdict_reading_tag (reading, text) VALUES (?, ?)",
+    [ST_GLOSS] =
+        "INSERT INTO jmdict_sense_gloss (seqnum, sense, lang, text, type, gender) "
+        "VALUES (?, ?, ?, ?, ?, ?)",
+    [ST_POS] =
+        "INSERT INTO jmdict_sense_pos (seqnum, sense, text) "
+        "VALUES (?, ?, ?)",
+    [ST_XREF] =
+        "INSERT INTO jmdict_sense_xref (seqnum, sense, text) "
+        "VALUES (?, ?, ?)",
+    [ST_INFO] =
+        "INSERT INTO jmdict_sense_info (seqnum, sense, text) "
+        "VALUES (?, ?, ?)",
+    [ST_MISC] =
+        "INSERT INTO jmdict_sense_misc (seqnum, sense, text) "
+        "VALUES (?, ?, ?)",
+    [ST_READING_FOR] = "INSERT INTO jmdict_reading_for (reading, kanji) VALUES (?, ?)",
+    [ST_ENTRY] = "INSERT OR REPLACE INTO jmdict_entry (seqnum, hash) VALUES (?, ?)",
+};
+
+static const char *import_err[ST_COUNT] = {
+    [ST_KANJI] = "insert kanji",
+    [ST_READING] = "insert reading",
+    [ST_KANJI_TAG] = "insert kanji tag",
+    [ST_READING_TAG] = "insert reading tag",
+    [ST_GLOSS] = "insert glossary",
+    [ST_POS] = "insert pos",
+    [ST_XREF] = "insert xref",
+    [ST_INFO] = "insert s_inf",
+    [ST_MISC] = "insert misc",
+    [ST_READING_FOR] = "insert re_restr",
+    [ST_ENTRY] = "insert entry",
+};
+
+// removes everything belonging to an entry, used when updating
+static const char *delete_sql[] = {
+    "DELETE FROM jmdict_kanji_tag WHERE kanji IN (SELECT id FROM jmdict_kanji WHERE seqnum = ?)",
+    "DELETE FROM jmdict_reading_tag WHERE reading IN (SELECT id FROM jmdict_reading WHERE seqnum = ?)",
+    "DELETE FROM jmdict_reading_for WHERE reading IN (SELECT id FROM jmdict_reading WHERE seqnum = ?)",
+    "DELETE FROM jmdict_kanji WHERE seqnum = ?",
+    "DELETE FROM jmdict_reading WHERE seqnum = ?",
+    "DELETE FROM jmdict_sense_gloss WHERE seqnum = ?",
+    "DELETE FROM jmdict_sense_pos WHERE seqnum = ?",
+    "DELETE FROM jmdict_sense_xref WHERE seqnum = ?",
+    "DELETE FROM jmdict_sense_info WHERE seqnum = ?",
+    "DELETE FROM jmdict_sense_misc WHERE seqnum = ?",
+    "DELETE FROM jmdict_entry WHERE seqnum = ?",
+};
+
+#define NDELETE_SQL (sizeof(delete_sql) / sizeof(*delete_sql))
+
+// elements we store, and the statement their value ends up in
+static const struct {
+    const char *name;
+    import_stmt_t type;
+} import_elements[] = {
+    { "keb", ST_KANJI },
+    { "reb", ST_READING },
+    // these are not of interest to us
+    //{ "ke_pri", ... },
+    //{ "re_pri", ... },
+    { "ke_inf", ST_KANJI_TAG },
+    { "re_inf", ST_READING_TAG },
+    { "gloss", ST_GLOSS },
+    { "pos", ST_POS },
+    { "xref", ST_XREF },
+    { "s_inf", ST_INFO },
+    { "misc", ST_MISC },
+    //{ "lsource", ... },
+    //{ "ant", ... },
+    //{ "dial", ... },
+    //{ "stagk", ... },
+    //{ "stagr", ... },
+    { "re_restr", ST_READING_FOR },
+};
+
+// a single value of an entry, text is stored in the string pool of the
+// batch it belongs to (as offsets, since the pool may be reallocated)
+typedef struct {
+    import_stmt_t type;
+    int seqnum;
+    int sense;
+    int text;
+    // normalized text of kanji and readings and the same reversed, -1 for
+    // everything else
+    int norm;
+    int rnorm;
+    // only used by glosses, -1 when not present
+    int lang;
+    int gtype;
+    int gender;
+    // only used by readings
+    int nokanji;
+
+    // filled in by the writer: the id of a kanji/reading, or the id of the
+    // kanji/reading a tag or re_restr belongs to
+    int id;
+    // kanji id of a re_restr
+    int kanji;
+
+    // only used by entries
+    sqlite3_int64 hash;
+} row_t;
+
+typedef struct {
+    int seqnum;
+    size_t nrows;
+    sqlite3_int64 hash;
+} entry_t;
+
+// an entry already in the database when updating
+typedef struct {
+    int seqnum;
+    int seen;
+    sqlite3_int64 hash;
+} existing_t;
+
+// a number of complete entries, handed from the parser to the writer
+typedef struct {
+    array_t entries;
+    array_t rows;
+    array_t pool;
+} batch_t;
+
+// kanji of the entry currently being written, used to resolve re_restr
+typedef struct {
+    const char *text;
+    int id;
+} kanji_ref_t;
 
 typedef struct {
     int verbose;
     struct sqlite3 *db;
-    XML_Parser parser;
-    int depth;
     int count;
+    atomic_int failed;
 
-    int seqnum;
+    int commit_freq;
+    size_t commit_bytes;
+    // written since the last commit
+    int uncommitted;
+    size_t uncommitted_bytes;
+
+    // last assigned ids
     int kanji_id;
     int reading_id;
+    array_t kanji;
+
+    // only used when updating, existing is sorted by seqnum
+    int update;
+    array_t existing;
+    struct sqlite3_stmt *st_delete[NDELETE_SQL];
+    int added;
+    int changed;
+    int removed;
+
+    struct sqlite3_stmt *st[ST_COUNT];
+    struct sqlite3_stmt *multi[ST_COUNT];
+
+    // rows waiting to be written by a single multi-row INSERT
+    const char *pool;
+    const row_t *pending[ST_COUNT][MULTI_ROWS];
+    int npending[ST_COUNT];
+} writer_t;
+
+// the text of the element being parsed, rarely more than a short gloss
+ARRAY_TYPE(text_buf, XML_Char, 128)
+
+typedef struct {
+    int verbose;
+    XML_Parser parser;
+    int depth;
 
+    int seqnum;
     int sensei;
 
     const XML_Char *cur_tag;
     const XML_Char **cur_atts;
-    XML_Char *cur_val;
-    int cur_val_len;
-    int cur_val_alen;
+    text_buf_t cur_val;
+
+    batch_t *batch;
+    size_t entry_row;
+    // index of the last reading row, for re_nokanji
+    size_t reading_row;
+    writer_t *w;
+    // NULL when importing on a single thread
+    queue_t *queue;
 } userdata_t;
 
-static void XMLCALL startEl(void *p, const XML_Char *name, const XML_Char **atts)
+static batch_t *batch_new(void)
 {
-    userdata_t *d = (userdata_t *)p;
+    batch_t *b = malloc(sizeof(batch_t));
+    if (b == NULL) {
+        return NULL;
+    }
 
-    d->depth++;
+    b->entries = array_new(BATCH_ENTRIES, sizeof(entry_t));
+    b->rows = array_new(BATCH_ENTRIES * 16, sizeof(row_t));
+    b->pool = array_new(BATCH_ENTRIES * 256, sizeof(char));
 
-    if (d->depth == 1 && strcmp(name, "JMdict") != 0) {
-        fprintf(stderr, "Invalid document: root node name does not match\n");
+    if (b->entries.ptr == NULL || b->rows.ptr == NULL || b->pool.ptr == NULL) {
+        array_free(&b->entries, NULL);
+        array_free(&b->rows, NULL);
+        array_free(&b->pool, NULL);
+        free(b);
 
-        XML_StopParser(d->parser, XML_FALSE);
-        return;
+        return NULL;
     }
 
-    if (d->depth == 2 && strcmp(name, "entry") != 0) {
-        fprintf(stderr, "Invalid document: entry node name does not match\n");
+    return b;
+}
 
-        XML_StopParser(d->parser, XML_FALSE);
-        return;
-    }
+static void batch_clear(batch_t *b)
+{
+    b->entries.size = 0;
+    b->rows.size = 0;
+    b->pool.size = 0;
+}
 
-    if (!strcmp(name, "sense")) {
-        d->sensei++;
+static void batch_free(batch_t *b)
+{
+    array_free(&b->entries, NULL);
+    array_free(&b->rows, NULL);
+    array_free(&b->pool, NULL);
+    free(b);
+}
+
+// copy a string into a string pool, returns its offset or -1
+static int pool_str(array_t *pool, const char *s, size_t len)
+{
+    if (!array_reserve(pool, len + 1)) {
+        return -1;
     }
 
-    d->cur_tag = name;
-    d->cur_atts = atts;
+    int off = (int)pool->size;
+    char *dst = ARRAY(pool, char) + off;
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    pool->size += len + 1;
+
+    return off;
 }
 
-static void XMLCALL charHandler(void *p, const XML_Char *s, int len)
+static int batch_str(batch_t *b, const char *s, size_t len)
 {
-    if (*s == '\n') {
-        return;
+    return pool_str(&b->pool, s, len);
+}
+
+// adds the normalized form of the string at off to the pool, returns its offset or -1
+static int batch_norm(batch_t *b, int off)
+{
+    size_t len = strlen(ARRAY((&b->pool), char) + off);
+    if (!array_reserve(&b->pool, NORMALIZE_SIZE(len))) {
+        return -1;
     }
 
-    userdata_t *d = (userdata_t *)p;
+    // the pool may have moved
+    char *pool = ARRAY((&b->pool), char);
+    int norm = (int)b->pool.size;
+    b->pool.size += normalize(pool + off, pool + norm) + 1;
 
-    // accumulate all characters so we don't end up with partial strings
-    // this is a big problem when using smaller buffer sizes, but could
-    // cause problems with any buffer size
-    if (d->cur_val_len + len > d->cur_val_alen) {
-        void *ptr = realloc((void *)d->cur_val, (size_t)(d->cur_val_len + len) * sizeof(XML_Char));
-        if (ptr == NULL) {
-            fprintf(stderr, "Failed to (re)allocate memory for value string\n");
+    return norm;
+}
 
-            XML_StopParser(d->parser, XML_FALSE);
-            return;
-        }
-        d->cur_val = ptr;
-        d->cur_val_alen = d->cur_val_len + len;
+// adds the string at off reversed to the pool, returns its offset or -1
+static int batch_reverse(batch_t *b, int off)
+{
+    size_t len = strlen(ARRAY((&b->pool), char) + off);
+    if (!array_reserve(&b->pool, len + 1)) {
+        return -1;
+    }
 
-        if (d->verbose == 2) {
-            printf("NEW cur_val BUF SIZE = %i\n", d->cur_val_alen);
-        }
+    char *pool = ARRAY((&b->pool), char);
+    int rev = (int)b->pool.size;
+    utf8_reverse(pool + off, len, pool + rev);
+    b->pool.size += len + 1;
+
+    return rev;
+}
+
+static row_t *batch_row(batch_t *b, import_stmt_t type, int seqnum, int sense, const char *s, size_t len)
+{
+    int text = s != NULL ? batch_str(b, s, len) : -1;
+    if ((s != NULL && text < 0) || !array_reserve(&b->rows, 1)) {
+        return NULL;
     }
-    memcpy(d->cur_val+d->cur_val_len, s, (size_t)len);
-    d->cur_val_len += len;
+
+    row_t *r = ARRAY((&b->rows), row_t) + b->rows.size++;
+    *r = (row_t){
+        .type = type,
+        .seqnum = seqnum,
+        .sense = sense,
+        .text = text,
+        .norm = -1,
+        .rnorm = -1,
+        .lang = -1,
+        .gtype = -1,
+        .gender = -1,
+    };
+
+    return r;
 }
 
-static void XMLCALL endEl(void *p, const XML_Char *name)
+// build "INSERT ... VALUES (?, ?), (?, ?), ..." with n value lists
+static char *multi_sql(const char *sql, int n)
 {
-    userdata_t *d = (userdata_t *)p;
-    struct sqlite3_stmt *st = NULL;
+    const char *values = strstr(sql, "(?");
+    size_t head = (size_t)(values - sql);
+    size_t vlen = strlen(values);
 
-    if (!strcmp(name, "entry")) {
-        if (d->verbose) {
-            printf("Inserted entry #%i\n", d->seqnum);
+    char *buf = malloc(head + (vlen + 2) * (size_t)n + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    char *end = buf + head;
+    memcpy(buf, sql, head);
+    for (int i = 0; i < n; i++) {
+        if (i > 0) {
+            *end++ = ',';
+            *end++ = ' ';
         }
+        memcpy(end, values, vlen);
+        end += vlen;
+    }
+    *end = '\0';
 
-        // these are technically not needed since they *should* be overwritten before being used again
-        d->kanji_id = 0;
-        d->reading_id = 0;
-        d->sensei = 0;
-        d->count++;
+    return buf;
+}
 
-        if (d->seqnum % COMMIT_FREQ == 0) {
-            {
-                sqlite3_prepare_v2(d->db, "COMMIT", -1, &st, NULL);
-                int rc = sqlite3_step(st);
-                if (rc != SQLITE_DONE) {
-                    fprintf(stderr, "ERR! Failed to commit database transaction: %i\n", rc);
+static void bind_pool(struct sqlite3_stmt *st, int i, const char *pool, int off)
+{
+    if (off < 0) {
+        sqlite3_bind_null(st, i);
+    } else {
+        sqlite3_bind_text(st, i, pool + off, -1, SQLITE_STATIC);
+    }
+}
 
-                    XML_StopParser(d->parser, XML_FALSE);
-                    goto cleanup;
-                }
+// binds a row starting at parameter i, returns the number of parameters used
+static int bind_row(struct sqlite3_stmt *st, int i, const char *pool, const row_t *r)
+{
+    switch (r->type) {
+        case ST_KANJI:
+            sqlite3_bind_int(st, i, r->id);
+            sqlite3_bind_int(st, i+1, r->seqnum);
+            bind_pool(st, i+2, pool, r->text);
+            bind_pool(st, i+3, pool, r->norm);
+            bind_pool(st, i+4, pool, r->rnorm);
+
+            return 5;
+        case ST_READING:
+            sqlite3_bind_int(st, i, r->id);
+            sqlite3_bind_int(st, i+1, r->seqnum);
+            bind_pool(st, i+2, pool, r->text);
+            bind_pool(st, i+3, pool, r->norm);
+            bind_pool(st, i+4, pool, r->rnorm);
+            sqlite3_bind_int(st, i+5, !r->nokanji);
+
+            return 6;
+        case ST_KANJI_TAG:
+        case ST_READING_TAG:
+            sqlite3_bind_int(st, i, r->id);
+            bind_pool(st, i+1, pool, r->text);
+
+            return 2;
+        case ST_READING_FOR:
+            sqlite3_bind_int(st, i, r->id);
+            sqlite3_bind_int(st, i+1, r->kanji);
+
+            return 2;
+        case ST_GLOSS:
+            sqlite3_bind_int(st, i, r->seqnum);
+            sqlite3_bind_int(st, i+1, r->sense);
+            bind_pool(st, i+2, pool, r->lang);
+            bind_pool(st, i+3, pool, r->text);
+            bind_pool(st, i+4, pool, r->gtype);
+            bind_pool(st, i+5, pool, r->gender);
+
+            return 6;
+        case ST_ENTRY:
+            sqlite3_bind_int(st, i, r->seqnum);
+            sqlite3_bind_int64(st, i+1, r->hash);
+
+            return 2;
+        default:
+            sqlite3_bind_int(st, i, r->seqnum);
+            sqlite3_bind_int(st, i+1, r->sense);
+            bind_pool(st, i+2, pool, r->text);
+
+            return 3;
+    }
+}
 
-                sqlite3_finalize(st);
-                st = NULL;
-            }
-            {
-                sqlite3_prepare_v2(d->db, "BEGIN", -1, &st, NULL);
-                int rc = sqlite3_step(st);
-                if (rc != SQLITE_DONE) {
-                    fprintf(stderr, "ERR! Failed to begin new database transaction: %i\n", rc);
+static int writer_flush(writer_t *w, import_stmt_t type)
+{
+    int n = w->npending[type];
+    w->npending[type] = 0;
 
-                    XML_StopParser(d->parser, XML_FALSE);
-                }
+    if (n == MULTI_ROWS) {
+        struct sqlite3_stmt *st = w->multi[type];
+        int param = 1;
 
-                sqlite3_finalize(st);
-                st = NULL;
-            }
+        for (int i = 0; i < n; i++) {
+            param += bind_row(st, param, w->pool, w->pending[type][i]);
         }
-    } else if (!strcmp(name, "ent_seq")) {
-        d->seqnum = antoi(d->cur_val, (size_t)d->cur_val_len);
-    } else if (!strcmp(name, "keb")) {
-        {
-            const char *sql = "INSERT INTO jmdict_kanji (seqnum, text) VALUES (?, ?)";
-            sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, d->seqnum);
-            sqlite3_bind_text(st, 2, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
-
-            int rc = sqlite3_step(st);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "ERR! Failed to insert kanji: %i\n" , rc);
 
-                XML_StopParser(d->parser, XML_FALSE);
-                goto cleanup;
-            }
+        int rc = sqlite3_step(st);
+        sqlite3_reset(st);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "ERR! Failed to %s: %i\n", import_err[type], rc);
 
-            sqlite3_finalize(st);
-            st = NULL;
+            return 1;
         }
-        {
-            const char *sql = "SELECT last_insert_rowid()";
-            sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
 
-            int rc = sqlite3_step(st);
-            if (rc == SQLITE_ROW) {
-                d->kanji_id = sqlite3_column_int(st, 0);
-            } else {
-                fprintf(stderr, "ERR! Failed to get last row id: %i\n", rc);
+        return 0;
+    }
 
-                XML_StopParser(d->parser, XML_FALSE);
-                goto cleanup;
-            }
+    struct sqlite3_stmt *st = w->st[type];
+    for (int i = 0; i < n; i++) {
+        bind_row(st, 1, w->pool, w->pending[type][i]);
 
-            sqlite3_finalize(st);
-            st = NULL;
-        }
-    } else if (!strcmp(name, "reb")) {
-        {
-            const char *sql = "INSERT INTO jmdict_reading (seqnum, text) VALUES (?, ?)";
-            sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, d->seqnum);
-            sqlite3_bind_text(st, 2, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+        int rc = sqlite3_step(st);
+        sqlite3_reset(st);
+        if (rc != SQLITE_DONE) {
+            fprintf(stderr, "ERR! Failed to %s: %i\n", import_err[type], rc);
 
-            int rc = sqlite3_step(st);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "ERR! Failed to insert kanji: %i\n" , rc);
+            return 1;
+        }
+    }
 
-                XML_StopParser(d->parser, XML_FALSE);
-                goto cleanup;
-            }
+    return 0;
+}
 
-            sqlite3_finalize(st);
-            st = NULL;
+static int writer_flush_all(writer_t *w)
+{
+    for (int i = ST_FIRST_INSERT; i < ST_COUNT; i++) {
+        if (writer_flush(w, (import_stmt_t)i)) {
+            return 1;
         }
-        {
-            const char *sql = "SELECT last_insert_rowid()";
-            sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
+    }
 
-            int rc = sqlite3_step(st);
-            if (rc == SQLITE_ROW) {
-                d->reading_id = sqlite3_column_int(st, 0);
-            } else {
-                fprintf(stderr, "ERR! Failed to get last row id: %i\n", rc);
+    return 0;
+}
 
-                XML_StopParser(d->parser, XML_FALSE);
-                goto cleanup;
-            }
+static int writer_commit(writer_t *w)
+{
+    if (writer_flush_all(w)) {
+        return 1;
+    }
 
-            sqlite3_finalize(st);
-            st = NULL;
-        }
-    // these are not of interest to us
-    //} else if (!strcmp(name, "ke_pri")) {
-    //} else if (!strcmp(name, "re_pri")) {
-    } else if (!strcmp(name, "ke_inf")) {
-        const char *sql = "INSERT INTO jmdict_kanji_tag (kanji, text) VALUES (?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->kanji_id);
-        sqlite3_bind_text(st, 2, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+    int rc = sqlite3_step(w->st[ST_COMMIT]);
+    sqlite3_reset(w->st[ST_COMMIT]);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to commit database transaction: %i\n", rc);
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert kanji tag: %i\n" , rc);
+        return 1;
+    }
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
-        }
+    rc = sqlite3_step(w->st[ST_BEGIN]);
+    sqlite3_reset(w->st[ST_BEGIN]);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to begin new database transaction: %i\n", rc);
 
-        sqlite3_finalize(st);
-        st = NULL;
-    } else if (!strcmp(name, "re_inf")) {
-        const char *sql = "INSERT INTO jmdict_reading_tag (reading, text) VALUES (?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->reading_id);
-        sqlite3_bind_text(st, 2, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+        return 1;
+    }
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert reading tag: %i\n" , rc);
+    w->uncommitted = 0;
+    w->uncommitted_bytes = 0;
+    return 0;
+}
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
-        }
+static int write_row(writer_t *w, row_t *r)
+{
+    const char *text = w->pool + r->text;
 
-        sqlite3_finalize(st);
-        st = NULL;
-    } else if (!strcmp(name, "gloss")) {
-        const XML_Char *lang = "eng";
-        const XML_Char *type = NULL;
-        const XML_Char *gender = NULL;
-        for (int i = 0; d->cur_atts[i]; i += 2) {
-            const XML_Char *att = d->cur_atts[i];
-            const XML_Char *attval = d->cur_atts[i+1];
-
-            if (!strcmp(att, "xml:lang")) {
-                lang = attval;
-            } else if (!strcmp(att, "g_type")) {
-                type = attval;
-            } else if (!strcmp(att, "g_gend")) {
-                gender = attval;
+    switch (r->type) {
+        case ST_KANJI: {
+            r->id = ++w->kanji_id;
+
+            if (!array_reserve(&w->kanji, 1)) {
+                fprintf(stderr, "ERR! Failed to allocate memory for kanji map\n");
+
+                return 1;
             }
+            kanji_ref_t *k = ARRAY((&w->kanji), kanji_ref_t) + w->kanji.size++;
+            k->text = text;
+            k->id = r->id;
+            break;
         }
+        case ST_READING:
+            r->id = ++w->reading_id;
+            break;
+        case ST_KANJI_TAG:
+            r->id = w->kanji_id;
+            break;
+        case ST_READING_TAG:
+            r->id = w->reading_id;
+            break;
+        case ST_READING_FOR: {
+            const kanji_ref_t *kanji = ARRAY((&w->kanji), kanji_ref_t);
+
+            r->id = w->reading_id;
+            r->kanji = 0;
+            for (size_t i = 0; i < w->kanji.size; i++) {
+                if (!strcmp(kanji[i].text, text)) {
+                    r->kanji = kanji[i].id;
+                    break;
+                }
+            }
 
-        const char *sql =
-            "INSERT INTO jmdict_sense_gloss (seqnum, sense, lang, text, type, gender) "
-            "VALUES (?, ?, ?, ?, ?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->seqnum);
-        sqlite3_bind_int(st, 2, d->sensei);
-        sqlite3_bind_text(st, 3, lang, (int)strlen(lang), SQLITE_TRANSIENT);
-        sqlite3_bind_text(st, 4, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
-        if (type != NULL) {
-            sqlite3_bind_text(st, 5, type, (int)strlen(type), SQLITE_TRANSIENT);
-        } else {
-            sqlite3_bind_null(st, 5);
-        }
-        if (gender != NULL) {
-            sqlite3_bind_text(st, 6, gender, (int)strlen(gender), SQLITE_TRANSIENT);
-        } else {
-            sqlite3_bind_null(st, 6);
+            if (r->kanji == 0) {
+                fprintf(stderr, "ERR! Failed to get kanji id: %s (#%i)\n", text, r->seqnum);
+
+                return 1;
+            }
+            break;
         }
+        default:
+            break;
+    }
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert glossary: %i\n" , rc);
+    w->pending[r->type][w->npending[r->type]++] = r;
+    if (w->npending[r->type] == MULTI_ROWS) {
+        return writer_flush(w, r->type);
+    }
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
-        }
+    return 0;
+}
 
-        sqlite3_finalize(st);
-        st = NULL;
-    } else if (!strcmp(name, "pos")) {
-        const char *sql =
-            "INSERT INTO jmdict_sense_pos (seqnum, sense, text) "
-            "VALUES (?, ?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->seqnum);
-        sqlite3_bind_int(st, 2, d->sensei);
-        sqlite3_bind_text(st, 3, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+static int existing_cmp(const void *a, const void *b)
+{
+    return ((const existing_t *)a)->seqnum - ((const existing_t *)b)->seqnum;
+}
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert pos: %i\n" , rc);
+static existing_t *find_existing(writer_t *w, int seqnum)
+{
+    existing_t key = { .seqnum = seqnum };
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
-        }
+    return bsearch(&key, w->existing.ptr, w->existing.size, sizeof(existing_t), existing_cmp);
+}
 
-        sqlite3_finalize(st);
-        st = NULL;
-    } else if (!strcmp(name, "xref")) {
-        const char *sql =
-            "INSERT INTO jmdict_sense_xref (seqnum, sense, text) "
-            "VALUES (?, ?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->seqnum);
-        sqlite3_bind_int(st, 2, d->sensei);
-        sqlite3_bind_text(st, 3, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+static int delete_entry(writer_t *w, int seqnum)
+{
+    for (size_t i = 0; i < NDELETE_SQL; i++) {
+        struct sqlite3_stmt *st = w->st_delete[i];
 
+        sqlite3_bind_int(st, 1, seqnum);
         int rc = sqlite3_step(st);
+        sqlite3_reset(st);
         if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert xref: %i\n" , rc);
+            fprintf(stderr, "ERR! Failed to delete entry #%i: %i\n", seqnum, rc);
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
+            return 1;
         }
+    }
 
-        sqlite3_finalize(st);
-        st = NULL;
-    } else if (!strcmp(name, "s_inf")) {
-        const char *sql =
-            "INSERT INTO jmdict_sense_info (seqnum, sense, text) "
-            "VALUES (?, ?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->seqnum);
-        sqlite3_bind_int(st, 2, d->sensei);
-        sqlite3_bind_text(st, 3, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+    return 0;
+}
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert s_inf: %i\n" , rc);
+// delete every entry that was in the database but not in the imported file
+static int delete_unseen(writer_t *w)
+{
+    existing_t *existing = ARRAY((&w->existing), existing_t);
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
+    for (size_t i = 0; i < w->existing.size; i++) {
+        if (existing[i].seen) {
+            continue;
+        }
+
+        if (delete_entry(w, existing[i].seqnum)) {
+            return 1;
+        }
+        if (w->verbose) {
+            printf("Removed entry #%i\n", existing[i].seqnum);
         }
+        w->removed++;
+    }
 
-        sqlite3_finalize(st);
-        st = NULL;
-    } else if (!strcmp(name, "misc")) {
-        const char *sql =
-            "INSERT INTO jmdict_sense_misc (seqnum, sense, text) "
-            "VALUES (?, ?, ?)";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->seqnum);
-        sqlite3_bind_int(st, 2, d->sensei);
-        sqlite3_bind_text(st, 3, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
+    return 0;
+}
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to insert misc: %i\n" , rc);
+static int write_batch(writer_t *w, batch_t *b)
+{
+    const entry_t *entries = ARRAY((&b->entries), entry_t);
+    row_t *r = ARRAY((&b->rows), row_t);
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
-        }
+    w->pool = ARRAY((&b->pool), char);
 
-        sqlite3_finalize(st);
-        st = NULL;
-    //} else if (!strcmp(name, "lsource")) {
-    //} else if (!strcmp(name, "ant")) {
-    //} else if (!strcmp(name, "dial")) {
-    //} else if (!strcmp(name, "stagk")) {
-    //} else if (!strcmp(name, "stagk")) {
-    } else if (!strcmp(name, "re_restr")) {
-        int kanji_id;
-
-        {
-            const char *sql = "SELECT id FROM jmdict_kanji WHERE seqnum = ? AND text = ?";
-            sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, d->seqnum);
-            sqlite3_bind_text(st, 2, d->cur_val, d->cur_val_len, SQLITE_TRANSIENT);
-
-            int rc = sqlite3_step(st);
-            if (rc == SQLITE_ROW) {
-                kanji_id = sqlite3_column_int(st, 0);
-            } else {
-                fprintf(stderr, "ERR! Failed to get kanji id: %i (#%i)\n", rc, d->seqnum);
+    for (size_t i = 0; i < b->entries.size; i++) {
+        const entry_t *e = &entries[i];
 
-                XML_StopParser(d->parser, XML_FALSE);
-                goto cleanup;
-            }
+        if (w->update) {
+            existing_t *old = find_existing(w, e->seqnum);
 
-            sqlite3_finalize(st);
-            st = NULL;
-        }
-        {
-            const char *sql = "INSERT INTO jmdict_reading_for (reading, kanji) VALUES (?, ?)";
-            sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-            sqlite3_bind_int(st, 1, d->reading_id);
-            sqlite3_bind_int(st, 2, kanji_id);
+            if (old != NULL) {
+                old->seen = 1;
 
-            int rc = sqlite3_step(st);
-            if (rc != SQLITE_DONE) {
-                fprintf(stderr, "ERR! Failed to insert re_restr: %i\n", rc);
+                if (old->hash == e->hash) {
+                    r += e->nrows;
+                    continue;
+                }
 
-                XML_StopParser(d->parser, XML_FALSE);
-                goto cleanup;
+                // pending rows of earlier entries can't belong to this one,
+                // so it is fine to delete before they are flushed
+                if (delete_entry(w, e->seqnum)) {
+                    return 1;
+                }
+                w->changed++;
+            } else {
+                w->added++;
             }
+        }
 
-            sqlite3_finalize(st);
-            st = NULL;
+        w->kanji.size = 0;
+        for (size_t j = 0; j < e->nrows; j++, r++) {
+            if (write_row(w, r)) {
+                return 1;
+            }
         }
-    } else if (!strcmp(name, "re_nokanji")) {
-        const char *sql = "UPDATE jmdict_reading SET truereading = FALSE WHERE id = ?";
-        sqlite3_prepare_v2(d->db, sql, -1, &st, NULL);
-        sqlite3_bind_int(st, 1, d->reading_id);
 
-        int rc = sqlite3_step(st);
-        if (rc != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to set truereading for reading %i: %i\n", d->reading_id, rc);
+        if (w->verbose) {
+            printf("Inserted entry #%i\n", e->seqnum);
+        }
+        w->count++;
 
-            XML_StopParser(d->parser, XML_FALSE);
-            goto cleanup;
+        if (++w->uncommitted >= w->commit_freq && writer_commit(w)) {
+            return 1;
         }
+    }
 
-        sqlite3_finalize(st);
-        st = NULL;
+    // pending rows point into this batch, so they have to be written before it goes away
+    if (writer_flush_all(w)) {
+        return 1;
     }
 
-cleanup:
-    if (st != NULL) {
-        sqlite3_finalize(st);
+    w->uncommitted_bytes += b->pool.size;
+    if (w->uncommitted_bytes >= w->commit_bytes) {
+        return writer_commit(w);
     }
 
-    d->depth--;
-    d->cur_val_len = 0;
+    return 0;
 }
 
-int jmdict_import(jdic_t *p, const char *fn)
+static void *writer_thread(void *p)
 {
-    time_t start = time(NULL);
-    FILE *fp = fopen(fn, "r");
-    if (!fp) {
-        fprintf(stderr, "Failed to open file: %s\n", fn);
+    userdata_t *d = (userdata_t *)p;
+    batch_t *b;
 
-        return 1;
+    // keep draining after a failure so the parser never blocks on a full queue
+    while ((b = queue_pop(d->queue)) != NULL) {
+        if (!atomic_load(&d->w->failed) && write_batch(d->w, b)) {
+            atomic_store(&d->w->failed, 1);
+        }
+        batch_free(b);
     }
 
-    XML_Parser parser = XML_ParserCreate(NULL);
-    if (!parser) {
-        fprintf(stderr, "Could not allocate enough memory for XML parser!\n");
+    return NULL;
+}
 
-        fclose(fp);
-        return 1;
+// hand the current batch to the writer
+static int dispatch_batch(userdata_t *d)
+{
+    if (d->queue == NULL) {
+        int rc = write_batch(d->w, d->batch);
+        batch_clear(d->batch);
+
+        return rc;
     }
 
-    userdata_t userdata = {
-        .verbose = p->verbose,
-        .parser = parser,
-        .db = p->db,
-    };
-    int done = 0;
-    int ret = 0;
-    sqlite3_stmt *st = NULL;
+    queue_push(d->queue, d->batch);
+    d->batch = batch_new();
+    if (d->batch == NULL) {
+        fprintf(stderr, "Failed to allocate memory for entry batch\n");
 
-    XML_SetParamEntityParsing(parser, XML_PARAM_ENTITY_PARSING_ALWAYS);
-    XML_SetUserData(parser, &userdata);
-    XML_SetElementHandler(parser, startEl, endEl);
-    XML_SetCharacterDataHandler(parser, charHandler);
+        return 1;
+    }
 
-    /*
-    sqlite3_prepare_v2(p->db, "PRAGMA foreign_keys = ON", -1, &st, NULL);
-    if (sqlite3_step(st) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to enable foreign keys in SQLite database\n");
+    return atomic_load(&d->w->failed);
+}
 
-        ret = 1;
-        goto cleanup;
+static unsigned long long hash_str(unsigned long long h, const char *pool, int off)
+{
+    // 0xff never appears in UTF-8, so NULL and "" hash differently
+    if (off < 0) {
+        return fnv1a(h, "\xff", 1);
     }
-    sqlite3_finalize(st);
-    */
-    sqlite3_exec(p->db, "PRAGMA read_uncomitted=true", NULL, NULL, NULL);
 
-    sqlite3_prepare_v2(p->db, "BEGIN", -1, &st, NULL);
-    if (sqlite3_step(st) != SQLITE_DONE) {
-        fprintf(stderr, "Failed to BEGIN SQLite transaction\n");
+    const char *s = pool + off;
+    return fnv1a(h, s, strlen(s) + 1);
+}
 
-        ret = 1;
-        goto cleanup;
+// content hash of all rows of an entry, used to find changed entries when updating
+static sqlite3_int64 hash_entry(const batch_t *b, size_t first)
+{
+    const row_t *rows = ARRAY((&b->rows), row_t);
+    const char *pool = ARRAY((&b->pool), char);
+    unsigned long long h = FNV1A_INIT;
+
+    for (size_t i = first; i < b->rows.size; i++) {
+        const row_t *r = &rows[i];
+        int ints[] = { r->type, r->sense, r->nokanji };
+
+        h = fnv1a(h, ints, sizeof(ints));
+        h = hash_str(h, pool, r->text);
+        h = hash_str(h, pool, r->lang);
+        h = hash_str(h, pool, r->gtype);
+        h = hash_str(h, pool, r->gender);
+    }
+
+    return (sqlite3_int64)h;
+}
+
+static void XMLCALL startEl(void *p, const XML_Char *name, const XML_Char **atts)
+{
+    userdata_t *d = (userdata_t *)p;
+
+    d->depth++;
+
+    if (d->depth == 1 && strcmp(name, "JMdict") != 0) {
+        fprintf(stderr, "Invalid document: root node name does not match\n");
+
+        XML_StopParser(d->parser, XML_FALSE);
+        return;
+    }
+
+    if (d->depth == 2 && strcmp(name, "entry") != 0) {
+        fprintf(stderr, "Invalid document: entry node name does not match\n");
+
+        XML_StopParser(d->parser, XML_FALSE);
+        return;
+    }
+
+    if (!strcmp(name, "sense")) {
+        d->sensei++;
+    }
+
+    d->cur_tag = name;
+    d->cur_atts = atts;
+}
+
+static void XMLCALL charHandler(void *p, const XML_Char *s, int len)
+{
+    if (*s == '\n') {
+        return;
+    }
+
+    userdata_t *d = (userdata_t *)p;
+
+    // accumulate all characters so we don't end up with partial strings
+    // this is a big problem when using smaller buffer sizes, but could
+    // cause problems with any buffer size
+    size_t alen = text_buf_capacity(&d->cur_val);
+    if (!text_buf_reserve(&d->cur_val, (size_t)len)) {
+        fprintf(stderr, "Failed to (re)allocate memory for value string\n");
+
+        XML_StopParser(d->parser, XML_FALSE);
+        return;
+    }
+    if (d->verbose == 2 && text_buf_capacity(&d->cur_val) != alen) {
+        printf("NEW cur_val BUF SIZE = %zu\n", text_buf_capacity(&d->cur_val));
+    }
+
+    memcpy(text_buf_data(&d->cur_val) + d->cur_val.size, s, (size_t)len);
+    d->cur_val.size += (size_t)len;
+}
+
+static int add_gloss(userdata_t *d)
+{
+    batch_t *b = d->batch;
+    const XML_Char *lang = "eng";
+    const XML_Char *type = NULL;
+    const XML_Char *gender = NULL;
+    for (int i = 0; d->cur_atts[i]; i += 2) {
+        const XML_Char *att = d->cur_atts[i];
+        const XML_Char *attval = d->cur_atts[i+1];
+
+        if (!strcmp(att, "xml:lang")) {
+            lang = attval;
+        } else if (!strcmp(att, "g_type")) {
+            type = attval;
+        } else if (!strcmp(att, "g_gend")) {
+            gender = attval;
+        }
+    }
+
+    row_t *r = batch_row(b, ST_GLOSS, d->seqnum, d->sensei, text_buf_data(&d->cur_val), d->cur_val.size);
+    if (r == NULL) {
+        return 1;
+    }
+
+    // r stays valid, batch_str only grows the string pool
+    r->lang = batch_str(b, lang, strlen(lang));
+    if (r->lang < 0) {
+        return 1;
+    }
+    if (type != NULL && (r->gtype = batch_str(b, type, strlen(type))) < 0) {
+        return 1;
+    }
+    if (gender != NULL && (r->gender = batch_str(b, gender, strlen(gender))) < 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void XMLCALL endEl(void *p, const XML_Char *name)
+{
+    userdata_t *d = (userdata_t *)p;
+    batch_t *b = d->batch;
+
+    if (!strcmp(name, "entry")) {
+        if (!array_reserve(&b->entries, 1)) {
+            fprintf(stderr, "Failed to allocate memory for entry\n");
+
+            XML_StopParser(d->parser, XML_FALSE);
+            goto cleanup;
+        }
+
+        sqlite3_int64 hash = hash_entry(b, d->entry_row);
+        row_t *r = batch_row(b, ST_ENTRY, d->seqnum, 0, NULL, 0);
+        if (r == NULL) {
+            fprintf(stderr, "Failed to allocate memory for entry\n");
+
+            XML_StopParser(d->parser, XML_FALSE);
+            goto cleanup;
+        }
+        r->hash = hash;
+
+        entry_t *e = ARRAY((&b->entries), entry_t) + b->entries.size++;
+        e->seqnum = d->seqnum;
+        e->nrows = b->rows.size - d->entry_row;
+        e->hash = hash;
+
+        d->entry_row = b->rows.size;
+        d->sensei = 0;
+
+        if (b->entries.size >= BATCH_ENTRIES) {
+            if (dispatch_batch(d)) {
+                XML_StopParser(d->parser, XML_FALSE);
+            }
+            d->entry_row = 0;
+        }
+    } else if (!strcmp(name, "ent_seq")) {
+        d->seqnum = antoi(text_buf_data(&d->cur_val), d->cur_val.size);
+    } else if (!strcmp(name, "re_nokanji")) {
+        if (b->rows.size > d->entry_row) {
+            ARRAY((&b->rows), row_t)[d->reading_row].nokanji = 1;
+        }
+    } else if (!strcmp(name, "gloss")) {
+        if (add_gloss(d)) {
+            fprintf(stderr, "Failed to allocate memory for glossary\n");
+
+            XML_StopParser(d->parser, XML_FALSE);
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(import_elements) / sizeof(*import_elements); i++) {
+            if (strcmp(name, import_elements[i].name) != 0) {
+                continue;
+            }
+
+            import_stmt_t type = import_elements[i].type;
+            row_t *r = batch_row(b, type, d->seqnum, d->sensei, text_buf_data(&d->cur_val), d->cur_val.size);
+            int indexed = type == ST_KANJI || type == ST_READING;
+
+            // r stays valid, batch_norm and batch_reverse only grow the string pool
+            if (r == NULL || (indexed && ((r->norm = batch_norm(b, r->text)) < 0
+                            || (r->rnorm = batch_reverse(b, r->norm)) < 0))) {
+                fprintf(stderr, "Failed to allocate memory for %s\n", name);
+
+                XML_StopParser(d->parser, XML_FALSE);
+            } else if (type == ST_READING) {
+                d->reading_row = b->rows.size - 1;
+            }
+            break;
+        }
+    }
+
+cleanup:
+    d->depth--;
+    d->cur_val.size = 0;
+}
+
+static void parse_error(XML_Parser parser)
+{
+    fprintf(stderr,
+            "Parser error at line %lu:\n%s\n",
+            XML_GetCurrentLineNumber(parser),
+            XML_ErrorString(XML_GetErrorCode(parser)));
+}
+
+// prefix holds the bytes already read from fp to detect compression
+static int parse_stream(XML_Parser parser, FILE *fp, const unsigned char *prefix, size_t nprefix)
+{
+    int done = 0;
+
+    if (nprefix > 0 && XML_Parse(parser, (const char *)prefix, (int)nprefix, XML_FALSE) == XML_STATUS_ERROR) {
+        parse_error(parser);
+
+        return 1;
     }
-    sqlite3_finalize(st);
 
     do {
         void *buf = XML_GetBuffer(parser, XMLBUFSIZ);
         if (!buf) {
             fprintf(stderr, "Could not allocate enough memory for buffer\n");
 
-            ret = 1;
-            break;
+            return 1;
         }
 
         size_t len = fread(buf, 1, XMLBUFSIZ, fp);
         if (ferror(fp)) {
             fprintf(stderr, "Read error\n");
 
-            ret = 1;
-            break;
+            return 1;
         }
 
         done = feof(fp);
         if (XML_ParseBuffer(parser, (int)len, done) == XML_STATUS_ERROR) {
-            fprintf(stderr,
-                    "Parser error at line %lu:\n%s\n",
-                    XML_GetCurrentLineNumber(parser),
-                    XML_ErrorString(XML_GetErrorCode(parser)));
+            parse_error(parser);
+
+            return 1;
+        }
+    } while (!done);
+
+    return 0;
+}
+
+// hands the mapped file to expat in large chunks, which saves copying
+// everything into expat's own buffer first
+static int parse_mmap(XML_Parser parser, FILE *fp, size_t size, const unsigned char *prefix, size_t nprefix)
+{
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        return parse_stream(parser, fp, prefix, nprefix);
+    }
+
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    int ret = 0;
+    for (size_t off = 0; off < size; off += MMAPCHUNKSIZ) {
+        size_t len = size - off < MMAPCHUNKSIZ ? size - off : MMAPCHUNKSIZ;
+        int done = off + len == size;
+
+        if (XML_Parse(parser, map + off, (int)len, done) == XML_STATUS_ERROR) {
+            parse_error(parser);
 
             ret = 1;
             break;
         }
-    } while (!done);
+    }
 
-    sqlite3_prepare_v2(p->db, "COMMIT", -1, &st, NULL);
-    ret = sqlite3_step(st) != SQLITE_DONE;
+    munmap(map, size);
+    return ret;
+}
 
-    time_t taken = time(NULL) - start;
-    time_t min = taken / 60;
-    time_t sec = taken % 60;
-    time_t hour = min / 60;
-    min %= 60;
+static int parse_compressed(XML_Parser parser, FILE *fp, compression_t comp, const unsigned char *prefix, size_t nprefix)
+{
+    decompress_t *dc = decompress_start(fp, comp, prefix, nprefix);
+    if (dc == NULL) {
+        fprintf(stderr, "Failed to start decompressing input\n");
 
-    char tstr[64];
-    if (hour > 0) {
-        sprintf(tstr, "%lih %lim %lis", hour, min, sec);
-    } else if (min > 0) {
-        sprintf(tstr, "%lim %lis", min, sec);
-    } else {
-        sprintf(tstr, "%lis", sec);
+        return 1;
     }
 
-    printf("Imported %i entries in %s\n", userdata.count, tstr);
+    const char *buf = NULL;
+    long len;
+    int ret = 0;
 
-    printf("Creating indices...\n");
-    sqlite3_exec(p->db, "CREATE INDEX k_seqnum ON jmdict_kanji (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX k_text ON jmdict_kanji (text)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX r_seqnum ON jmdict_reading (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX r_id ON jmdict_reading (id)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX r_text ON jmdict_reaidng (text)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX f_kanji ON jmdict_reading_for (kanji)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX g_seqnum ON jmdict_sense_gloss (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX g_lang ON jmdict_sense_gloss (lang)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX p_seqnum ON jmdict_sense_pos (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX p_sense ON jmdict_sense_pos (sense)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX x_seqnum ON jmdict_sense_xref (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX x_sense ON jmdict_sense_xref (sense)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX i_seqnum ON jmdict_sense_info (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX i_sense ON jmdict_sense_info (sense)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX m_seqnum ON jmdict_sense_misc (seqnum)", NULL, NULL, NULL);
-    sqlite3_exec(p->db, "CREATE INDEX m_sense ON jmdict_sense_misc (sense)", NULL, NULL, NULL);
+    while ((len = decompress_read(dc, &buf)) > 0) {
+        if (XML_Parse(parser, buf, (int)len, XML_FALSE) == XML_STATUS_ERROR) {
+            parse_error(parser);
 
-cleanup:
+            ret = 1;
+            break;
+        }
+    }
+
+    if (len < 0) {
+        ret = 1;
+    } else if (!ret && XML_Parse(parser, NULL, 0, XML_TRUE) == XML_STATUS_ERROR) {
+        parse_error(parser);
+
+        ret = 1;
+    }
+
+    return decompress_finish(dc) || ret;
+}
+
+// settings used for bulk imports, the original values are restored afterwards
+static const struct {
+    const char *name;
+    const char *value;
+} bulk_pragmas[] = {
+    { "journal_mode", "OFF" },
+    { "synchronous", "OFF" },
+    { "cache_size", "-262144" },
+    { "locking_mode", "EXCLUSIVE" },
+    { "temp_store", "MEMORY" },
+};
+
+#define NBULK_PRAGMAS (sizeof(bulk_pragmas) / sizeof(*bulk_pragmas))
+
+static const struct {
+    const char *name;
+    const char *sql;
+} import_indices[] = {
+    { "k_seqnum", "CREATE INDEX IF NOT EXISTS k_seqnum ON jmdict_kanji (seqnum)" },
+    { "k_norm", "CREATE INDEX IF NOT EXISTS k_norm ON jmdict_kanji (norm)" },
+    { "k_rnorm", "CREATE INDEX IF NOT EXISTS k_rnorm ON jmdict_kanji (rnorm)" },
+    { "r_seqnum", "CREATE INDEX IF NOT EXISTS r_seqnum ON jmdict_reading (seqnum)" },
+    { "r_norm", "CREATE INDEX IF NOT EXISTS r_norm ON jmdict_reading (norm)" },
+    { "r_rnorm", "CREATE INDEX IF NOT EXISTS r_rnorm ON jmdict_reading (rnorm)" },
+    { "kt_kanji", "CREATE INDEX IF NOT EXISTS kt_kanji ON jmdict_kanji_tag (kanji)" },
+    { "rt_reading", "CREATE INDEX IF NOT EXISTS rt_reading ON jmdict_reading_tag (reading)" },
+    { "f_kanji", "CREATE INDEX IF NOT EXISTS f_kanji ON jmdict_reading_for (kanji)" },
+    { "f_reading", "CREATE INDEX IF NOT EXISTS f_reading ON jmdict_reading_for (reading)" },
+    { "g_seqnum", "CREATE INDEX IF NOT EXISTS g_seqnum ON jmdict_sense_gloss (seqnum)" },
+    { "g_lang", "CREATE INDEX IF NOT EXISTS g_lang ON jmdict_sense_gloss (lang)" },
+    { "p_seqnum", "CREATE INDEX IF NOT EXISTS p_seqnum ON jmdict_sense_pos (seqnum)" },
+    { "p_sense", "CREATE INDEX IF NOT EXISTS p_sense ON jmdict_sense_pos (sense)" },
+    { "x_seqnum", "CREATE INDEX IF NOT EXISTS x_seqnum ON jmdict_sense_xref (seqnum)" },
+    { "x_sense", "CREATE INDEX IF NOT EXISTS x_sense ON jmdict_sense_xref (sense)" },
+    { "i_seqnum", "CREATE INDEX IF NOT EXISTS i_seqnum ON jmdict_sense_info (seqnum)" },
+    { "i_sense", "CREATE INDEX IF NOT EXISTS i_sense ON jmdict_sense_info (sense)" },
+    { "m_seqnum", "CREATE INDEX IF NOT EXISTS m_seqnum ON jmdict_sense_misc (seqnum)" },
+    { "m_sense", "CREATE INDEX IF NOT EXISTS m_sense ON jmdict_sense_misc (sense)" },
+};
+
+#define NIMPORT_INDICES (sizeof(import_indices) / sizeof(*import_indices))
+
+// full text index over the glosses, the text itself stays in jmdict_sense_gloss
+#define GLOSS_FTS_SQL \
+    "CREATE VIRTUAL TABLE IF NOT EXISTS jmdict_sense_gloss_fts USING fts5(" \
+        "text, content='jmdict_sense_gloss', content_rowid='id', " \
+        "tokenize='unicode61 remove_diacritics 2', prefix='2 3'" \
+    ")"
+
+// updates only touch a few glosses, so rather than rebuilding the
+// definition index they keep it up to date as glosses are written and
+// deleted, in the same transaction. The triggers are temporary, they're
+// gone with the connection and full imports don't pay for them.
+static const char *fts_triggers[] = {
+    "CREATE TEMP TRIGGER IF NOT EXISTS gloss_fts_insert AFTER INSERT ON jmdict_sense_gloss BEGIN "
+        "INSERT INTO jmdict_sense_gloss_fts (rowid, text) VALUES (new.id, new.text); "
+    "END",
+    "CREATE TEMP TRIGGER IF NOT EXISTS gloss_fts_delete AFTER DELETE ON jmdict_sense_gloss BEGIN "
+        "INSERT INTO jmdict_sense_gloss_fts (jmdict_sense_gloss_fts, rowid, text) VALUES ('delete', old.id, old.text); "
+    "END",
+};
+
+#define NFTS_TRIGGERS (sizeof(fts_triggers) / sizeof(*fts_triggers))
+
+// get the current value of a pragma as a string
+static int pragma_get(struct sqlite3 *db, const char *name, char *buf, size_t size)
+{
+    struct sqlite3_stmt *st = NULL;
+    char sql[64];
+    int ret = 1;
+
+    snprintf(sql, sizeof(sql), "PRAGMA %s", name);
+    sqlite3_prepare_v2(db, sql, -1, &st, NULL);
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        snprintf(buf, size, "%s", (const char *)sqlite3_column_text(st, 0));
+        ret = 0;
+    }
     sqlite3_finalize(st);
 
-    XML_ParserFree(parser);
-    fclose(fp);
-    free(userdata.cur_val);
     return ret;
 }
 
-int jmdict_search_kanji(jdic_t *p, const char *query, int *a)
+static int pragma_set(struct sqlite3 *db, const char *name, const char *value)
 {
-    struct sqlite3_stmt *st = NULL;
-    int count = 0;
+    char sql[64];
+
+    snprintf(sql, sizeof(sql), "PRAGMA %s = %s", name, value);
+    return sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK;
+}
 
-    {
-        const char *sql = "SELECT DISTINCT seqnum FROM jmdict_kanji WHERE text GLOB ? LIMIT ? OFFSET ?";
-        sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-        sqlite3_bind_text(st, 1, query, (int)strlen(query), SQLITE_TRANSIENT);
-        sqlite3_bind_int(st, 2, p->limit);
-        sqlite3_bind_int(st, 3, (p->page - 1) * p->limit);
+// indices slow down every insert, so bulk imports drop them up front
+static void drop_indices(struct sqlite3 *db)
+{
+    char sql[64];
 
-        int ec;
-        while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
-            a[count] = sqlite3_column_int(st, 0);
-            count++;
-        }
-        if (ec != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to get count of matching entries\n");
+    for (size_t i = 0; i < NIMPORT_INDICES; i++) {
+        snprintf(sql, sizeof(sql), "DROP INDEX IF EXISTS %s", import_indices[i].name);
+        sqlite3_exec(db, sql, NULL, NULL, NULL);
+    }
+}
 
-            goto cleanup;
+static int create_indices(struct sqlite3 *db)
+{
+    int ret = 0;
+
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+    for (size_t i = 0; i < NIMPORT_INDICES; i++) {
+        char *err = NULL;
+
+        if (sqlite3_exec(db, import_indices[i].sql, NULL, NULL, &err) != SQLITE_OK) {
+            fprintf(stderr, "Failed to create index %s: %s\n", import_indices[i].name, err);
+            sqlite3_free(err);
+
+            ret = 1;
         }
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+
+    return ret;
+}
 
-        sqlite3_finalize(st);
-        st = NULL;
+static void sql_normalize(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    if (text == NULL) {
+        sqlite3_result_null(ctx);
+        return;
     }
 
-    /*
-    if (count == 0) {
-        goto cleanup;
+    char *norm = sqlite3_malloc((int)NORMALIZE_SIZE(strlen(text)));
+    if (norm == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
     }
 
-    {
-        const char *sql = "SELECT DISTINCT seqnum FROM jmdict_kanji WHERE text GLOB ?";
-        sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-        sqlite3_bind_text(st, 1, query, (int)strlen(query), SQLITE_TRANSIENT);
+    int len = (int)normalize(text, norm);
+    sqlite3_result_text(ctx, norm, len, sqlite3_free);
+}
 
-        sqlite3_finalize(st);
-        st = NULL;
+static void sql_reverse(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    const char *text = (const char *)sqlite3_value_text(argv[0]);
+    if (text == NULL) {
+        sqlite3_result_null(ctx);
+        return;
     }
-    */
 
-cleanup:
-    if (st != NULL) {
-        sqlite3_finalize(st);
+    size_t len = strlen(text);
+    char *rev = sqlite3_malloc((int)len + 1);
+    if (rev == NULL) {
+        sqlite3_result_error_nomem(ctx);
+        return;
     }
 
-    return count;
+    utf8_reverse(text, len, rev);
+    sqlite3_result_text(ctx, rev, (int)len, sqlite3_free);
 }
 
-int jmdict_search_reading(jdic_t *p, const char *query, int *a)
+// databases created before kanji and readings were normalized, or before
+// the normalized text was stored reversed, don't have the columns, they're
+// added and filled in for the rows already there
+static int add_norm_columns(struct sqlite3 *db)
 {
-    struct sqlite3_stmt *st = NULL;
-    int count = 0;
+    static const char *tables[] = { "jmdict_kanji", "jmdict_reading" };
+    // in order, rnorm is filled in from norm
+    static const struct {
+        const char *name;
+        const char *value;
+    } columns[] = {
+        { "norm", "jdic_normalize(text)" },
+        { "rnorm", "jdic_reverse(norm)" },
+    };
+    char sql[128];
 
-    {
-        const char *sql = "SELECT DISTINCT seqnum FROM jmdict_reading WHERE text GLOB ? LIMIT ? OFFSET ?";
-        sqlite3_prepare_v2(p->db, sql, -1, &st, NULL);
-        sqlite3_bind_text(st, 1, query, (int)strlen(query), SQLITE_TRANSIENT);
-        sqlite3_bind_int(st, 2, p->limit);
-        sqlite3_bind_int(st, 3, (p->page - 1) * p->limit);
+    if (sqlite3_create_function(db, "jdic_normalize", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                NULL, sql_normalize, NULL, NULL) != SQLITE_OK
+            || sqlite3_create_function(db, "jdic_reverse", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                NULL, sql_reverse, NULL, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to register normalize functions: %s\n", sqlite3_errmsg(db));
 
-        int ec;
-        while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
-            a[count] = sqlite3_column_int(st, 0);
-            count++;
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(tables) / sizeof(*tables); i++) {
+        for (size_t j = 0; j < sizeof(columns) / sizeof(*columns); j++) {
+            snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN %s TINYTEXT NOT NULL DEFAULT ''",
+                    tables[i], columns[j].name);
+            if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+                // it's there already
+                continue;
+            }
+
+            char *err = NULL;
+            snprintf(sql, sizeof(sql), "UPDATE %s SET %s = %s", tables[i], columns[j].name, columns[j].value);
+            if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+                fprintf(stderr, "Failed to normalize %s: %s\n", tables[i], err);
+                sqlite3_free(err);
+
+                return 1;
+            }
         }
-        if (ec != SQLITE_DONE) {
-            fprintf(stderr, "ERR! Failed to get count of matching entries\n");
+    }
 
-            goto cleanup;
+    // searches go through the normalized texts now
+    sqlite3_exec(db, "DROP INDEX IF EXISTS k_text", NULL, NULL, NULL);
+    sqlite3_exec(db, "DROP INDEX IF EXISTS r_text", NULL, NULL, NULL);
+
+    return 0;
+}
+
+// the definition index only refers to the glosses, so a full import
+// rebuilds it from them in one go rather than keeping it up to date row by row
+static int build_fts(struct sqlite3 *db)
+{
+    char *err = NULL;
+
+    if (sqlite3_exec(db, "INSERT INTO jmdict_sense_gloss_fts (jmdict_sense_gloss_fts) VALUES ('rebuild')",
+                NULL, NULL, &err) != SQLITE_OK) {
+        fprintf(stderr, "Failed to build definition index: %s\n", err);
+        sqlite3_free(err);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static int load_existing(writer_t *w)
+{
+    struct sqlite3_stmt *st = NULL;
+    int rc;
+
+    w->existing = array_new(1024, sizeof(existing_t));
+
+    sqlite3_prepare_v2(w->db, "SELECT seqnum, hash FROM jmdict_entry ORDER BY seqnum", -1, &st, NULL);
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        if (!array_reserve(&w->existing, 1)) {
+            fprintf(stderr, "Failed to allocate memory for existing entries\n");
+
+            sqlite3_finalize(st);
+            return 1;
         }
 
-        sqlite3_finalize(st);
-        st = NULL;
+        existing_t *e = ARRAY((&w->existing), existing_t) + w->existing.size++;
+        e->seqnum = sqlite3_column_int(st, 0);
+        e->hash = sqlite3_column_int64(st, 1);
+        e->seen = 0;
     }
+    sqlite3_finalize(st);
 
-cleanup:
-    if (st != NULL) {
-        sqlite3_finalize(st);
+    if (rc != SQLITE_DONE) {
+        fprintf(stderr, "Failed to load existing entries: %s\n", sqlite3_errmsg(w->db));
+
+        return 1;
     }
 
-    return count;
+    return 0;
 }
 
-int jmdict_search_definition(jdic_t *p, const char *query, int *a)
+static int max_id(struct sqlite3 *db, const char *sql)
 {
-    int ret = 0;
     struct sqlite3_stmt *st = NULL;
+    int id = -1;
 
+    sqlite3_prepare_v2(db, sql, -1, &st, NULL);
+    if (sqlite3_step(st) == SQLITE_ROW) {
+        id = sqlite3_column_int(st, 0);
+    }
     sqlite3_finalize(st);
-    return ret;
+
+    return id;
 }
 
+int jmdict_import(jdic_t *p, const char *fn)
+{
+    long long start = mstime();
+    FILE *fp = fopen(fn, "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to open file: %s\n", fn);
+
+        return 1;
+    }
+
+    XML_Parser parser = XML_ParserCreate(NULL);
+    if (!parser) {
+        fprintf(stderr, "Could not allocate enough memory for XML parser!\n");
+
+        fclose(fp);
+        return 1;
+    }
+
+    writer_t writer = {
+        .verbose = p->verbose,
+        .db = p->db,
+        .update = p->update,
+        .commit_freq = p->bulk ? BULK_COMMIT_FREQ : COMMIT_FREQ,
+        .commit_bytes = p->bulk ? BULK_COMMIT_BYTES : COMMIT_BYTES,
+    };
+    char saved_pragmas[NBULK_PRAGMAS][32];
+    int bulk = 0;
+    queue_t queue;
+    userdata_t userdata = {
+        .verbose = p->verbose,
+        .parser = parser,
+        .w = &writer,
+        .queue = p->serial ? NULL : &queue,
+    };
+    pthread_t writer_tid;
+    int writer_running = 0;
+    int ret = 0;
+
+    atomic_init(&writer.failed, 0);
+    queue_init(&queue);
+
+    XML_SetParamEntityParsing(parser, XML_PARAM_ENTITY_PARSING_ALWAYS);
+    XML_SetUserData(parser, &userdata);
+    XML_SetElementHandler(parser, startEl, endEl);
+    XML_SetCharacterDataHandler(parser, charHandler);
+
+    writer.kanji = array_new(16, sizeof(kanji_ref_t));
+    userdata.batch = batch_new();
+    if (userdata.batch == NULL) {
+        fprintf(stderr, "Failed to allocate memory for entry batch\n");
+
+        ret = 1;
+        goto cleanup;
+    }
+
+    /*
+    sqlite3_prepare_v2(p->db, "PRAGMA foreign_keys = ON", -1, &st, NULL);
+    if (sqlite3_step(st) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to enable foreign keys in SQLite database\n");
+
+        ret = 1;
+        goto cleanup;
+    }
+    sqlite3_finalize(st);
+    */
+    sqlite3_exec(p->db, "PRAGMA read_uncommitted = true", NULL, NULL, NULL);
+
+    // databases created before entry hashes were stored don't have this table
+    sqlite3_exec(p->db,
+            "CREATE TABLE IF NOT EXISTS jmdict_entry ("
+                "seqnum INTEGER PRIMARY KEY, "
+                "hash INTEGER NOT NULL"
+            ")", NULL, NULL, NULL);
+    // same for the definition index, which has to be built from scratch
+    // while it's empty, even by an update
+    sqlite3_exec(p->db, GLOSS_FTS_SQL, NULL, NULL, NULL);
+    int fts_empty = max_id(p->db, "SELECT NOT EXISTS (SELECT 1 FROM jmdict_sense_gloss_fts_docsize)") != 0;
+    if (add_norm_columns(p->db)) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (p->update) {
+        if (load_existing(&writer)) {
+            ret = 1;
+            goto cleanup;
+        }
+
+        if (writer.existing.size == 0 && max_id(p->db, "SELECT count(*) FROM jmdict_kanji") > 0) {
+            fprintf(stderr, "Database has no entry hashes, it has to be imported from scratch once before it can be updated\n");
+
+            ret = 1;
+            goto cleanup;
+        }
+
+        for (size_t i = 0; i < NDELETE_SQL; i++) {
+            if (sqlite3_prepare_v2(p->db, delete_sql[i], -1, &writer.st_delete[i], NULL) != SQLITE_OK) {
+                fprintf(stderr, "Failed to prepare statement \"%s\": %s\n", delete_sql[i], sqlite3_errmsg(p->db));
+
+                ret = 1;
+                goto cleanup;
+            }
+        }
+
+        for (size_t i = 0; !fts_empty && i < NFTS_TRIGGERS; i++) {
+            char *err = NULL;
+
+            if (sqlite3_exec(p->db, fts_triggers[i], NULL, NULL, &err) != SQLITE_OK) {
+                fprintf(stderr, "Failed to create definition index trigger: %s\n", err);
+                sqlite3_free(err);
+
+                ret = 1;
+                goto cleanup;
+            }
+        }
+
+        // readers keep seeing the old dictionary until the whole update is committed
+        writer.commit_freq = INT_MAX;
+        writer.commit_bytes = SIZE_MAX;
+    }
+
+    if (p->bulk) {
+        for (size_t i = 0; i < NBULK_PRAGMAS; i++) {
+            if (pragma_get(p->db, bulk_pragmas[i].name, saved_pragmas[i], sizeof(*saved_pragmas))) {
+                fprintf(stderr, "Failed to get current value of PRAGMA %s\n", bulk_pragmas[i].name);
+
+                ret = 1;
+                goto cleanup;
+            }
+        }
+
+        bulk = 1;
+        for (size_t i = 0; i < NBULK_PRAGMAS; i++) {
+            if (pragma_set(p->db, bulk_pragmas[i].name, bulk_pragmas[i].value)) {
+                fprintf(stderr, "Failed to set PRAGMA %s: %s\n", bulk_pragmas[i].name, sqlite3_errmsg(p->db));
+
+                ret = 1;
+                goto cleanup;
+            }
+        }
+
+        drop_indices(p->db);
+    }
+
+    for (int i = 0; i < ST_COUNT; i++) {
+        int rc = sqlite3_prepare_v2(p->db, import_sql[i], -1, &writer.st[i], NULL);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Failed to prepare statement \"%s\": %s\n", import_sql[i], sqlite3_errmsg(p->db));
+
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    for (int i = ST_FIRST_INSERT; i < ST_COUNT; i++) {
+        char *sql = multi_sql(import_sql[i], MULTI_ROWS);
+        int rc = sql != NULL ? sqlite3_prepare_v2(p->db, sql, -1, &writer.multi[i], NULL) : SQLITE_NOMEM;
+        free(sql);
+        if (rc != SQLITE_OK) {
+            fprintf(stderr, "Failed to prepare multi-row statement for \"%s\": %s\n", import_sql[i], sqlite3_errmsg(p->db));
+
+            ret = 1;
+            goto cleanup;
+        }
+    }
+
+    // continue numbering after whatever is already in the database
+    writer.kanji_id = max_id(p->db, "SELECT coalesce(max(id), 0) FROM jmdict_kanji");
+    writer.reading_id = max_id(p->db, "SELECT coalesce(max(id), 0) FROM jmdict_reading");
+    if (writer.kanji_id < 0 || writer.reading_id < 0) {
+        fprintf(stderr, "Failed to get current kanji/reading ids: %s\n", sqlite3_errmsg(p->db));
+
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (sqlite3_step(writer.st[ST_BEGIN]) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to BEGIN SQLite transaction\n");
+
+        ret = 1;
+        goto cleanup;
+    }
+    sqlite3_reset(writer.st[ST_BEGIN]);
+
+    if (userdata.queue != NULL) {
+        if (pthread_create(&writer_tid, NULL, writer_thread, &userdata) != 0) {
+            fprintf(stderr, "Failed to start writer thread\n");
+
+            ret = 1;
+            goto cleanup;
+        }
+        writer_running = 1;
+    }
+
+    // compressed files are decompressed on the fly, regular files are mapped
+    // and parsed in place, anything else (pipes, character devices, ...) is
+    // read through the stream path
+    unsigned char magic[6];
+    size_t nmagic = fread(magic, 1, sizeof(magic), fp);
+    compression_t comp = compression_detect(magic, nmagic);
+
+    struct stat sb;
+    if (comp != COMPRESSION_NONE) {
+        ret = parse_compressed(parser, fp, comp, magic, nmagic);
+    } else if (fstat(fileno(fp), &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        ret = parse_mmap(parser, fp, (size_t)sb.st_size, magic, nmagic);
+    } else {
+        ret = parse_stream(parser, fp, magic, nmagic);
+    }
+
+    // write whatever is left in the last (partial) batch
+    if (!ret && userdata.batch != NULL && userdata.batch->entries.size > 0) {
+        ret = dispatch_batch(&userdata);
+    }
+
+    if (writer_running) {
+        queue_push(&queue, NULL);
+        pthread_join(writer_tid, NULL);
+        writer_running = 0;
+
+        ret |= atomic_load(&writer.failed);
+    }
+
+    if (p->update && !ret) {
+        ret = delete_unseen(&writer);
+    }
+    // the triggers have kept the definition index up to date unless it was
+    // still empty
+    if (p->update && fts_empty && !ret) {
+        ret = build_fts(p->db);
+    }
+
+    // an update is a single transaction, so a failed one leaves the database
+    // as it was. A full import has committed every batch before the failed
+    // one already, its indices are still created so what it got to can be
+    // searched.
+    if (!ret && sqlite3_step(writer.st[ST_COMMIT]) != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to commit database transaction: %s\n", sqlite3_errmsg(p->db));
+
+        ret = 1;
+    }
+    sqlite3_reset(writer.st[ST_COMMIT]);
+    if (ret) {
+        sqlite3_step(writer.st[ST_ROLLBACK]);
+        sqlite3_reset(writer.st[ST_ROLLBACK]);
+
+        if (p->update) {
+            fprintf(stderr, "Update failed, the database was left unchanged\n");
+
+            goto cleanup;
+        }
+    }
+
+    long long then = mstime();
+    long long taken = then - start;
+    long long ms = taken % 1000;
+    long long sec = taken / 1000;
+    long long min = sec / 60;
+    long long hour = min / 60;
+    sec %= 60;
+    min %= 60;
+
+    char tstr[64];
+    if (hour > 0) {
+        sprintf(tstr, "%llih %llim %lli.%03llis", hour, min, sec, ms);
+    } else if (min > 0) {
+        sprintf(tstr, "%llim %lli.%03llis", min, sec, ms);
+    } else {
+        sprintf(tstr, "%lli.%03llis", sec, ms);
+    }
+
+    printf("Imported %i entries in %s (%.0f entries/s)\n",
+            writer.count, tstr, taken > 0 ? writer.count * 1000.0 / (double)taken : 0.0);
+    if (p->update) {
+        printf("%i added, %i changed, %i removed, %zu unchanged\n",
+                writer.added, writer.changed, writer.removed,
+                writer.existing.size - (size_t)(writer.changed + writer.removed));
+    }
+
+    printf("Creating indices...\n");
+    then = mstime();
+    ret |= create_indices(p->db);
+    if (!p->update) {
+        ret |= build_fts(p->db);
+    }
+    if (p->bulk) {
+        printf("Analyzing...\n");
+        sqlite3_exec(p->db, "ANALYZE", NULL, NULL, NULL);
+    }
+    if (p->verbose) {
+        printf("Created indices in %llims\n", mstime() - then);
+    }
+
+cleanup:
+    if (writer_running) {
+        queue_push(&queue, NULL);
+        pthread_join(writer_tid, NULL);
+    }
+
+    sqlite3_exec(p->db, "DROP TRIGGER IF EXISTS temp.gloss_fts_insert", NULL, NULL, NULL);
+    sqlite3_exec(p->db, "DROP TRIGGER IF EXISTS temp.gloss_fts_delete", NULL, NULL, NULL);
+
+    // undo the bulk settings in reverse order
+    if (bulk) {
+        for (size_t i = NBULK_PRAGMAS; i-- > 0;) {
+            pragma_set(p->db, bulk_pragmas[i].name, saved_pragmas[i]);
+        }
+    }
+
+    for (int i = 0; i < ST_COUNT; i++) {
+        sqlite3_finalize(writer.st[i]);
+        sqlite3_finalize(writer.multi[i]);
+    }
+
+    if (userdata.batch != NULL) {
+        batch_free(userdata.batch);
+    }
+    array_free(&writer.kanji, NULL);
+    array_free(&writer.existing, NULL);
+    for (size_t i = 0; i < NDELETE_SQL; i++) {
+        sqlite3_finalize(writer.st_delete[i]);
+    }
+
+    XML_ParserFree(parser);
+    fclose(fp);
+    text_buf_free(&userdata.cur_val);
+    return ret;
+}
+
+// returns a prepared statement for sql, statements are kept around between
+// lookups and only ever used by the connection they were prepared for
+static struct sqlite3_stmt *lookup_stmt(jdic_t *p, const char *sql)
+{
+    struct sqlite3_stmt *st = NULL;
+    int i;
+
+    for (i = 0; i < STMT_CACHE_SIZE && p->stmts[i] != NULL; i++) {
+        if (!strcmp(sqlite3_sql(p->stmts[i]), sql)) {
+            st = p->stmts[i];
+            break;
+        }
+    }
+
+    if (st == NULL) {
+        if (sqlite3_prepare_v3(p->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &st, NULL) != SQLITE_OK) {
+            fprintf(stderr, "ERR! Failed to prepare \"%s\": %s\n", sql, sqlite3_errmsg(p->db));
+
+            return NULL;
+        }
+
+        // the least recently used statement makes room
+        if (i == STMT_CACHE_SIZE) {
+            i--;
+            sqlite3_finalize(p->stmts[i]);
+        }
+    }
+
+    memmove(&p->stmts[1], &p->stmts[0], (size_t)i * sizeof(*p->stmts));
+    p->stmts[0] = st;
+
+    sqlite3_clear_bindings(st);
+    return st;
+}
+
+// runs a search query, storing at most p->limit seqnums in a. Patterns are
+// looked up by the literal text they start with in the index on norm, or by
+// the literal text they end with in the index on rnorm when that is longer,
+// the same way snapshots pick between their indices. rsql gets the reversed
+// suffix and the first text after every one starting with it as ?5 and ?6.
+static int search_seqnums(jdic_t *p, const char *sql, const char *rsql, const char *query, int *a)
+{
+    size_t len = strlen(query);
+    size_t plen = strcspn(query, "*?[");
+    size_t slen = 0;
+    int count = 0;
+
+    while (slen < len && strchr("*?[]", query[len - slen - 1]) == NULL) {
+        slen++;
+    }
+
+    struct sqlite3_stmt *st = lookup_stmt(p, slen > plen ? rsql : sql);
+    if (st == NULL) {
+        return 0;
+    }
+
+    sqlite3_bind_text(st, 1, query, (int)len, SQLITE_TRANSIENT);
+    sqlite3_bind_int(st, 2, p->limit);
+    sqlite3_bind_int(st, 3, (p->page - 1) * p->limit);
+    sqlite3_bind_int(st, 4, p->after);
+
+    if (slen > plen) {
+        char *suffix = malloc(slen + 1);
+        if (suffix == NULL) {
+            fprintf(stderr, "ERR! Failed to allocate memory for search\n");
+
+            sqlite3_reset(st);
+            return 0;
+        }
+
+        utf8_reverse(query + len - slen, slen, suffix);
+        sqlite3_bind_text(st, 5, suffix, (int)slen, SQLITE_TRANSIENT);
+        // bytes in UTF-8 never reach 0xff so the last one can be incremented
+        suffix[slen - 1]++;
+        sqlite3_bind_text(st, 6, suffix, (int)slen, SQLITE_TRANSIENT);
+        free(suffix);
+    }
+
+    int ec;
+    while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
+        a[count] = sqlite3_column_int(st, 0);
+        count++;
+    }
+    if (ec != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to get count of matching entries\n");
+    }
+
+    sqlite3_reset(st);
+    return count;
+}
+
+int jmdict_search_kanji(jdic_t *p, const char *query, int *a)
+{
+    return search_seqnums(p,
+            "SELECT DISTINCT seqnum FROM jmdict_kanji WHERE norm GLOB ?1 AND seqnum > ?4 ORDER BY seqnum LIMIT ?2 OFFSET ?3",
+            "SELECT DISTINCT seqnum FROM jmdict_kanji WHERE rnorm >= ?5 AND rnorm < ?6 AND norm GLOB ?1 AND seqnum > ?4 ORDER BY seqnum LIMIT ?2 OFFSET ?3",
+            query, a);
+}
+
+int jmdict_search_reading(jdic_t *p, const char *query, int *a)
+{
+    return search_seqnums(p,
+            "SELECT DISTINCT seqnum FROM jmdict_reading WHERE norm GLOB ?1 AND seqnum > ?4 ORDER BY seqnum LIMIT ?2 OFFSET ?3",
+            "SELECT DISTINCT seqnum FROM jmdict_reading WHERE rnorm >= ?5 AND rnorm < ?6 AND norm GLOB ?1 AND seqnum > ?4 ORDER BY seqnum LIMIT ?2 OFFSET ?3",
+            query, a);
+}
+
+typedef struct {
+    sqlite3_stmt *st;
+    char *bound;
+} reading_cursor_t;
+
+static const char *reading_next(void *ctx, int *id)
+{
+    reading_cursor_t *c = ctx;
+
+    if (sqlite3_step(c->st) != SQLITE_ROW) {
+        return NULL;
+    }
+
+    *id = sqlite3_column_int(c->st, 1);
+    return (const char *)sqlite3_column_text(c->st, 0);
+}
+
+static void reading_skip(void *ctx, const char *prefix, size_t len)
+{
+    reading_cursor_t *c = ctx;
+
+    // restart from the first text after every one starting with prefix,
+    // bytes in UTF-8 never reach 0xff so the last one can be incremented
+    memcpy(c->bound, prefix, len);
+    c->bound[len - 1]++;
+
+    sqlite3_reset(c->st);
+    sqlite3_bind_text(c->st, 1, c->bound, (int)len, SQLITE_STATIC);
+}
+
+// finds readings within p->distance edits of the query, closest first
+int jmdict_search_fuzzy(jdic_t *p, const char *query, int *a)
+{
+    const char *sql = "SELECT norm, seqnum FROM jmdict_reading WHERE norm >= ? ORDER BY norm";
+    // no key the search goes into is longer than this
+    char bound[(FUZZY_MAX_LEN + FUZZY_MAX_DISTANCE) * 4];
+    array_t hits = array_new(64, sizeof(fuzzy_hit_t));
+    int skip = (p->page - 1) * p->limit;
+    int count = 0;
+
+    struct sqlite3_stmt *st = lookup_stmt(p, sql);
+    if (st == NULL) {
+        array_free(&hits, NULL);
+        return 0;
+    }
+    sqlite3_bind_text(st, 1, "", 0, SQLITE_STATIC);
+
+    reading_cursor_t cursor = { st, bound };
+    key_source_t src = { &cursor, reading_next, reading_skip };
+    if (fuzzy_walk(query, p->distance, &src, &hits)) {
+        fprintf(stderr, "ERR! Query is too long for a fuzzy search\n");
+    } else {
+        fuzzy_rank(&hits);
+
+        for (size_t i = (size_t)skip; i < hits.size && count < p->limit; i++) {
+            a[count++] = ARRAY((&hits), fuzzy_hit_t)[i].id;
+        }
+    }
+
+    sqlite3_reset(st);
+    array_free(&hits, NULL);
+    return count;
+}
+
+// turns a query into an FTS5 query matching glosses with all of its words,
+// a word ending in * matches every word starting with it
+static char *fts_query(const char *query)
+{
+    // at worst every character is a quote, or a word of its own
+    char *buf = malloc(strlen(query) * 4 + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    char *end = buf;
+    const char *c = query;
+    while (*c != '\0') {
+        size_t len = strcspn(c, " \t");
+        if (len == 0) {
+            c++;
+            continue;
+        }
+
+        int prefix = c[len-1] == '*';
+        if (prefix) len--;
+
+        if (len > 0) {
+            if (end != buf) *end++ = ' ';
+            *end++ = '"';
+            for (size_t i = 0; i < len; i++) {
+                // quotes are escaped by doubling them
+                if (c[i] == '"') *end++ = '"';
+                *end++ = c[i];
+            }
+            *end++ = '"';
+            if (prefix) *end++ = '*';
+        }
+
+        c += len + (size_t)prefix;
+    }
+    *end = '\0';
+
+    return buf;
+}
+
+// searches the glosses in p->lang, best (bm25) matches first
+int jmdict_search_definition(jdic_t *p, const char *query, int *a)
+{
+    const char *sql =
+        "SELECT g.seqnum FROM jmdict_sense_gloss_fts f "
+            "JOIN jmdict_sense_gloss g ON g.id = f.rowid "
+        "WHERE jmdict_sense_gloss_fts MATCH ? AND g.lang = ? "
+        "GROUP BY g.seqnum ORDER BY min(f.rank), g.seqnum LIMIT ? OFFSET ?";
+    int count = 0;
+
+    char *match = fts_query(query);
+    if (match == NULL || *match == '\0') {
+        free(match);
+        return 0;
+    }
+
+    struct sqlite3_stmt *st = lookup_stmt(p, sql);
+    if (st == NULL) {
+        free(match);
+        return 0;
+    }
+
+    sqlite3_bind_text(st, 1, match, -1, SQLITE_STATIC);
+    sqlite3_bind_text(st, 2, p->lang, -1, SQLITE_STATIC);
+    sqlite3_bind_int(st, 3, p->limit);
+    sqlite3_bind_int(st, 4, (p->page - 1) * p->limit);
+
+    int ec;
+    while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
+        a[count++] = sqlite3_column_int(st, 0);
+    }
+    if (ec != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to search definitions: %s\n", sqlite3_errmsg(p->db));
+    }
+
+    sqlite3_reset(st);
+    free(match);
+    return count;
+}
+
+
+typedef struct {
+    int id;
+    const char *text;
+    const char *tags;
+} fetch_kanji_t;
+
+typedef struct {
+    int id;
+    const char *text;
+    int true_reading;
+} fetch_reading_t;
+
+typedef struct {
+    int reading;
+    int kanji;
+} fetch_restr_t;
+
+// most entries have a kanji or two and about as many readings, which then
+// need no allocation of their own
+ARRAY_TYPE(kanji_list, fetch_kanji_t, 4)
+ARRAY_TYPE(reading_list, fetch_reading_t, 4)
+ARRAY_TYPE(restr_list, fetch_restr_t, 4)
+
+typedef struct {
+    int sense;
+    const char *lang;
+    const char *text;
+} fetch_gloss_t;
+
+typedef enum {
+    EXTRA_POS = 0,
+    EXTRA_MISC,
+    EXTRA_INFO,
+    EXTRA_XREF,
+    EXTRA_COUNT,
+} fetch_extra_type_t;
+
+typedef struct {
+    fetch_extra_type_t type;
+    int sense;
+    const char *text;
+} fetch_extra_t;
+
+// every query fetches the rows of a whole batch of entries, %s is replaced
+// by the list of seqnum parameters
+static const char *fetch_kanji_sql =
+    "SELECT k.seqnum, k.id, k.text, ("
+        "SELECT group_concat(text, ', ') FROM jmdict_kanji_tag WHERE kanji = k.id"
+    ") "
+    "FROM jmdict_kanji k WHERE k.seqnum IN (%s) "
+    "ORDER BY k.seqnum, k.id";
+static const char *fetch_reading_sql =
+    "SELECT seqnum, id, text, truereading FROM jmdict_reading WHERE seqnum IN (%s) "
+    "ORDER BY seqnum, id";
+static const char *fetch_restr_sql =
+    "SELECT r.seqnum, f.reading, f.kanji "
+    "FROM jmdict_reading_for f JOIN jmdict_reading r ON r.id = f.reading "
+    "WHERE r.seqnum IN (%s)";
+static const char *fetch_gloss_sql =
+    "SELECT seqnum, sense, lang, text FROM jmdict_sense_gloss "
+    "WHERE seqnum IN (%s) AND (:lang IS NULL OR lang = :lang) "
+    "ORDER BY seqnum, sense, id";
+
+// per-sense values, all concatenated into a single string per sense and
+// fetched together in a single UNION ALL
+static const char *extra_sql[EXTRA_COUNT] = {
+    [EXTRA_POS] = "SELECT seqnum, 0, sense, group_concat(text, ', ') FROM jmdict_sense_pos WHERE seqnum IN (%s) GROUP BY seqnum, sense",
+    [EXTRA_MISC] = "SELECT seqnum, 1, sense, group_concat(text, ', ') FROM jmdict_sense_misc WHERE seqnum IN (%s) GROUP BY seqnum, sense",
+    [EXTRA_INFO] = "SELECT seqnum, 2, sense, group_concat(text, ', ') FROM jmdict_sense_info WHERE seqnum IN (%s) GROUP BY seqnum, sense",
+    [EXTRA_XREF] = "SELECT seqnum, 3, sense, group_concat(text, ', ') FROM jmdict_sense_xref WHERE seqnum IN (%s) GROUP BY seqnum, sense",
+};
+
+// everything needed to assemble a single entry. Column text is copied
+// straight into the arena the entry is assembled in, the only copy made of
+// it on the way to the output.
+typedef struct {
+    int seqnum;
+    arena_t *arena;
+    kanji_list_t kanji;
+    reading_list_t readings;
+    restr_list_t restr;
+    array_t glosses;
+    array_t extras;
+} fetch_t;
+
+// the text of column i in the arena of fe, NULL if it's NULL or out of memory
+static const char *fetch_col(fetch_t *fe, struct sqlite3_stmt *st, int i)
+{
+    const char *s = (const char *)sqlite3_column_text(st, i);
+    if (s == NULL) {
+        return NULL;
+    }
+
+    size_t len = (size_t)sqlite3_column_bytes(st, i);
+    char *copy = arena_alloc(fe->arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, s, len + 1);
+    }
+
+    return copy;
+}
+
+static int fetch_cmp(const void *a, const void *b)
+{
+    const fetch_t *fa = a;
+    const fetch_t *fb = b;
+
+    return fa->seqnum < fb->seqnum ? -1 : fa->seqnum > fb->seqnum;
+}
+
+// replace every %s in fmt by "?1, ?2, ..., ?n"
+static char *in_sql(const char *fmt, int n)
+{
+    size_t nlist = 0;
+    for (int i = 1; i <= n; i++) {
+        nlist += (size_t)snprintf(NULL, 0, "?%i, ", i);
+    }
+
+    size_t nfmt = strlen(fmt);
+    size_t count = 0;
+    for (const char *c = strstr(fmt, "%s"); c != NULL; c = strstr(c + 2, "%s")) {
+        count++;
+    }
+
+    char *buf = malloc(nfmt + nlist * count + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    char *end = buf;
+    for (const char *c = fmt; *c != '\0';) {
+        if (c[0] == '%' && c[1] == 's') {
+            for (int i = 1; i <= n; i++) {
+                end += sprintf(end, i < n ? "?%i, " : "?%i", i);
+            }
+            c += 2;
+        } else {
+            *end++ = *c++;
+        }
+    }
+    *end = '\0';
+
+    return buf;
+}
+
+// looks up the forms query could be an inflection of, all of them in a
+// single query, keeping the entries with a part of speech that fits
+int jmdict_search_deinflected(jdic_t *p, const char *query, int *a)
+{
+    const char *fmt =
+        "SELECT c.norm, c.seqnum, p.text FROM ("
+            "SELECT norm, seqnum FROM jmdict_kanji WHERE norm IN (%s) "
+            "UNION SELECT norm, seqnum FROM jmdict_reading WHERE norm IN (%s)) c "
+        "JOIN jmdict_sense_pos p ON p.seqnum = c.seqnum";
+    deinflection_t cands[DEINFLECT_MAX];
+    int count = 0;
+
+    int n = deinflect(query, cands);
+    if (n <= 1) {
+        return 0;
+    }
+
+    // always as many parameters, so there is only ever one statement
+    char *sql = in_sql(fmt, DEINFLECT_MAX);
+    if (sql == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for query\n");
+
+        return 0;
+    }
+    struct sqlite3_stmt *st = lookup_stmt(p, sql);
+    free(sql);
+    if (st == NULL) {
+        return 0;
+    }
+
+    // the word itself has been looked up already
+    for (int i = 1; i < n; i++) {
+        if (cands[i].type & DI_DICTIONARY) {
+            sqlite3_bind_text(st, i + 1, cands[i].text, -1, SQLITE_STATIC);
+        }
+    }
+
+    array_t hits = array_new(16, sizeof(deinflect_hit_t));
+    int ec;
+    while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
+        const char *text = (const char *)sqlite3_column_text(st, 0);
+        const char *pos = (const char *)sqlite3_column_text(st, 2);
+
+        for (int i = 1; i < n; i++) {
+            if (strcmp(cands[i].text, text) != 0 || !deinflect_pos_ok(cands[i].type, pos)) {
+                continue;
+            }
+            if (!array_reserve(&hits, 1)) {
+                fprintf(stderr, "ERR! Failed to allocate memory for results\n");
+
+                goto cleanup;
+            }
+            ARRAY((&hits), deinflect_hit_t)[hits.size++] = (deinflect_hit_t){ i, sqlite3_column_int(st, 1) };
+        }
+    }
+    if (ec != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to look up deinflections: %s\n", sqlite3_errmsg(p->db));
+    }
+
+    count = deinflect_rank(&hits, cands, p->trace, (p->page - 1) * p->limit, p->limit, a);
+
+cleanup:
+    sqlite3_reset(st);
+    array_free(&hits, NULL);
+    return count;
+}
+
+// runs a query for a batch of entries (and optionally a language), calling f
+// with the entry every row belongs to, fe has to be sorted by seqnum
+static int fetch_rows(jdic_t *p, const char *fmt, fetch_t *fe, int n, const char *lang,
+                      int (*f)(fetch_t *, struct sqlite3_stmt *))
+{
+    int ret = 0;
+
+    char *sql = in_sql(fmt, n);
+    if (sql == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for query\n");
+
+        return 1;
+    }
+
+    struct sqlite3_stmt *st = lookup_stmt(p, sql);
+    free(sql);
+    if (st == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        sqlite3_bind_int(st, i + 1, fe[i].seqnum);
+    }
+    int lang_param = sqlite3_bind_parameter_index(st, ":lang");
+    if (lang_param > 0 && lang != NULL) {
+        sqlite3_bind_text(st, lang_param, lang, -1, SQLITE_STATIC);
+    }
+
+    int ec;
+    while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
+        fetch_t key = { .seqnum = sqlite3_column_int(st, 0) };
+        fetch_t *e = bsearch(&key, fe, (size_t)n, sizeof(fetch_t), fetch_cmp);
+        if (e == NULL) {
+            continue;
+        }
+
+        if (f(e, st)) {
+            fprintf(stderr, "ERR! Failed to allocate memory for entry #%i\n", e->seqnum);
+
+            ret = 1;
+            break;
+        }
+    }
+    if (!ret && ec != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to fetch entries: %i\n", ec);
+
+        ret = 1;
+    }
+
+    sqlite3_reset(st);
+    return ret;
+}
+
+static int fetch_kanji_row(fetch_t *fe, struct sqlite3_stmt *st)
+{
+    fetch_kanji_t *k = kanji_list_push(&fe->kanji);
+    if (k == NULL) {
+        return 1;
+    }
+
+    k->id = sqlite3_column_int(st, 1);
+    k->text = fetch_col(fe, st, 2);
+    k->tags = fetch_col(fe, st, 3);
+
+    return k->text == NULL || (sqlite3_column_type(st, 3) != SQLITE_NULL && k->tags == NULL);
+}
+
+static int fetch_reading_row(fetch_t *fe, struct sqlite3_stmt *st)
+{
+    fetch_reading_t *r = reading_list_push(&fe->readings);
+    if (r == NULL) {
+        return 1;
+    }
+
+    r->id = sqlite3_column_int(st, 1);
+    r->text = fetch_col(fe, st, 2);
+    r->true_reading = sqlite3_column_int(st, 3);
+
+    return r->text == NULL;
+}
+
+static int fetch_restr_row(fetch_t *fe, struct sqlite3_stmt *st)
+{
+    fetch_restr_t *f = restr_list_push(&fe->restr);
+    if (f == NULL) {
+        return 1;
+    }
+
+    f->reading = sqlite3_column_int(st, 1);
+    f->kanji = sqlite3_column_int(st, 2);
+
+    return 0;
+}
+
+static int fetch_gloss_row(fetch_t *fe, struct sqlite3_stmt *st)
+{
+    if (!array_reserve(&fe->glosses, 1)) {
+        return 1;
+    }
+
+    fetch_gloss_t *g = ARRAY((&fe->glosses), fetch_gloss_t) + fe->glosses.size++;
+    g->sense = sqlite3_column_int(st, 1);
+    g->lang = fetch_col(fe, st, 2);
+    g->text = fetch_col(fe, st, 3);
+
+    return g->lang == NULL || g->text == NULL;
+}
+
+static int fetch_extra_row(fetch_t *fe, struct sqlite3_stmt *st)
+{
+    if (!array_reserve(&fe->extras, 1)) {
+        return 1;
+    }
+
+    fetch_extra_t *x = ARRAY((&fe->extras), fetch_extra_t) + fe->extras.size++;
+    x->type = (fetch_extra_type_t)sqlite3_column_int(st, 1);
+    x->sense = sqlite3_column_int(st, 2);
+    x->text = fetch_col(fe, st, 3);
+
+    return x->text == NULL;
+}
+
+// readings apply to every kanji of their entry, unless they are restricted
+// to some of them or aren't a true reading of the kanji at all
+static int reading_applies(const fetch_t *fe, const fetch_reading_t *r, int kanji)
+{
+    const fetch_restr_t *restr = restr_list_data(&fe->restr);
+    int restricted = 0;
+
+    if (!r->true_reading) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < fe->restr.size; i++) {
+        if (restr[i].reading == r->id) {
+            if (restr[i].kanji == kanji) {
+                return 1;
+            }
+            restricted = 1;
+        }
+    }
+
+    return !restricted;
+}
+
+// turn the fetched rows into an entry, in the arena its strings are in
+static int assemble_entry(fetch_t *fe, jmdict_entry_t *e)
+{
+    const fetch_kanji_t *kanji = kanji_list_data(&fe->kanji);
+    const fetch_reading_t *readings = reading_list_data(&fe->readings);
+    const fetch_gloss_t *glosses = ARRAY((&fe->glosses), fetch_gloss_t);
+    const fetch_extra_t *extras = ARRAY((&fe->extras), fetch_extra_t);
+
+    // at most every kanji with every reading, plus the readings on their own
+    size_t maxforms = (fe->kanji.size + 1) * fe->readings.size;
+    e->forms = arena_calloc(fe->arena, maxforms > 0 ? maxforms : 1, sizeof(jmdict_form_t));
+    e->glosses = arena_calloc(fe->arena, fe->glosses.size > 0 ? fe->glosses.size : 1, sizeof(jmdict_gloss_t));
+    e->senses = arena_calloc(fe->arena, fe->glosses.size > 0 ? fe->glosses.size : 1, sizeof(jmdict_sense_t));
+    if (e->forms == NULL || e->glosses == NULL || e->senses == NULL) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < fe->kanji.size; i++) {
+        const fetch_kanji_t *k = &kanji[i];
+
+        for (size_t j = 0; j < fe->readings.size; j++) {
+            if (!reading_applies(fe, &readings[j], k->id)) {
+                continue;
+            }
+
+            jmdict_form_t *f = &e->forms[e->nforms++];
+            f->kanji = k->text;
+            f->reading = readings[j].text;
+            f->tags = k->tags;
+        }
+    }
+    // readings that are never written with kanji
+    for (size_t i = 0; i < fe->readings.size; i++) {
+        if (fe->kanji.size == 0 || !readings[i].true_reading) {
+            e->forms[e->nforms++].reading = readings[i].text;
+        }
+    }
+
+    jmdict_sense_t *s = NULL;
+    for (size_t i = 0; i < fe->glosses.size; i++) {
+        const fetch_gloss_t *g = &glosses[i];
+
+        if (s == NULL || s->id != g->sense) {
+            s = &e->senses[e->nsenses++];
+            s->id = g->sense;
+            s->glosses = &e->glosses[i];
+        }
+
+        s->glosses[s->nglosses].lang = g->lang;
+        s->glosses[s->nglosses].text = g->text;
+        s->nglosses++;
+    }
+
+    for (int i = 0; i < e->nsenses; i++) {
+        s = &e->senses[i];
+
+        for (size_t j = 0; j < fe->extras.size; j++) {
+            const fetch_extra_t *x = &extras[j];
+            const char *text = x->text;
+
+            switch (x->type) {
+                case EXTRA_POS:
+                    // senses without a part of speech share the one of the sense before them
+                    if (x->sense <= s->id) s->pos = text;
+                    break;
+                case EXTRA_MISC:
+                    if (x->sense == s->id) s->misc = text;
+                    break;
+                case EXTRA_INFO:
+                    if (x->sense == s->id) s->info = text;
+                    break;
+                case EXTRA_XREF:
+                    if (x->sense == s->id) s->xref = text;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int fetch_batch(jdic_t *p, fetch_t *fe, int n, const char *lang)
+{
+    if (fetch_rows(p, fetch_kanji_sql, fe, n, NULL, fetch_kanji_row)
+            || fetch_rows(p, fetch_reading_sql, fe, n, NULL, fetch_reading_row)
+            || fetch_rows(p, fetch_restr_sql, fe, n, NULL, fetch_restr_row)
+            || fetch_rows(p, fetch_gloss_sql, fe, n, lang, fetch_gloss_row)) {
+        return 1;
+    }
+
+    char extras[1024] = "";
+    for (int i = 0; i < EXTRA_COUNT; i++) {
+        // pos and xref are extra info, skip them when asked to be fast
+        if (p->fast > 0 && (i == EXTRA_POS || i == EXTRA_XREF)) {
+            continue;
+        }
+#if FAST
+        if (i == EXTRA_MISC) {
+            continue;
+        }
+#endif
+        if (*extras != '\0') {
+            strcat(extras, " UNION ALL ");
+        }
+        strcat(extras, extra_sql[i]);
+    }
+    if (*extras == '\0') {
+        return 0;
+    }
+    // senses without a pos need the ones before them in order
+    strcat(extras, " ORDER BY 1, 2, 3");
+
+    return fetch_rows(p, extras, fe, n, NULL, fetch_extra_row);
+}
+
+// fetch complete entries for n distinct seqnums in a bounded number of queries,
+// only glosses in lang are included unless it's NULL. With an arena the
+// entries are allocated from it, and live until it's reset, otherwise every
+// entry gets an arena of its own.
+int jmdict_fetch_entries(jdic_t *p, const int *seqnums, int n, const char *lang, jmdict_entry_t *entries, arena_t *arena)
+{
+    fetch_t *fe = calloc(n > 0 ? (size_t)n : 1, sizeof(fetch_t));
+    int ret = 1;
+
+    if (fe == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for entries\n");
+
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        entries[i] = (jmdict_entry_t){ .seqnum = seqnums[i], .arena = arena_new(ENTRY_ARENA_BLOCK) };
+        fe[i] = (fetch_t){
+            .seqnum = seqnums[i],
+            .arena = arena != NULL ? arena : &entries[i].arena,
+            .glosses = array_new(16, sizeof(fetch_gloss_t)),
+            .extras = array_new(16, sizeof(fetch_extra_t)),
+        };
+    }
+    qsort(fe, (size_t)n, sizeof(fetch_t), fetch_cmp);
+
+    for (int i = 0; i < n; i += FETCH_BATCH) {
+        if (fetch_batch(p, fe + i, n - i < FETCH_BATCH ? n - i : FETCH_BATCH, lang)) {
+            goto cleanup;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        fetch_t key = { .seqnum = seqnums[i] };
+        fetch_t *f = bsearch(&key, fe, (size_t)n, sizeof(fetch_t), fetch_cmp);
+
+        if (assemble_entry(f, &entries[i])) {
+            fprintf(stderr, "ERR! Failed to allocate memory for entry #%i\n", seqnums[i]);
+
+            goto cleanup;
+        }
+    }
+    ret = 0;
+
+cleanup:
+    for (int i = 0; i < n; i++) {
+        kanji_list_free(&fe[i].kanji);
+        reading_list_free(&fe[i].readings);
+        restr_list_free(&fe[i].restr);
+        array_free(&fe[i].glosses, NULL);
+        array_free(&fe[i].extras, NULL);
+        if (ret) {
+            jmdict_entry_free(&entries[i]);
+        }
+    }
+    free(fe);
+
+    return ret;
+}
+
+// frees the arena of an entry that has one of its own, does nothing for
+// entries in an arena of the caller's
+void jmdict_entry_free(jmdict_entry_t *e)
+{
+    arena_free(&e->arena);
+
+    *e = (jmdict_entry_t){ .seqnum = e->seqnum };
+}
+
+// changes whenever another connection commits to the database, -1 on failure
+int jmdict_data_version(jdic_t *p)
+{
+    struct sqlite3_stmt *st = lookup_stmt(p, "PRAGMA data_version");
+    if (st == NULL) {
+        return -1;
+    }
+
+    int version = sqlite3_step(st) == SQLITE_ROW ? sqlite3_column_int(st, 0) : -1;
+    sqlite3_reset(st);
+
+    return version;
+}
+
+// opens a read-only connection of its own for p, which is a copy of a jdic_t
+// used by another thread, only the snapshot can be shared between threads
+int jmdict_open_reader(jdic_t *p, const char *fn)
+{
+    memset(p->stmts, 0, sizeof(p->stmts));
+    p->db = NULL;
+    p->arena = arena_new(0);
+
+    if (p->snap != NULL) {
+        return 0;
+    }
+
+    if (sqlite3_open_v2(fn, &p->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open SQLite3 database\n");
+
+        sqlite3_close(p->db);
+        p->db = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+// finalizes the statements kept around for lookups and closes the database
+void jmdict_close(jdic_t *p)
+{
+    for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+        sqlite3_finalize(p->stmts[i]);
+        p->stmts[i] = NULL;
+    }
+
+    sqlite3_close(p->db);
+    p->db = NULL;
+    arena_free(&p->arena);
+}
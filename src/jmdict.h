@@ -2,10 +2,58 @@
 #define __JMDICT_H__
 
 #include "jdic.h"
+#include "arena.h"
+
+// block size of the arena of an entry that has one of its own, enough for
+// most entries
+#define ENTRY_ARENA_BLOCK 1024
+
+typedef struct {
+    // NULL for entries without kanji
+    const char *kanji;
+    const char *reading;
+    const char *tags;
+} jmdict_form_t;
+
+typedef struct {
+    const char *lang;
+    const char *text;
+} jmdict_gloss_t;
+
+typedef struct {
+    int id;
+    const char *pos;
+    const char *misc;
+    const char *info;
+    const char *xref;
+    jmdict_gloss_t *glosses;
+    int nglosses;
+} jmdict_sense_t;
+
+// a fully assembled dictionary entry. Entries fetched into an arena of the
+// caller's live in it, others in an arena of their own (strings from a
+// snapshot stay in the mapping either way), which jmdict_entry_free frees.
+typedef struct {
+    int seqnum;
+    jmdict_form_t *forms;
+    int nforms;
+    jmdict_sense_t *senses;
+    int nsenses;
+    // storage for the glosses of all senses
+    jmdict_gloss_t *glosses;
+    arena_t arena;
+} jmdict_entry_t;
 
 int jmdict_import(jdic_t *, const char *);
 int jmdict_search_kanji(jdic_t *, const char *, int *);
 int jmdict_search_reading(jdic_t *, const char *, int *);
 int jmdict_search_definition(jdic_t *, const char *, int *);
+int jmdict_search_fuzzy(jdic_t *, const char *, int *);
+int jmdict_search_deinflected(jdic_t *, const char *, int *);
+int jmdict_fetch_entries(jdic_t *, const int *, int, const char *, jmdict_entry_t *, arena_t *);
+void jmdict_entry_free(jmdict_entry_t *);
+int jmdict_data_version(jdic_t *);
+int jmdict_open_reader(jdic_t *, const char *);
+void jmdict_close(jdic_t *);
 
 #endif // __JMDICT_H__
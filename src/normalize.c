@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "util.h"
+#include "normalize.h"
+
+// Kanji and reading texts are indexed, and queries looked up, in a
+// normalized form, so the way something happens to be written doesn't keep
+// it from being found:
+//
+//  - full-width ASCII becomes ASCII, the ideographic space a space
+//  - half-width katakana become full-width, with a following (half-width or
+//    combining) voiced sound mark merged into the kana before it
+//  - katakana become hiragana
+//  - a long vowel mark after a kana becomes the vowel it stands for, with
+//    long e and o spelled as they usually are in readings, えい and おう
+//
+// No character gets longer, so a text can be normalized in place.
+
+#define HALFWIDTH_FIRST 0xff61
+#define HALFWIDTH_LAST 0xff9d
+#define HIRAGANA_FIRST 0x3041
+#define HIRAGANA_LAST 0x3096
+#define KATAKANA_FIRST 0x30a1
+#define KATAKANA_LAST 0x30f6
+#define LONG_VOWEL 0x30fc
+#define VOICED_MARK 0x3099
+#define SEMI_VOICED_MARK 0x309a
+
+// full-width forms of the half-width katakana and punctuation
+static const uint16_t halfwidth[HALFWIDTH_LAST - HALFWIDTH_FIRST + 1] = {
+    0x3002, 0x300c, 0x300d, 0x3001, 0x30fb, 0x30f2,
+    0x30a1, 0x30a3, 0x30a5, 0x30a7, 0x30a9, 0x30e3, 0x30e5, 0x30e7, 0x30c3,
+    0x30fc,
+    0x30a2, 0x30a4, 0x30a6, 0x30a8, 0x30aa,
+    0x30ab, 0x30ad, 0x30af, 0x30b1, 0x30b3,
+    0x30b5, 0x30b7, 0x30b9, 0x30bb, 0x30bd,
+    0x30bf, 0x30c1, 0x30c4, 0x30c6, 0x30c8,
+    0x30ca, 0x30cb, 0x30cc, 0x30cd, 0x30ce,
+    0x30cf, 0x30d2, 0x30d5, 0x30d8, 0x30db,
+    0x30de, 0x30df, 0x30e0, 0x30e1, 0x30e2,
+    0x30e4, 0x30e6, 0x30e8,
+    0x30e9, 0x30ea, 0x30eb, 0x30ec, 0x30ed,
+    0x30ef, 0x30f3,
+};
+
+// vowel of every hiragana, - for っ and ん
+static const char vowels[] =
+    "aaiiuueeoo"
+    "aaiiuueeoo"
+    "aaiiuueeoo"
+    "aaii-uueeoo"
+    "aiueo"
+    "aaaiiiuuueeeooo"
+    "aiueo"
+    "aauuoo"
+    "aiueo"
+    "aaieo-"
+    "uae";
+
+static uint32_t fold(uint32_t cp)
+{
+    if (cp == 0x3000) {
+        return ' ';
+    }
+    if (cp >= 0xff01 && cp <= 0xff5e) {
+        return cp - 0xfee0;
+    }
+    if (cp == 0xff9e) {
+        return VOICED_MARK;
+    }
+    if (cp == 0xff9f) {
+        return SEMI_VOICED_MARK;
+    }
+    if (cp >= HALFWIDTH_FIRST && cp <= HALFWIDTH_LAST) {
+        cp = halfwidth[cp - HALFWIDTH_FIRST];
+    }
+    // ヽ and ヾ have hiragana counterparts too
+    if ((cp >= KATAKANA_FIRST && cp <= KATAKANA_LAST) || cp == 0x30fd || cp == 0x30fe) {
+        return cp - 0x60;
+    }
+
+    return cp;
+}
+
+// kana with a voiced sound mark merged in, or 0 when it doesn't take one
+static uint32_t compose(uint32_t cp, uint32_t mark)
+{
+    int ha_row = cp >= 0x306f && cp <= 0x307b && (cp - 0x306f) % 3 == 0;
+
+    if (mark == SEMI_VOICED_MARK) {
+        return ha_row ? cp + 2 : 0;
+    }
+
+    if ((cp >= 0x304b && cp <= 0x3061 && cp % 2 == 1)
+            || (cp >= 0x3064 && cp <= 0x3068 && cp % 2 == 0)
+            || ha_row || cp == 0x309d) {
+        return cp + 1;
+    }
+    if (cp == 0x3046) {
+        return 0x3094;
+    }
+
+    return 0;
+}
+
+// what a long vowel mark after cp stands for, or 0 if it doesn't follow a vowel
+static uint32_t long_vowel(uint32_t cp)
+{
+    if (cp < HIRAGANA_FIRST || cp > HIRAGANA_LAST) {
+        return 0;
+    }
+
+    switch (vowels[cp - HIRAGANA_FIRST]) {
+        case 'a': return 0x3042;
+        case 'i':
+        case 'e': return 0x3044;
+        case 'u':
+        case 'o': return 0x3046;
+        default: return 0;
+    }
+}
+
+// every character that folds starts with one of these two bytes, anything
+// else (ASCII, kanji, ...) is copied as is
+#define FOLD_LEAD(c) ((unsigned char)(c) == 0xe3 || (unsigned char)(c) == 0xef)
+
+static size_t plain_run(const char *s, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i e3 = _mm_set1_epi8((char)0xe3);
+    const __m128i ef = _mm_set1_epi8((char)0xef);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, e3), _mm_cmpeq_epi8(v, ef)));
+
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+#endif
+
+    while (i < len && !FOLD_LEAD(s[i])) {
+        i++;
+    }
+
+    return i;
+}
+
+static size_t put_utf8(char *out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+
+    // nothing we write is outside the BMP or below U+0800
+    out[0] = (char)(0xe0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[2] = (char)(0x80 | (cp & 0x3f));
+    return 3;
+}
+
+// writes the normalized form of s to out, which needs NORMALIZE_SIZE(strlen(s))
+// bytes and may be s itself, returns its length
+size_t normalize(const char *s, char *out)
+{
+    size_t len = strlen(s);
+    size_t i = 0;
+    size_t o = 0;
+    // the last kana written and where, marks and long vowels change it
+    uint32_t prev = 0;
+    size_t prev_at = 0;
+
+    while (i < len) {
+        size_t run = plain_run(s + i, len - i);
+        if (run > 0) {
+            memmove(out + o, s + i, run);
+            i += run;
+            o += run;
+            prev = 0;
+            continue;
+        }
+
+        // hiragana up to U+307F never change, and are most of what a reading is
+        if ((unsigned char)s[i] == 0xe3 && (unsigned char)s[i + 1] == 0x81 && ((unsigned char)s[i + 2] & 0xc0) == 0x80) {
+            prev = 0x3000 | (uint32_t)(((unsigned char)s[i + 1] & 0x3f) << 6) | ((unsigned char)s[i + 2] & 0x3f);
+            prev_at = o;
+            memmove(out + o, s + i, 3);
+            i += 3;
+            o += 3;
+            continue;
+        }
+
+        const char *c = s + i;
+        uint32_t orig = utf8_decode(&c);
+        size_t n = (size_t)(c - (s + i));
+        uint32_t cp = fold(orig);
+
+        if (cp == VOICED_MARK || cp == SEMI_VOICED_MARK) {
+            uint32_t composed = prev != 0 ? compose(prev, cp) : 0;
+            if (composed != 0) {
+                put_utf8(out + prev_at, composed);
+                prev = composed;
+                i += n;
+                continue;
+            }
+        } else if (cp == LONG_VOWEL && long_vowel(prev) != 0) {
+            cp = long_vowel(prev);
+        }
+
+        if (cp == orig) {
+            memmove(out + o, s + i, n);
+        } else {
+            put_utf8(out + o, cp);
+        }
+        prev = cp;
+        prev_at = o;
+        i += n;
+        o += cp == orig ? n : (cp < 0x80 ? 1 : 3);
+    }
+    out[o] = '\0';
+
+    return o;
+}
+
+// reverses the len bytes of s character by character into out, so that
+// the result is still valid UTF-8
+void utf8_reverse(const char *s, size_t len, char *out)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        size_t n = 1;
+        while (i + n < len && ((unsigned char)s[i + n] & 0xc0) == 0x80) {
+            n++;
+        }
+
+        memcpy(out + len - i - n, s + i, n);
+        i += n;
+    }
+    out[len] = '\0';
+}
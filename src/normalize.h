@@ -0,0 +1,12 @@
+#ifndef __NORMALIZE_H__
+#define __NORMALIZE_H__
+
+#include <stdlib.h>
+
+// normalized text is never longer than the original
+#define NORMALIZE_SIZE(len) ((len) + 1)
+
+size_t normalize(const char *, char *);
+void utf8_reverse(const char *, size_t, char *);
+
+#endif // __NORMALIZE_H__
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+// Entries are formatted into a buffer of our own rather than with a printf
+// per field, and written out a buffer at a time. Every format writes one
+// entry at a time:
+//
+//  - text, the human readable format jdic has always printed
+//  - json, one JSON object per line with the query, seqnum, forms and senses,
+//    fields that are missing are left out
+//  - tsv, one line per entry with the query, seqnum, the kanji and the
+//    readings each separated by commas, and the senses separated by " / "
+//    with their glosses separated by "; ". Tabs, newlines and backslashes
+//    are escaped as \t, \n and \\.
+
+void output_init(output_t *o, FILE *out)
+{
+    o->out = out;
+    o->len = 0;
+    o->failed = 0;
+}
+
+// writes out what has been formatted so far, returns 1 if any write failed
+int output_flush(output_t *o)
+{
+    if (o->len > 0 && !o->failed && fwrite(o->buf, 1, o->len, o->out) != o->len) {
+        o->failed = 1;
+    }
+    o->len = 0;
+
+    return o->failed;
+}
+
+void output_mem(output_t *o, const char *s, size_t len)
+{
+    while (len > 0) {
+        if (o->len == OUTPUT_BUFFER) {
+            output_flush(o);
+        }
+
+        size_t n = OUTPUT_BUFFER - o->len < len ? OUTPUT_BUFFER - o->len : len;
+        memcpy(o->buf + o->len, s, n);
+        o->len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+void output_str(output_t *o, const char *s)
+{
+    output_mem(o, s, strlen(s));
+}
+
+void output_char(output_t *o, char c)
+{
+    if (o->len == OUTPUT_BUFFER) {
+        output_flush(o);
+    }
+    o->buf[o->len++] = c;
+}
+
+void output_int(output_t *o, long long n)
+{
+    char buf[24];
+    char *c = buf + sizeof(buf);
+    unsigned long long u = n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+
+    do {
+        *--c = (char)('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (n < 0) {
+        *--c = '-';
+    }
+
+    output_mem(o, c, (size_t)(buf + sizeof(buf) - c));
+}
+
+// s as a JSON string, quotes included
+void output_json(output_t *o, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    output_char(o, '"');
+    while (*s != '\0') {
+        // copy everything that needs no escaping at once
+        size_t run = 0;
+        while ((unsigned char)s[run] >= 0x20 && s[run] != '"' && s[run] != '\\') {
+            run++;
+        }
+        output_mem(o, s, run);
+        s += run;
+        if (*s == '\0') {
+            break;
+        }
+
+        output_char(o, '\\');
+        switch (*s) {
+            case '"': output_char(o, '"'); break;
+            case '\\': output_char(o, '\\'); break;
+            case '\n': output_char(o, 'n'); break;
+            case '\r': output_char(o, 'r'); break;
+            case '\t': output_char(o, 't'); break;
+            default:
+                output_str(o, "u00");
+                output_char(o, hex[(unsigned char)*s >> 4]);
+                output_char(o, hex[*s & 0xf]);
+                break;
+        }
+        s++;
+    }
+    output_char(o, '"');
+}
+
+// s as a TSV field
+void output_tsv(output_t *o, const char *s)
+{
+    while (*s != '\0') {
+        size_t run = strcspn(s, "\t\n\r\\");
+        output_mem(o, s, run);
+        s += run;
+        if (*s == '\0') {
+            break;
+        }
+
+        output_char(o, '\\');
+        output_char(o, *s == '\t' ? 't' : *s == '\n' ? 'n' : *s == '\r' ? 'r' : '\\');
+        s++;
+    }
+}
+
+static void text_form(output_t *o, const jmdict_form_t *f)
+{
+    if (f->kanji != NULL) {
+        output_str(o, f->kanji);
+        output_str(o, "【");
+        output_str(o, f->reading);
+        output_str(o, "】");
+    } else {
+        output_str(o, f->reading);
+    }
+}
+
+static void text_entry(output_t *o, const jdic_t *p, const char *query, const jmdict_entry_t *e)
+{
+    (void)query;
+
+    if (p->verbose >= 2) {
+        output_char(o, '[');
+        output_int(o, e->seqnum);
+        output_str(o, "] ");
+    }
+
+    if (e->nforms > 0) {
+        text_form(o, &e->forms[0]);
+        output_char(o, '\n');
+    }
+
+    for (int i = 0; i < e->nsenses; i++) {
+        const jmdict_sense_t *s = &e->senses[i];
+
+        if (i > 0) {
+            output_char(o, '\n');
+        }
+
+        output_str(o, "    ");
+        if (p->fast < 1 && s->pos != NULL) {
+            output_str(o, s->pos);
+            output_char(o, '.');
+        }
+        if (s->misc != NULL) {
+            output_char(o, ' ');
+            output_str(o, s->misc);
+        }
+        output_char(o, '\n');
+
+        for (int j = 0; j < s->nglosses; j++) {
+            if (j == 0) {
+                // sense numbers are right aligned to two digits
+                output_str(o, s->id >= 0 && s->id < 10 ? "     " : "    ");
+                output_int(o, s->id);
+                output_str(o, ") ");
+            } else {
+                output_str(o, "        ");
+            }
+            output_str(o, s->glosses[j].text);
+            output_char(o, '\n');
+        }
+
+        if (s->info != NULL) {
+            output_str(o, "       ");
+            output_str(o, s->info);
+            output_str(o, ".\n");
+        }
+        if (p->fast < 1 && s->xref != NULL) {
+            output_str(o, "       See also ");
+            output_str(o, s->xref);
+            output_char(o, '\n');
+        }
+    }
+
+    if (e->nforms > 1) {
+        output_str(o, "\n    Other forms:\n        ");
+        for (int i = 1; i < e->nforms; i++) {
+            text_form(o, &e->forms[i]);
+
+            if (i != e->nforms-1) {
+                output_str(o, "、");
+            }
+        }
+        output_char(o, '\n');
+    }
+
+    int first = 1;
+    for (int i = 0; i < e->nforms; i++) {
+        const jmdict_form_t *f = &e->forms[i];
+
+        // forms of the same kanji are next to each other and share its tags
+        if (f->tags == NULL || (i > 0 && e->forms[i-1].kanji == f->kanji)) {
+            continue;
+        }
+
+        if (first) {
+            output_str(o, "\n    Notes\n");
+            first = 0;
+        }
+
+        output_str(o, "        ");
+        output_str(o, f->kanji);
+        output_str(o, ": ");
+        output_str(o, f->tags);
+        output_char(o, '\n');
+    }
+
+    output_char(o, '\n');
+}
+
+// "name":value for a string that may be missing, preceded by a comma
+static void json_field(output_t *o, const char *name, const char *value)
+{
+    if (value == NULL) {
+        return;
+    }
+
+    output_str(o, ",\"");
+    output_str(o, name);
+    output_str(o, "\":");
+    output_json(o, value);
+}
+
+static void json_entry(output_t *o, const jdic_t *p, const char *query, const jmdict_entry_t *e)
+{
+    output_str(o, "{\"query\":");
+    output_json(o, query);
+    output_str(o, ",\"seqnum\":");
+    output_int(o, e->seqnum);
+
+    output_str(o, ",\"forms\":[");
+    for (int i = 0; i < e->nforms; i++) {
+        const jmdict_form_t *f = &e->forms[i];
+
+        output_str(o, i > 0 ? ",{\"reading\":" : "{\"reading\":");
+        output_json(o, f->reading);
+        json_field(o, "kanji", f->kanji);
+        json_field(o, "tags", f->tags);
+        output_char(o, '}');
+    }
+
+    output_str(o, "],\"senses\":[");
+    for (int i = 0; i < e->nsenses; i++) {
+        const jmdict_sense_t *s = &e->senses[i];
+
+        output_str(o, i > 0 ? ",{\"id\":" : "{\"id\":");
+        output_int(o, s->id);
+        json_field(o, "pos", p->fast < 1 ? s->pos : NULL);
+        json_field(o, "misc", s->misc);
+        json_field(o, "info", s->info);
+        json_field(o, "xref", p->fast < 1 ? s->xref : NULL);
+
+        output_str(o, ",\"glosses\":[");
+        for (int j = 0; j < s->nglosses; j++) {
+            output_str(o, j > 0 ? ",{\"lang\":" : "{\"lang\":");
+            output_json(o, s->glosses[j].lang);
+            output_str(o, ",\"text\":");
+            output_json(o, s->glosses[j].text);
+            output_char(o, '}');
+        }
+        output_str(o, "]}");
+    }
+
+    output_str(o, "]}\n");
+}
+
+static void tsv_entry(output_t *o, const jdic_t *p, const char *query, const jmdict_entry_t *e)
+{
+    (void)p;
+
+    output_tsv(o, query);
+    output_char(o, '\t');
+    output_int(o, e->seqnum);
+
+    output_char(o, '\t');
+    int n = 0;
+    for (int i = 0; i < e->nforms; i++) {
+        const char *kanji = e->forms[i].kanji;
+
+        // forms of the same kanji are next to each other
+        if (kanji == NULL || (i > 0 && e->forms[i-1].kanji == kanji)) {
+            continue;
+        }
+        if (n++ > 0) {
+            output_char(o, ',');
+        }
+        output_tsv(o, kanji);
+    }
+
+    output_char(o, '\t');
+    n = 0;
+    for (int i = 0; i < e->nforms; i++) {
+        const char *reading = e->forms[i].reading;
+
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) {
+            seen = !strcmp(e->forms[j].reading, reading);
+        }
+        if (seen) {
+            continue;
+        }
+        if (n++ > 0) {
+            output_char(o, ',');
+        }
+        output_tsv(o, reading);
+    }
+
+    output_char(o, '\t');
+    for (int i = 0; i < e->nsenses; i++) {
+        const jmdict_sense_t *s = &e->senses[i];
+
+        if (i > 0) {
+            output_str(o, " / ");
+        }
+        for (int j = 0; j < s->nglosses; j++) {
+            if (j > 0) {
+                output_str(o, "; ");
+            }
+            output_tsv(o, s->glosses[j].text);
+        }
+    }
+    output_char(o, '\n');
+}
+
+static void (*const formatters[])(output_t *, const jdic_t *, const char *, const jmdict_entry_t *) = {
+    [OUTPUT_TEXT] = text_entry,
+    [OUTPUT_JSON] = json_entry,
+    [OUTPUT_TSV] = tsv_entry,
+};
+
+static const char *format_names[] = {
+    [OUTPUT_TEXT] = "text",
+    [OUTPUT_JSON] = "json",
+    [OUTPUT_TSV] = "tsv",
+};
+
+// formats entry e, found looking up query, in the format p asks for
+void output_entry(output_t *o, const jdic_t *p, const char *query, const jmdict_entry_t *e)
+{
+    formatters[p->format](o, p, query, e);
+}
+
+// the format called name, returns 1 if there's no such format
+int output_parse_format(const char *name, output_format_t *format)
+{
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(*format_names); i++) {
+        if (!strcmp(name, format_names[i])) {
+            *format = (output_format_t)i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jdic.h"
+#include "jmdict.h"
+
+// bytes formatted before they are written out in one go
+#define OUTPUT_BUFFER (32 * 1024)
+
+typedef struct {
+    FILE *out;
+    size_t len;
+    int failed;
+    char buf[OUTPUT_BUFFER];
+} output_t;
+
+void output_init(output_t *, FILE *);
+void output_mem(output_t *, const char *, size_t);
+void output_str(output_t *, const char *);
+void output_char(output_t *, char);
+void output_int(output_t *, long long);
+void output_json(output_t *, const char *);
+void output_tsv(output_t *, const char *);
+int output_flush(output_t *);
+
+void output_entry(output_t *, const jdic_t *, const char *, const jmdict_entry_t *);
+int output_parse_format(const char *, output_format_t *);
+
+#endif // __OUTPUT_H__
@@ -0,0 +1,105 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "postings.h"
+
+// Posting lists are ascending lists of ids, stored as the differences
+// between consecutive ids in LEB128 varints (7 bits per byte, the high bit
+// set on every byte but the last).
+
+size_t varint_put(uint8_t *buf, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+
+    return n;
+}
+
+// buf has to have room for VARINT_MAX bytes per id, returns the size used
+size_t postings_encode(const uint32_t *ids, size_t n, uint8_t *buf)
+{
+    uint32_t prev = 0;
+    size_t size = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        size += varint_put(buf + size, ids[i] - prev);
+        prev = ids[i];
+    }
+
+    return size;
+}
+
+void postings_decode(const uint8_t *buf, size_t n, uint32_t *ids)
+{
+    uint32_t prev = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t v = 0;
+        int shift = 0;
+
+        while (*buf & 0x80) {
+            v |= (uint32_t)(*buf++ & 0x7f) << shift;
+            shift += 7;
+        }
+        v |= (uint32_t)*buf++ << shift;
+
+        prev += v;
+        ids[i] = prev;
+    }
+}
+
+// writes the ids in both a and b to out, which can't be either of them,
+// returns the number of ids written
+size_t postings_intersect(const uint32_t *a, size_t na, const uint32_t *b, size_t nb, uint32_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+
+#ifdef __SSE2__
+    // compare blocks of four ids against each other in every rotation, and
+    // move on from whichever block ends with the smaller id
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va, vb),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+
+        for (int k = 0; k < 4; k++) {
+            if (mask & (1 << k)) {
+                out[n++] = a[i + (size_t)k];
+            }
+        }
+
+        uint32_t amax = a[i + 3];
+        uint32_t bmax = b[j + 3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+#endif
+
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) {
+            i++;
+        } else if (a[i] > b[j]) {
+            j++;
+        } else {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,15 @@
+#ifndef __POSTINGS_H__
+#define __POSTINGS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// maximum size of a single varint
+#define VARINT_MAX 5
+
+size_t varint_put(uint8_t *, uint32_t);
+size_t postings_encode(const uint32_t *, size_t, uint8_t *);
+void postings_decode(const uint8_t *, size_t, uint32_t *);
+size_t postings_intersect(const uint32_t *, size_t, const uint32_t *, size_t, uint32_t *);
+
+#endif // __POSTINGS_H__
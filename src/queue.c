@@ -0,0 +1,53 @@
+#include <sched.h>
+#include <time.h>
+
+#include "queue.h"
+
+// spin for a while before falling back to sleeping, the other side is
+// usually only a few microseconds away from making room (or data)
+static void backoff(int *spins)
+{
+    if (*spins < 64) {
+        (*spins)++;
+        sched_yield();
+    } else {
+        struct timespec ts = { .tv_nsec = 50000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void queue_init(queue_t *q)
+{
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+// blocks while the queue is full
+void queue_push(queue_t *q, void *ptr)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int spins = 0;
+
+    while (tail - atomic_load_explicit(&q->head, memory_order_acquire) == QUEUE_SIZE) {
+        backoff(&spins);
+    }
+
+    q->slots[tail & (QUEUE_SIZE - 1)] = ptr;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+// blocks while the queue is empty
+void *queue_pop(queue_t *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    int spins = 0;
+
+    while (atomic_load_explicit(&q->tail, memory_order_acquire) == head) {
+        backoff(&spins);
+    }
+
+    void *ptr = q->slots[head & (QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+    return ptr;
+}
@@ -0,0 +1,21 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// must be a power of two
+#define QUEUE_SIZE 16
+
+// bounded lock-free single producer, single consumer queue
+typedef struct {
+    void *slots[QUEUE_SIZE];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+} queue_t;
+
+void queue_init(queue_t *);
+void queue_push(queue_t *, void *);
+void *queue_pop(queue_t *);
+
+#endif // __QUEUE_H__
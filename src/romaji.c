@@ -0,0 +1,205 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "romaji.h"
+
+// Romaji are turned into kana by a transducer: a table of transitions on
+// lowercase letters, compiled once from the syllables below, where every
+// state reached by a complete syllable has the kana it stands for. The
+// longest syllable is taken at every position. Lowercase romaji become
+// hiragana and uppercase romaji katakana, like most IMEs do it.
+
+typedef struct {
+    const char *romaji;
+    const char *kana;
+} syllable_t;
+
+// Hepburn and Kunrei-shiki spellings, and the x/l prefixed small kana
+static const syllable_t syllables[] = {
+    { "a", "あ" }, { "i", "い" }, { "u", "う" }, { "e", "え" }, { "o", "お" },
+    { "ka", "か" }, { "ki", "き" }, { "ku", "く" }, { "ke", "け" }, { "ko", "こ" },
+    { "kya", "きゃ" }, { "kyu", "きゅ" }, { "kyo", "きょ" },
+    { "ga", "が" }, { "gi", "ぎ" }, { "gu", "ぐ" }, { "ge", "げ" }, { "go", "ご" },
+    { "gya", "ぎゃ" }, { "gyu", "ぎゅ" }, { "gyo", "ぎょ" },
+    { "sa", "さ" }, { "shi", "し" }, { "si", "し" }, { "su", "す" }, { "se", "せ" }, { "so", "そ" },
+    { "sha", "しゃ" }, { "shu", "しゅ" }, { "sho", "しょ" }, { "she", "しぇ" },
+    { "sya", "しゃ" }, { "syu", "しゅ" }, { "syo", "しょ" },
+    { "za", "ざ" }, { "ji", "じ" }, { "zi", "じ" }, { "zu", "ず" }, { "ze", "ぜ" }, { "zo", "ぞ" },
+    { "ja", "じゃ" }, { "ju", "じゅ" }, { "jo", "じょ" }, { "je", "じぇ" },
+    { "jya", "じゃ" }, { "jyu", "じゅ" }, { "jyo", "じょ" },
+    { "zya", "じゃ" }, { "zyu", "じゅ" }, { "zyo", "じょ" },
+    { "ta", "た" }, { "chi", "ち" }, { "ti", "ち" }, { "tsu", "つ" }, { "tu", "つ" }, { "te", "て" }, { "to", "と" },
+    { "cha", "ちゃ" }, { "chu", "ちゅ" }, { "cho", "ちょ" }, { "che", "ちぇ" },
+    { "tya", "ちゃ" }, { "tyu", "ちゅ" }, { "tyo", "ちょ" },
+    { "cya", "ちゃ" }, { "cyu", "ちゅ" }, { "cyo", "ちょ" },
+    { "da", "だ" }, { "di", "ぢ" }, { "du", "づ" }, { "de", "で" }, { "do", "ど" },
+    { "dya", "ぢゃ" }, { "dyu", "ぢゅ" }, { "dyo", "ぢょ" },
+    { "na", "な" }, { "ni", "に" }, { "nu", "ぬ" }, { "ne", "ね" }, { "no", "の" },
+    { "nya", "にゃ" }, { "nyu", "にゅ" }, { "nyo", "にょ" },
+    { "n", "ん" },
+    { "ha", "は" }, { "hi", "ひ" }, { "fu", "ふ" }, { "hu", "ふ" }, { "he", "へ" }, { "ho", "ほ" },
+    { "hya", "ひゃ" }, { "hyu", "ひゅ" }, { "hyo", "ひょ" },
+    { "fa", "ふぁ" }, { "fi", "ふぃ" }, { "fe", "ふぇ" }, { "fo", "ふぉ" },
+    { "ba", "ば" }, { "bi", "び" }, { "bu", "ぶ" }, { "be", "べ" }, { "bo", "ぼ" },
+    { "bya", "びゃ" }, { "byu", "びゅ" }, { "byo", "びょ" },
+    { "pa", "ぱ" }, { "pi", "ぴ" }, { "pu", "ぷ" }, { "pe", "ぺ" }, { "po", "ぽ" },
+    { "pya", "ぴゃ" }, { "pyu", "ぴゅ" }, { "pyo", "ぴょ" },
+    { "ma", "ま" }, { "mi", "み" }, { "mu", "む" }, { "me", "め" }, { "mo", "も" },
+    { "mya", "みゃ" }, { "myu", "みゅ" }, { "myo", "みょ" },
+    { "ya", "や" }, { "yu", "ゆ" }, { "yo", "よ" },
+    { "ra", "ら" }, { "ri", "り" }, { "ru", "る" }, { "re", "れ" }, { "ro", "ろ" },
+    { "rya", "りゃ" }, { "ryu", "りゅ" }, { "ryo", "りょ" },
+    { "wa", "わ" }, { "wi", "ゐ" }, { "we", "ゑ" }, { "wo", "を" },
+    { "vu", "ゔ" }, { "va", "ゔぁ" }, { "vi", "ゔぃ" }, { "ve", "ゔぇ" }, { "vo", "ゔぉ" },
+    { "xa", "ぁ" }, { "xi", "ぃ" }, { "xu", "ぅ" }, { "xe", "ぇ" }, { "xo", "ぉ" },
+    { "xya", "ゃ" }, { "xyu", "ゅ" }, { "xyo", "ょ" }, { "xtu", "っ" }, { "xwa", "ゎ" },
+    { "la", "ぁ" }, { "li", "ぃ" }, { "lu", "ぅ" }, { "le", "ぇ" }, { "lo", "ぉ" },
+    { "lya", "ゃ" }, { "lyu", "ゅ" }, { "lyo", "ょ" }, { "ltu", "っ" }, { "lwa", "ゎ" },
+};
+
+#define NSYLLABLES (sizeof(syllables) / sizeof(*syllables))
+// one state per distinct prefix of a syllable, and the start state
+#define MAX_STATES 256
+
+// 0 is both the start state and "no transition", nothing leads back to it
+static unsigned char next[MAX_STATES][26];
+static const char *output[MAX_STATES];
+static pthread_once_t compiled = PTHREAD_ONCE_INIT;
+
+static void compile(void)
+{
+    int nstates = 1;
+
+    for (size_t i = 0; i < NSYLLABLES; i++) {
+        int state = 0;
+
+        for (const char *c = syllables[i].romaji; *c != '\0'; c++) {
+            unsigned char *to = &next[state][*c - 'a'];
+
+            if (*to == 0) {
+                *to = (unsigned char)nstates++;
+            }
+            state = *to;
+        }
+        output[state] = syllables[i].kana;
+    }
+}
+
+static int is_vowel(char c)
+{
+    return c == 'a' || c == 'i' || c == 'u' || c == 'e' || c == 'o';
+}
+
+static char lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+// appends kana to out, as katakana if asked, returns 1 if it doesn't fit
+static int emit(const char *kana, int katakana, char **out, const char *end)
+{
+    size_t len = strlen(kana);
+    if ((size_t)(end - *out) <= len) {
+        return 1;
+    }
+
+    memcpy(*out, kana, len);
+    if (katakana) {
+        // hiragana and katakana are 0x60 apart, every hiragana above is
+        // E3 81 xx or E3 82 xx, and lands in E3 82 xx or E3 83 xx
+        for (size_t i = 0; i < len; i += 3) {
+            unsigned char *k = (unsigned char *)*out + i;
+            int cp = ((k[1] & 0x3f) << 6 | (k[2] & 0x3f)) + 0x60;
+
+            k[1] = (unsigned char)(0x80 | (cp >> 6));
+            k[2] = (unsigned char)(0x80 | (cp & 0x3f));
+        }
+    }
+    *out += len;
+
+    return 0;
+}
+
+// writes the kana for romaji to kana, which should have room for
+// ROMAJI_KANA_SIZE bytes, the GLOB wildcards * and ? are kept as they are.
+// Returns 1 if romaji isn't made up of romaji alone.
+int romaji_to_kana(const char *romaji, char *kana, size_t size)
+{
+    const char *c = romaji;
+    char *out = kana;
+    const char *end = kana + size;
+
+    pthread_once(&compiled, compile);
+
+    if (*c == '\0') {
+        return 1;
+    }
+
+    while (*c != '\0') {
+        char l = lower(*c);
+        int katakana = *c >= 'A' && *c <= 'Z';
+
+        if (*c == '*' || *c == '?') {
+            if (end - out <= 1) {
+                return 1;
+            }
+            *out++ = *c++;
+            continue;
+        }
+        if (*c == '-') {
+            if (emit("ー", 0, &out, end)) {
+                return 1;
+            }
+            c++;
+            continue;
+        }
+        if (l < 'a' || l > 'z') {
+            return 1;
+        }
+
+        // a doubled consonant, or t before ch, is a small tsu
+        char n1 = lower(c[1]);
+        if (l != 'n' && !is_vowel(l) && (n1 == l || (l == 't' && n1 == 'c' && lower(c[2]) == 'h'))) {
+            if (emit("っ", katakana, &out, end)) {
+                return 1;
+            }
+            c++;
+            continue;
+        }
+
+        // nn is a single n, unless the second one starts a syllable
+        if (l == 'n' && n1 == 'n' && !is_vowel(lower(c[2])) && lower(c[2]) != 'y') {
+            if (emit("ん", katakana, &out, end)) {
+                return 1;
+            }
+            c += 2;
+            continue;
+        }
+
+        int state = 0;
+        const char *match = NULL;
+        size_t len = 0;
+        for (size_t i = 0; c[i] != '\0'; i++) {
+            char ci = lower(c[i]);
+            if (ci < 'a' || ci > 'z' || (state = next[state][ci - 'a']) == 0) {
+                break;
+            }
+            if (output[state] != NULL) {
+                match = output[state];
+                len = i + 1;
+            }
+        }
+        if (match == NULL || emit(match, katakana, &out, end)) {
+            return 1;
+        }
+        c += len;
+
+        // n' separates ん from a following vowel
+        if (len == 1 && l == 'n' && *c == '\'') {
+            c++;
+        }
+    }
+    *out = '\0';
+
+    return 0;
+}
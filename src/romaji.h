@@ -0,0 +1,11 @@
+#ifndef __ROMAJI_H__
+#define __ROMAJI_H__
+
+#include <stdlib.h>
+
+// kana take at most three times as many bytes as the romaji they're written with
+#define ROMAJI_KANA_SIZE(len) ((len) * 3 + 1)
+
+int romaji_to_kana(const char *, char *, size_t);
+
+#endif // __ROMAJI_H__
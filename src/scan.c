@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sqlite3.h>
+#include "array.h"
+#include "util.h"
+#include "snapshot.h"
+#include "scan.h"
+
+// Scanning splits running text into the longest kanji or reading texts in
+// the dictionary, for every position from the start. The texts are put in
+// a byte trie first, so finding the longest match at a position is a walk
+// down the trie for as long as the text goes on matching.
+//
+// Every token found is written as a line with its byte offset and length,
+// its text and the seqnums of the entries it's a form of:
+//
+//     <offset>\t<length>\t<text>\t<seqnum>[,<seqnum>...]\n
+
+#define SCAN_BUFFER (1 << 20)
+#define SCAN_NONE UINT32_MAX
+
+// the children of a node are stored next to each other, sorted by byte
+typedef struct {
+    uint32_t child;
+    // keys with the text that leads to this node, or SCAN_NONE
+    uint32_t key;
+    uint16_t nchild;
+    uint16_t nkeys;
+    unsigned char byte;
+} trie_node_t;
+
+typedef struct {
+    const char *pool;
+    form_key_t *keys;
+    size_t nkeys;
+    array_t nodes;
+    // the longest text, a match can't go on past it
+    size_t maxlen;
+} trie_t;
+
+#define KEY_TEXT(t, i) ((t)->pool + (t)->keys[i].text)
+
+static int new_nodes(trie_t *t, size_t n, uint32_t *first)
+{
+    if (t->nodes.size + n >= SCAN_NONE || !array_reserve(&t->nodes, n)) {
+        return 1;
+    }
+
+    *first = (uint32_t)t->nodes.size;
+    memset(ARRAY((&t->nodes), trie_node_t) + t->nodes.size, 0, n * sizeof(trie_node_t));
+    t->nodes.size += n;
+
+    return 0;
+}
+
+// builds the node for keys [lo, hi), which all share their first depth bytes
+static int build_node(trie_t *t, uint32_t node, size_t lo, size_t hi, size_t depth)
+{
+    trie_node_t *nd = ARRAY((&t->nodes), trie_node_t) + node;
+
+    // shorter texts sort first, the keys that end here are at the start
+    nd->key = SCAN_NONE;
+    size_t i = lo;
+    while (i < hi && KEY_TEXT(t, i)[depth] == '\0') {
+        i++;
+    }
+    if (i > lo) {
+        nd->key = (uint32_t)lo;
+        nd->nkeys = (uint16_t)(i - lo > UINT16_MAX ? UINT16_MAX : i - lo);
+    }
+    if (depth > t->maxlen && i > lo) {
+        t->maxlen = depth;
+    }
+
+    size_t nchild = 0;
+    for (size_t j = i; j < hi; j++) {
+        if (j == i || KEY_TEXT(t, j)[depth] != KEY_TEXT(t, j - 1)[depth]) {
+            nchild++;
+        }
+    }
+    if (nchild == 0) {
+        return 0;
+    }
+
+    uint32_t first;
+    if (new_nodes(t, nchild, &first)) {
+        return 1;
+    }
+    // the array may have moved
+    nd = ARRAY((&t->nodes), trie_node_t) + node;
+    nd->child = first;
+    nd->nchild = (uint16_t)nchild;
+
+    size_t c = 0;
+    for (size_t j = i; j < hi; c++) {
+        unsigned char byte = (unsigned char)KEY_TEXT(t, j)[depth];
+        size_t end = j + 1;
+        while (end < hi && (unsigned char)KEY_TEXT(t, end)[depth] == byte) {
+            end++;
+        }
+
+        ARRAY((&t->nodes), trie_node_t)[first + c].byte = byte;
+        if (build_node(t, first + (uint32_t)c, j, end, depth + 1)) {
+            return 1;
+        }
+        j = end;
+    }
+
+    return 0;
+}
+
+// reads every kanji and reading text, sorted, into keys and pool
+static int database_keys(jdic_t *p, trie_t *t, array_t *keys, array_t *pool)
+{
+    const char *sql =
+        "SELECT text, seqnum FROM jmdict_kanji "
+        "UNION SELECT text, seqnum FROM jmdict_reading "
+        "ORDER BY 1, 2";
+    struct sqlite3_stmt *st = NULL;
+    int ret = 1;
+
+    if (sqlite3_prepare_v2(p->db, sql, -1, &st, NULL) != SQLITE_OK) {
+        fprintf(stderr, "ERR! Failed to prepare \"%s\": %s\n", sql, sqlite3_errmsg(p->db));
+
+        return 1;
+    }
+
+    int ec;
+    while ((ec = sqlite3_step(st)) == SQLITE_ROW) {
+        size_t len = (size_t)sqlite3_column_bytes(st, 0);
+
+        if (pool->size + len + 1 >= SCAN_NONE || !array_reserve(pool, len + 1) || !array_reserve(keys, 1)) {
+            goto cleanup;
+        }
+
+        form_key_t *k = ARRAY(keys, form_key_t) + keys->size++;
+        k->text = (uint32_t)pool->size;
+        k->seqnum = sqlite3_column_int(st, 1);
+
+        memcpy(ARRAY(pool, char) + pool->size, sqlite3_column_text(st, 0), len + 1);
+        pool->size += len + 1;
+    }
+    ret = ec != SQLITE_DONE;
+    t->pool = ARRAY(pool, char);
+
+cleanup:
+    sqlite3_finalize(st);
+    return ret;
+}
+
+// appends n to buf, returns the number of characters written
+static size_t put_int(char *buf, long long n)
+{
+    char tmp[24];
+    size_t len = 0;
+    unsigned long long u = n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+
+    do {
+        tmp[len++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (n < 0) {
+        tmp[len++] = '-';
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
+    }
+
+    return len;
+}
+
+// length of the longest text in the trie that buf starts with, and its node
+static size_t longest_match(const trie_t *t, const unsigned char *buf, size_t len, const trie_node_t **match)
+{
+    const trie_node_t *nodes = ARRAY((&t->nodes), trie_node_t);
+    const trie_node_t *nd = &nodes[0];
+    size_t best = 0;
+
+    for (size_t i = 0; i < len && nd->nchild > 0; i++) {
+        const trie_node_t *c = &nodes[nd->child];
+        uint32_t lo = 0;
+        uint32_t hi = nd->nchild;
+
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+
+            if (c[mid].byte < buf[i]) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == nd->nchild || c[lo].byte != buf[i]) {
+            break;
+        }
+
+        nd = &c[lo];
+        if (nd->key != SCAN_NONE) {
+            best = i + 1;
+            *match = nd;
+        }
+    }
+
+    return best;
+}
+
+// writes the longest matches in the text read from in to out
+int scan_run(jdic_t *p, FILE *in, FILE *out)
+{
+    long long start = mstime();
+    trie_t t = { .nodes = array_new(1 << 16, sizeof(trie_node_t)) };
+    array_t keys = array_new(1 << 16, sizeof(form_key_t));
+    array_t pool = array_new(1 << 16, sizeof(char));
+    unsigned char *buf = malloc(SCAN_BUFFER);
+    char *line = NULL;
+    int ret = 1;
+
+    if (buf == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for scanning\n");
+
+        goto cleanup;
+    }
+
+    if (p->snap != NULL
+            ? (t.pool = snapshot_forms(p, &keys)) == NULL
+            : database_keys(p, &t, &keys, &pool)) {
+        fprintf(stderr, "ERR! Failed to read the dictionary forms\n");
+
+        goto cleanup;
+    }
+    t.keys = ARRAY((&keys), form_key_t);
+    t.nkeys = keys.size;
+
+    uint32_t root;
+    if (new_nodes(&t, 1, &root) || build_node(&t, root, 0, t.nkeys, 0)) {
+        fprintf(stderr, "ERR! Failed to allocate memory for scanning\n");
+
+        goto cleanup;
+    }
+    if (t.maxlen >= SCAN_BUFFER / 2) {
+        fprintf(stderr, "ERR! Dictionary forms are too long to scan for\n");
+
+        goto cleanup;
+    }
+
+    // a line can't be longer than the longest text and the seqnums of every entry
+    line = malloc(t.maxlen + 64 + (size_t)UINT16_MAX * 12);
+    if (line == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for scanning\n");
+
+        goto cleanup;
+    }
+
+    if (p->verbose) {
+        fprintf(stderr, "Built a trie of %zu forms in %lims (%zu nodes)\n",
+                t.nkeys, (long)(mstime() - start), t.nodes.size);
+    }
+    start = mstime();
+
+    long long offset = 0;
+    long long ntokens = 0;
+    size_t pos = 0;
+    size_t filled = 0;
+    int eof = 0;
+    for (;;) {
+        // keep enough of the text buffered that the longest form fits
+        if (!eof && filled - pos <= t.maxlen) {
+            memmove(buf, buf + pos, filled - pos);
+            offset += (long long)pos;
+            filled -= pos;
+            pos = 0;
+
+            size_t n = fread(buf + filled, 1, SCAN_BUFFER - filled, in);
+            if (n == 0) {
+                eof = 1;
+            }
+            filled += n;
+        }
+        if (pos >= filled) {
+            break;
+        }
+
+        const trie_node_t *match = NULL;
+        size_t len = longest_match(&t, buf + pos, filled - pos, &match);
+        if (len == 0) {
+            // on to the next character
+            do {
+                pos++;
+            } while (pos < filled && (buf[pos] & 0xc0) == 0x80);
+            continue;
+        }
+
+        char *c = line;
+        c += put_int(c, offset + (long long)pos);
+        *c++ = '\t';
+        c += put_int(c, (long long)len);
+        *c++ = '\t';
+        memcpy(c, buf + pos, len);
+        c += len;
+        *c++ = '\t';
+        for (uint32_t i = 0; i < match->nkeys; i++) {
+            if (i > 0) *c++ = ',';
+            c += put_int(c, t.keys[match->key + i].seqnum);
+        }
+        *c++ = '\n';
+        if (fwrite(line, 1, (size_t)(c - line), out) != (size_t)(c - line)) {
+            fprintf(stderr, "ERR! Failed to write scanned forms\n");
+
+            goto cleanup;
+        }
+
+        ntokens++;
+        pos += len;
+    }
+
+    if (ferror(in)) {
+        fprintf(stderr, "ERR! Failed to read text to scan\n");
+
+        goto cleanup;
+    }
+    if (fflush(out) != 0 || ferror(out)) {
+        fprintf(stderr, "ERR! Failed to write scanned forms\n");
+
+        goto cleanup;
+    }
+
+    if (p->verbose) {
+        long long ms = mstime() - start;
+        double mb = (double)(offset + (long long)filled) / (1 << 20);
+        fprintf(stderr, "Scanned %.1fMB in %llims (%.1fMB/s), %lli tokens\n",
+                mb, ms, ms > 0 ? mb * 1000.0 / (double)ms : 0.0, ntokens);
+    }
+    ret = 0;
+
+cleanup:
+    free(buf);
+    free(line);
+    array_free(&t.nodes, NULL);
+    array_free(&keys, NULL);
+    array_free(&pool, NULL);
+
+    return ret;
+}
@@ -0,0 +1,10 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+#include <stdio.h>
+
+#include "jdic.h"
+
+int scan_run(jdic_t *, FILE *, FILE *);
+
+#endif // __SCAN_H__
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "jmdict.h"
+#include "fuzzy.h"
+#include "server.h"
+
+// Lookups over a unix socket. A request is a single line:
+//
+//     <mode> <limit> <page> <after> <distance> <fast> <verbose> <format> <lang> <query>\n
+//
+// and is answered with the output of the lookup, a NUL byte and the number
+// of entries found followed by a newline. A connection can be used for as
+// many requests as the client likes, a worker serves it until it hangs up
+// or stays idle for too long, which is not long at all once other
+// connections are waiting for a worker. A request of just "stats" is
+// answered with the hit and miss counts of the caches, the same way.
+//
+// The verbose level of a request only changes what is sent back, the
+// diagnostics on stderr are the server's own.
+
+#define SERVER_BACKLOG 64
+// number of accepted connections waiting for a worker
+#define SERVER_QUEUE 64
+// requests can't ask for more entries than this at once
+#define SERVER_MAX_LIMIT 1000
+// longest request line taken
+#define SERVER_MAX_REQUEST (16 * 1024)
+// how often a worker waiting for a request checks for other connections
+#define SERVER_POLL_MS 1000
+// idle connections are hung up on after this long even when nobody waits
+#define SERVER_IDLE_MS (60 * 1000)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fds[SERVER_QUEUE];
+    size_t head;
+    size_t count;
+    int stop;
+} conn_queue_t;
+
+// requests read from a connection but not answered yet
+typedef struct {
+    int fd;
+    size_t len;
+    // room for a terminator after a last line without a newline
+    char buf[SERVER_MAX_REQUEST + 1];
+} conn_t;
+
+typedef struct {
+    pthread_t tid;
+    const jdic_t *base;
+    const char *db;
+    conn_queue_t *queue;
+    // connection being served, -1 when idle, protected by queue->lock
+    int fd;
+} worker_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int sig)
+{
+    stopping = 1;
+}
+
+// waits for a connection, returns -1 once the server is stopping
+static int queue_take(worker_t *w)
+{
+    conn_queue_t *q = w->queue;
+    int fd = -1;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->stop) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    if (!q->stop) {
+        fd = q->fds[q->head];
+        q->head = (q->head + 1) % SERVER_QUEUE;
+        q->count--;
+    }
+    w->fd = fd;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    return fd;
+}
+
+static int queue_waiting(conn_queue_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    int waiting = q->count > 0;
+    pthread_mutex_unlock(&q->lock);
+
+    return waiting;
+}
+
+// reads the next request line of c and terminates it, returns the number of
+// bytes it took up, 0 when it's too long and -1 when the client hung up or
+// has been idle for too long
+static ssize_t read_request(worker_t *w, conn_t *c)
+{
+    int idle = 0;
+
+    for (;;) {
+        char *nl = memchr(c->buf, '\n', c->len);
+        if (nl != NULL) {
+            *nl = '\0';
+            return nl - c->buf + 1;
+        }
+        if (c->len == SERVER_MAX_REQUEST) {
+            return 0;
+        }
+
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, SERVER_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (ready == 0) {
+            // give the worker to the next connection rather than wait
+            idle += SERVER_POLL_MS;
+            if (idle >= SERVER_IDLE_MS || queue_waiting(w->queue)) {
+                return -1;
+            }
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        ssize_t n = read(c->fd, c->buf + c->len, SERVER_MAX_REQUEST - c->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // the client may not end its last request with a newline
+            if (n == 0 && c->len > 0) {
+                c->buf[c->len] = '\0';
+                return (ssize_t)c->len;
+            }
+            return -1;
+        }
+        c->len += (size_t)n;
+    }
+}
+
+static int parse_request(char *line, jdic_t *p, search_mode_t *mode, char **query)
+{
+    int m, f, n = 0;
+
+    // p->trace stays the server's own
+    if (sscanf(line, "%d %d %d %d %d %d %d %d %3s %n", &m, &p->limit, &p->page, &p->after, &p->distance, &p->fast, &p->verbose, &f, p->lang, &n) != 9 || n == 0) {
+        return 1;
+    }
+    if (m < SEARCH_AUTO || m > SEARCH_FUZZY || p->limit < 1 || p->limit > SERVER_MAX_LIMIT || p->page < 1
+            || p->distance < 0 || p->distance > FUZZY_MAX_DISTANCE || f < OUTPUT_TEXT || f > OUTPUT_TSV) {
+        return 1;
+    }
+
+    *mode = (search_mode_t)m;
+    p->format = (output_format_t)f;
+    *query = line + n;
+
+    return 0;
+}
+
+static void serve_conn(worker_t *w, jdic_t *p, conn_t *c, int fd)
+{
+    int ofd = dup(fd);
+    FILE *out = ofd >= 0 ? fdopen(ofd, "w") : NULL;
+    ssize_t used;
+
+    if (out == NULL) {
+        fprintf(stderr, "ERR! Failed to open connection\n");
+
+        if (ofd >= 0) close(ofd);
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->len = 0;
+    while ((used = read_request(w, c)) > 0) {
+        char *line = c->buf;
+        jdic_t req = *p;
+        search_mode_t mode;
+        char *query;
+        int count = -1;
+
+        if (!strcmp(line, "stats")) {
+            jdic_cache_report(p, out);
+            count = 0;
+        } else if (parse_request(line, &req, &mode, &query)) {
+            fprintf(out, "ERR! Bad request\n");
+        } else {
+            count = jdic_lookup(&req, mode, query, out);
+        }
+
+        // statements are cached on the copy, it's seen the database version
+        // and may have grown the arena
+        memcpy(p->stmts, req.stmts, sizeof(p->stmts));
+        p->data_version = req.data_version;
+        p->arena = req.arena;
+
+        fprintf(out, "%c%i\n", '\0', count);
+        if (fflush(out) != 0) {
+            break;
+        }
+
+        c->len -= (size_t)used;
+        memmove(c->buf, c->buf + used, c->len);
+    }
+    if (used == 0) {
+        fprintf(out, "ERR! Request too long\n%c%i\n", '\0', -1);
+    }
+
+    fclose(out);
+    close(fd);
+}
+
+static void *worker_thread(void *arg)
+{
+    worker_t *w = arg;
+    jdic_t p = *w->base;
+    conn_t *c = malloc(sizeof(conn_t));
+
+    // every worker gets a connection (and statements) of its own
+    jmdict_open_reader(&p, w->db);
+
+    int fd;
+    while ((fd = queue_take(w)) >= 0) {
+        if (c == NULL || (p.snap == NULL && p.db == NULL)) {
+            close(fd);
+        } else {
+            serve_conn(w, &p, c, fd);
+        }
+
+        pthread_mutex_lock(&w->queue->lock);
+        w->fd = -1;
+        pthread_mutex_unlock(&w->queue->lock);
+    }
+
+    jmdict_close(&p);
+    free(c);
+    return NULL;
+}
+
+static int unix_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+
+        return 1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+// a socket left behind by a server that's gone would make bind fail, only
+// that is removed, anything else at path is left alone
+static int remove_stale_socket(const char *path, const struct sockaddr_un *addr)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : 1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "Refusing to replace %s, it is not a socket\n", path);
+
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return 1;
+    }
+    int live = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+    close(fd);
+    if (live) {
+        fprintf(stderr, "A server is already listening on %s\n", path);
+
+        return 1;
+    }
+
+    return unlink(path) != 0;
+}
+
+// serves lookups on a unix socket with nworkers threads until interrupted,
+// lookups use the snapshot in p or a read-only connection to db per worker
+int server_run(jdic_t *p, const char *db, const char *path, int nworkers)
+{
+    struct sockaddr_un addr;
+    conn_queue_t queue = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    int ret = 0;
+
+    if (unix_addr(path, &addr)) {
+        return 1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        fprintf(stderr, "Failed to create socket\n");
+
+        return 1;
+    }
+
+    if (remove_stale_socket(path, &addr)) {
+        fprintf(stderr, "Failed to listen on %s\n", path);
+
+        close(sock);
+        return 1;
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, SERVER_BACKLOG) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+
+        close(sock);
+        return 1;
+    }
+
+    worker_t *workers = calloc((size_t)nworkers, sizeof(worker_t));
+    if (workers == NULL) {
+        fprintf(stderr, "Failed to allocate memory for workers\n");
+
+        close(sock);
+        unlink(path);
+        return 1;
+    }
+
+    // no SA_RESTART, accept has to return when we're asked to stop
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // clients going away are noticed when flushing their response
+    signal(SIGPIPE, SIG_IGN);
+
+    // signals have to interrupt accept in this thread, not land in a worker
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+
+    int nstarted = 0;
+    for (; nstarted < nworkers; nstarted++) {
+        worker_t *w = &workers[nstarted];
+        *w = (worker_t){ .base = p, .db = db, .queue = &queue, .fd = -1 };
+
+        if (pthread_create(&w->tid, NULL, worker_thread, w) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+
+            ret = 1;
+            stopping = 1;
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (p->verbose) {
+        printf("Serving lookups on %s with %i worker(s)\n", path, nstarted);
+        fflush(stdout);
+    }
+
+    while (!stopping) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "Failed to accept connection: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == SERVER_QUEUE && !stopping) {
+            pthread_cond_wait(&queue.cond, &queue.lock);
+        }
+        if (stopping) {
+            pthread_mutex_unlock(&queue.lock);
+            close(fd);
+            break;
+        }
+        queue.fds[(queue.head + queue.count) % SERVER_QUEUE] = fd;
+        queue.count++;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    // wake idle workers, and hang up on clients so busy ones finish too
+    pthread_mutex_lock(&queue.lock);
+    queue.stop = 1;
+    for (int i = 0; i < nstarted; i++) {
+        if (workers[i].fd >= 0) {
+            shutdown(workers[i].fd, SHUT_RDWR);
+        }
+    }
+    while (queue.count > 0) {
+        close(queue.fds[queue.head]);
+        queue.head = (queue.head + 1) % SERVER_QUEUE;
+        queue.count--;
+    }
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (int i = 0; i < nstarted; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    close(sock);
+    unlink(path);
+    free(workers);
+
+    if (p->verbose) {
+        jdic_cache_report(p, stdout);
+    }
+
+    return ret;
+}
+
+// looks up query through the server listening on path, like jdic_lookup
+int client_lookup(jdic_t *p, const char *path, search_mode_t mode, const char *query, FILE *out)
+{
+    struct sockaddr_un addr;
+
+    if (unix_addr(path, &addr)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", path, strerror(errno));
+
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    FILE *conn = fdopen(fd, "r+");
+    if (conn == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    // the request ends at the first newline
+    fprintf(conn, "%i %i %i %i %i %i %i %i %s ", mode, p->limit, p->page, p->after, p->distance, p->fast, p->verbose, p->format, p->lang);
+    for (const char *c = query; *c != '\0'; c++) {
+        fputc(*c == '\n' ? ' ' : *c, conn);
+    }
+    fputc('\n', conn);
+    fflush(conn);
+
+    int c;
+    while ((c = fgetc(conn)) != EOF && c != '\0') {
+        fputc(c, out);
+    }
+
+    int count = -1;
+    if (c == EOF || fscanf(conn, "%i", &count) != 1) {
+        fprintf(stderr, "ERR! Connection to %s closed unexpectedly\n", path);
+
+        count = -1;
+    }
+
+    fclose(conn);
+    return count;
+}
@@ -0,0 +1,11 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <stdio.h>
+
+#include "jdic.h"
+
+int server_run(jdic_t *, const char *, const char *, int);
+int client_lookup(jdic_t *, const char *, search_mode_t, const char *, FILE *);
+
+#endif // __SERVER_H__
@@ -0,0 +1,1463 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <sqlite3.h>
+#include "array.h"
+#include "util.h"
+#include "postings.h"
+#include "fuzzy.h"
+#include "deinflect.h"
+#include "normalize.h"
+#include "snapshot.h"
+
+// A snapshot is a read-only image of the dictionary that is used straight
+// from a memory mapping. Everything is stored in native byte order, as an
+// array of fixed size records per table, with all strings in a single pool
+// referenced by offset. Entries are sorted by seqnum, and the kanji and
+// reading indices are sorted by their normalized text so they can be binary
+// searched, and come with a second index of the same keys with their text
+// reversed.
+//
+// Definitions are searched through an inverted index: a term dictionary
+// sorted by text, with for every term the ascending list of glosses it
+// appears in, delta and varint encoded.
+//
+// Entries and senses are followed by a sentinel record, so the forms of
+// entry i are [entries[i].form, entries[i+1].form), and so on.
+
+#define SNAPSHOT_MAGIC "JDICSNAP"
+#define SNAPSHOT_VERSION 4
+// string offset of a missing value
+#define SNAPSHOT_NONE UINT32_MAX
+// initial size of the string intern table, must be a power of two
+#define INTERN_SIZE (1 << 16)
+// number of entries fetched from the database at once
+#define EXPORT_BATCH 256
+// longer gloss terms are cut short, in the index and in queries alike
+#define TERM_MAX 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t nforms;
+    uint32_t nsenses;
+    uint32_t nglosses;
+    uint32_t nkanji;
+    uint32_t nreadings;
+    uint32_t nterms;
+    // offsets of the sections from the start of the file
+    uint64_t entries;
+    uint64_t forms;
+    uint64_t senses;
+    uint64_t glosses;
+    uint64_t kanji;
+    uint64_t readings;
+    // reversed indices, with as many keys as the ones above
+    uint64_t kanji_rev;
+    uint64_t readings_rev;
+    uint64_t terms;
+    uint64_t postings;
+    uint64_t postings_size;
+    uint64_t pool;
+    uint64_t pool_size;
+    uint64_t size;
+} snap_header_t;
+
+typedef struct {
+    int32_t seqnum;
+    uint32_t form;
+    uint32_t sense;
+} snap_entry_t;
+
+typedef struct {
+    uint32_t kanji;
+    uint32_t reading;
+    uint32_t tags;
+} snap_form_t;
+
+typedef struct {
+    int32_t id;
+    uint32_t gloss;
+    uint32_t pos;
+    uint32_t misc;
+    uint32_t info;
+    uint32_t xref;
+} snap_sense_t;
+
+typedef struct {
+    uint32_t lang;
+    uint32_t text;
+} snap_gloss_t;
+
+// kanji or reading index entry, points at the entry record rather than the seqnum
+typedef struct {
+    uint32_t text;
+    uint32_t entry;
+} snap_key_t;
+
+// gloss index term, its posting list is count ids starting at byte postings
+typedef struct {
+    uint32_t text;
+    uint32_t postings;
+    uint32_t count;
+} snap_term_t;
+
+// occurrence of a term in a gloss, collected while exporting
+typedef struct {
+    uint32_t text;
+    uint32_t gloss;
+} term_hit_t;
+
+struct snapshot {
+    void *map;
+    size_t size;
+    const snap_header_t *hdr;
+    const snap_entry_t *entries;
+    const snap_form_t *forms;
+    const snap_sense_t *senses;
+    const snap_gloss_t *glosses;
+    const snap_key_t *kanji;
+    const snap_key_t *readings;
+    const snap_key_t *kanji_rev;
+    const snap_key_t *readings_rev;
+    const snap_term_t *terms;
+    const uint8_t *postings;
+    const char *pool;
+};
+
+// everything written to a snapshot, collected in memory first
+typedef struct {
+    array_t entries;
+    array_t forms;
+    array_t senses;
+    array_t glosses;
+    array_t kanji;
+    array_t readings;
+    array_t kanji_rev;
+    array_t readings_rev;
+    array_t hits;
+    array_t terms;
+    array_t postings;
+    array_t pool;
+    // open addressing table of pool offsets, every string is stored once
+    uint32_t *strings;
+    size_t nstrings;
+    size_t nslots;
+} builder_t;
+
+static int intern_grow(builder_t *b)
+{
+    size_t nslots = b->nslots > 0 ? b->nslots * 2 : INTERN_SIZE;
+    uint32_t *strings = malloc(nslots * sizeof(uint32_t));
+    if (strings == NULL) {
+        return 1;
+    }
+    memset(strings, 0xff, nslots * sizeof(uint32_t));
+
+    for (size_t i = 0; i < b->nslots; i++) {
+        uint32_t off = b->strings[i];
+        if (off == SNAPSHOT_NONE) {
+            continue;
+        }
+
+        const char *s = ARRAY((&b->pool), char) + off;
+        size_t slot = fnv1a(FNV1A_INIT, s, strlen(s)) & (nslots - 1);
+        while (strings[slot] != SNAPSHOT_NONE) {
+            slot = (slot + 1) & (nslots - 1);
+        }
+        strings[slot] = off;
+    }
+
+    free(b->strings);
+    b->strings = strings;
+    b->nslots = nslots;
+
+    return 0;
+}
+
+// returns the pool offset of s, adding it to the pool if it isn't there yet
+static int intern(builder_t *b, const char *s, uint32_t *off)
+{
+    if (s == NULL) {
+        *off = SNAPSHOT_NONE;
+
+        return 0;
+    }
+
+    if (b->nstrings * 2 >= b->nslots && intern_grow(b)) {
+        return 1;
+    }
+
+    size_t len = strlen(s);
+    size_t slot = fnv1a(FNV1A_INIT, s, len) & (b->nslots - 1);
+    while (b->strings[slot] != SNAPSHOT_NONE) {
+        if (!strcmp(ARRAY((&b->pool), char) + b->strings[slot], s)) {
+            *off = b->strings[slot];
+
+            return 0;
+        }
+        slot = (slot + 1) & (b->nslots - 1);
+    }
+
+    if (b->pool.size + len + 1 >= SNAPSHOT_NONE || !array_reserve(&b->pool, len + 1)) {
+        return 1;
+    }
+
+    *off = (uint32_t)b->pool.size;
+    memcpy(ARRAY((&b->pool), char) + b->pool.size, s, len + 1);
+    b->pool.size += len + 1;
+    b->strings[slot] = *off;
+    b->nstrings++;
+
+    return 0;
+}
+
+static int add_key(builder_t *b, array_t *keys, const char *text, uint32_t entry)
+{
+    if (!array_reserve(keys, 1)) {
+        return 1;
+    }
+
+    snap_key_t *k = ARRAY(keys, snap_key_t) + keys->size++;
+    k->entry = entry;
+
+    return intern(b, text, &k->text);
+}
+
+// adds the normalized text as a key to both an index and its reversed counterpart
+static int add_keys(builder_t *b, array_t *keys, array_t *rkeys, const char *text, uint32_t entry)
+{
+    size_t size = NORMALIZE_SIZE(strlen(text));
+    char *norm = malloc(size * 2);
+    if (norm == NULL) {
+        return 1;
+    }
+    char *rnorm = norm + size;
+
+    size_t len = normalize(text, norm);
+    utf8_reverse(norm, len, rnorm);
+
+    int ret = add_key(b, keys, norm, entry) || add_key(b, rkeys, rnorm, entry);
+
+    free(norm);
+    return ret;
+}
+
+// reads the next term from [*c, end) into term, lowercased, returns its
+// length or 0 once there are none left. Like the FTS tokenizer, terms are
+// runs of letters and digits, anything outside of ASCII counts as a letter.
+static size_t next_term(const char **c, const char *end, char *term)
+{
+    const char *s = *c;
+    size_t len = 0;
+
+    while (s < end && !isalnum((unsigned char)*s) && (unsigned char)*s < 0x80) {
+        s++;
+    }
+    while (s < end && (isalnum((unsigned char)*s) || (unsigned char)*s >= 0x80)) {
+        if (len < TERM_MAX - 1) {
+            term[len++] = (char)tolower((unsigned char)*s);
+        }
+        s++;
+    }
+    term[len] = '\0';
+    *c = s;
+
+    return len;
+}
+
+static int add_terms(builder_t *b, const char *text, uint32_t gloss)
+{
+    const char *c = text;
+    const char *end = text + strlen(text);
+    char term[TERM_MAX];
+
+    // the same term twice in a gloss is removed once the hits are sorted
+    while (next_term(&c, end, term) > 0) {
+        if (!array_reserve(&b->hits, 1)) {
+            return 1;
+        }
+
+        term_hit_t *h = ARRAY((&b->hits), term_hit_t) + b->hits.size++;
+        h->gloss = gloss;
+        if (intern(b, term, &h->text)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int add_entry(builder_t *b, const jmdict_entry_t *e)
+{
+    uint32_t entry = (uint32_t)b->entries.size;
+
+    if (!array_reserve(&b->entries, 1)
+            || !array_reserve(&b->forms, (size_t)e->nforms)
+            || !array_reserve(&b->senses, (size_t)e->nsenses)) {
+        return 1;
+    }
+
+    snap_entry_t *se = ARRAY((&b->entries), snap_entry_t) + b->entries.size++;
+    se->seqnum = e->seqnum;
+    se->form = (uint32_t)b->forms.size;
+    se->sense = (uint32_t)b->senses.size;
+
+    for (int i = 0; i < e->nforms; i++) {
+        const jmdict_form_t *f = &e->forms[i];
+        snap_form_t *sf = ARRAY((&b->forms), snap_form_t) + b->forms.size++;
+
+        if (intern(b, f->kanji, &sf->kanji)
+                || intern(b, f->reading, &sf->reading)
+                || intern(b, f->tags, &sf->tags)) {
+            return 1;
+        }
+
+        // duplicates are removed once the index is sorted
+        if (f->kanji != NULL && add_keys(b, &b->kanji, &b->kanji_rev, f->kanji, entry)) {
+            return 1;
+        }
+        if (add_keys(b, &b->readings, &b->readings_rev, f->reading, entry)) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < e->nsenses; i++) {
+        const jmdict_sense_t *s = &e->senses[i];
+
+        if (!array_reserve(&b->glosses, (size_t)s->nglosses)) {
+            return 1;
+        }
+
+        snap_sense_t *ss = ARRAY((&b->senses), snap_sense_t) + b->senses.size++;
+        ss->id = s->id;
+        ss->gloss = (uint32_t)b->glosses.size;
+        if (intern(b, s->pos, &ss->pos)
+                || intern(b, s->misc, &ss->misc)
+                || intern(b, s->info, &ss->info)
+                || intern(b, s->xref, &ss->xref)) {
+            return 1;
+        }
+
+        for (int j = 0; j < s->nglosses; j++) {
+            uint32_t gloss = (uint32_t)b->glosses.size++;
+            snap_gloss_t *sg = ARRAY((&b->glosses), snap_gloss_t) + gloss;
+
+            if (intern(b, s->glosses[j].lang, &sg->lang)
+                    || intern(b, s->glosses[j].text, &sg->text)
+                    || add_terms(b, s->glosses[j].text, gloss)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// key with its text resolved, so it can be sorted without a global pool pointer
+typedef struct {
+    const char *text;
+    snap_key_t key;
+} sort_key_t;
+
+static int sort_key_cmp(const void *a, const void *b)
+{
+    const sort_key_t *ka = a;
+    const sort_key_t *kb = b;
+
+    int cmp = strcmp(ka->text, kb->text);
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return ka->key.entry < kb->key.entry ? -1 : ka->key.entry > kb->key.entry;
+}
+
+// sort an index by text, dropping keys that point at the same entry twice
+static int sort_keys(builder_t *b, array_t *keys)
+{
+    snap_key_t *k = ARRAY(keys, snap_key_t);
+    sort_key_t *tmp = calloc(keys->size > 0 ? keys->size : 1, sizeof(sort_key_t));
+    if (tmp == NULL) {
+        return 1;
+    }
+
+    for (size_t i = 0; i < keys->size; i++) {
+        tmp[i].text = ARRAY((&b->pool), char) + k[i].text;
+        tmp[i].key = k[i];
+    }
+    qsort(tmp, keys->size, sizeof(sort_key_t), sort_key_cmp);
+
+    size_t n = 0;
+    for (size_t i = 0; i < keys->size; i++) {
+        if (n > 0 && k[n - 1].text == tmp[i].key.text && k[n - 1].entry == tmp[i].key.entry) {
+            continue;
+        }
+        k[n++] = tmp[i].key;
+    }
+    keys->size = n;
+
+    free(tmp);
+    return 0;
+}
+
+static int hit_cmp(const void *a, const void *b)
+{
+    const term_hit_t *ha = a;
+    const term_hit_t *hb = b;
+
+    if (ha->text != hb->text) {
+        return ha->text < hb->text ? -1 : 1;
+    }
+
+    return ha->gloss < hb->gloss ? -1 : ha->gloss > hb->gloss;
+}
+
+// term with its text resolved, see sort_key_t
+typedef struct {
+    const char *text;
+    snap_term_t term;
+} sort_term_t;
+
+static int sort_term_cmp(const void *a, const void *b)
+{
+    return strcmp(((const sort_term_t *)a)->text, ((const sort_term_t *)b)->text);
+}
+
+// turns the hits into posting lists and a term dictionary sorted by text
+static int build_terms(builder_t *b)
+{
+    term_hit_t *h = ARRAY((&b->hits), term_hit_t);
+    size_t nhits = b->hits.size;
+    int ret = 1;
+
+    // interned texts are equal when their offsets are, so sorting by
+    // offset groups the hits of every term together
+    qsort(h, nhits, sizeof(term_hit_t), hit_cmp);
+
+    uint32_t *ids = malloc((nhits > 0 ? nhits : 1) * sizeof(uint32_t));
+    sort_term_t *tmp = malloc((nhits > 0 ? nhits : 1) * sizeof(sort_term_t));
+    if (ids == NULL || tmp == NULL) {
+        goto cleanup;
+    }
+
+    size_t nterms = 0;
+    for (size_t i = 0; i < nhits;) {
+        uint32_t text = h[i].text;
+        size_t n = 0;
+
+        for (; i < nhits && h[i].text == text; i++) {
+            if (n == 0 || ids[n - 1] != h[i].gloss) {
+                ids[n++] = h[i].gloss;
+            }
+        }
+
+        if (b->postings.size + n * VARINT_MAX >= UINT32_MAX
+                || !array_reserve(&b->postings, n * VARINT_MAX)) {
+            goto cleanup;
+        }
+
+        tmp[nterms].text = ARRAY((&b->pool), char) + text;
+        tmp[nterms].term = (snap_term_t){
+            .text = text,
+            .postings = (uint32_t)b->postings.size,
+            .count = (uint32_t)n,
+        };
+        nterms++;
+
+        b->postings.size += postings_encode(ids, n, ARRAY((&b->postings), uint8_t) + b->postings.size);
+    }
+
+    qsort(tmp, nterms, sizeof(sort_term_t), sort_term_cmp);
+
+    if (!array_reserve(&b->terms, nterms)) {
+        goto cleanup;
+    }
+    for (size_t i = 0; i < nterms; i++) {
+        ARRAY((&b->terms), snap_term_t)[i] = tmp[i].term;
+    }
+    b->terms.size = nterms;
+    ret = 0;
+
+cleanup:
+    free(ids);
+    free(tmp);
+    return ret;
+}
+
+static uint64_t section(uint64_t *cur, size_t size)
+{
+    uint64_t off = *cur;
+    *cur = (off + size + 7) & ~(uint64_t)7;
+
+    return off;
+}
+
+static int write_section(FILE *fp, uint64_t *pos, uint64_t off, const void *ptr, size_t size)
+{
+    static const char zero[8];
+
+    if (off > *pos && fwrite(zero, 1, (size_t)(off - *pos), fp) != off - *pos) {
+        return 1;
+    }
+    if (size > 0 && fwrite(ptr, 1, size, fp) != size) {
+        return 1;
+    }
+    *pos = off + size;
+
+    return 0;
+}
+
+static int write_snapshot(builder_t *b, const char *fn)
+{
+    snap_header_t hdr = {
+        .version = SNAPSHOT_VERSION,
+        // without the sentinels
+        .nentries = (uint32_t)b->entries.size - 1,
+        .nforms = (uint32_t)b->forms.size,
+        .nsenses = (uint32_t)b->senses.size - 1,
+        .nglosses = (uint32_t)b->glosses.size,
+        .nkanji = (uint32_t)b->kanji.size,
+        .nreadings = (uint32_t)b->readings.size,
+        .nterms = (uint32_t)b->terms.size,
+        .postings_size = b->postings.size,
+        .pool_size = b->pool.size,
+    };
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+
+    uint64_t cur = 0;
+    section(&cur, sizeof(hdr));
+    hdr.entries = section(&cur, b->entries.size * sizeof(snap_entry_t));
+    hdr.forms = section(&cur, b->forms.size * sizeof(snap_form_t));
+    hdr.senses = section(&cur, b->senses.size * sizeof(snap_sense_t));
+    hdr.glosses = section(&cur, b->glosses.size * sizeof(snap_gloss_t));
+    hdr.kanji = section(&cur, b->kanji.size * sizeof(snap_key_t));
+    hdr.readings = section(&cur, b->readings.size * sizeof(snap_key_t));
+    hdr.kanji_rev = section(&cur, b->kanji_rev.size * sizeof(snap_key_t));
+    hdr.readings_rev = section(&cur, b->readings_rev.size * sizeof(snap_key_t));
+    hdr.terms = section(&cur, b->terms.size * sizeof(snap_term_t));
+    hdr.postings = section(&cur, b->postings.size);
+    hdr.pool = section(&cur, b->pool.size);
+    hdr.size = hdr.pool + b->pool.size;
+
+    // written next to the old snapshot and renamed over it, so processes
+    // that still have the old one mapped keep working
+    size_t len = strlen(fn);
+    char *tmp = malloc(len + 5);
+    if (tmp == NULL) {
+        return 1;
+    }
+    memcpy(tmp, fn, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open file: %s\n", tmp);
+
+        free(tmp);
+        return 1;
+    }
+
+    uint64_t pos = 0;
+    int ret = write_section(fp, &pos, 0, &hdr, sizeof(hdr))
+        || write_section(fp, &pos, hdr.entries, b->entries.ptr, b->entries.size * sizeof(snap_entry_t))
+        || write_section(fp, &pos, hdr.forms, b->forms.ptr, b->forms.size * sizeof(snap_form_t))
+        || write_section(fp, &pos, hdr.senses, b->senses.ptr, b->senses.size * sizeof(snap_sense_t))
+        || write_section(fp, &pos, hdr.glosses, b->glosses.ptr, b->glosses.size * sizeof(snap_gloss_t))
+        || write_section(fp, &pos, hdr.kanji, b->kanji.ptr, b->kanji.size * sizeof(snap_key_t))
+        || write_section(fp, &pos, hdr.readings, b->readings.ptr, b->readings.size * sizeof(snap_key_t))
+        || write_section(fp, &pos, hdr.kanji_rev, b->kanji_rev.ptr, b->kanji_rev.size * sizeof(snap_key_t))
+        || write_section(fp, &pos, hdr.readings_rev, b->readings_rev.ptr, b->readings_rev.size * sizeof(snap_key_t))
+        || write_section(fp, &pos, hdr.terms, b->terms.ptr, b->terms.size * sizeof(snap_term_t))
+        || write_section(fp, &pos, hdr.postings, b->postings.ptr, b->postings.size)
+        || write_section(fp, &pos, hdr.pool, b->pool.ptr, b->pool.size);
+
+    if (fclose(fp) != 0 || ret) {
+        fprintf(stderr, "Failed to write snapshot: %s\n", tmp);
+
+        remove(tmp);
+        ret = 1;
+    } else if (rename(tmp, fn) != 0) {
+        fprintf(stderr, "Failed to replace snapshot: %s\n", fn);
+
+        remove(tmp);
+        ret = 1;
+    }
+
+    free(tmp);
+    return ret;
+}
+
+int snapshot_export(jdic_t *p, const char *fn)
+{
+    long long start = mstime();
+    struct sqlite3_stmt *st = NULL;
+    builder_t b = {
+        .entries = array_new(1024, sizeof(snap_entry_t)),
+        .forms = array_new(1024, sizeof(snap_form_t)),
+        .senses = array_new(1024, sizeof(snap_sense_t)),
+        .glosses = array_new(1024, sizeof(snap_gloss_t)),
+        .kanji = array_new(1024, sizeof(snap_key_t)),
+        .readings = array_new(1024, sizeof(snap_key_t)),
+        .kanji_rev = array_new(1024, sizeof(snap_key_t)),
+        .readings_rev = array_new(1024, sizeof(snap_key_t)),
+        .hits = array_new(1 << 16, sizeof(term_hit_t)),
+        .terms = array_new(1024, sizeof(snap_term_t)),
+        .postings = array_new(1 << 16, sizeof(uint8_t)),
+        .pool = array_new(1 << 16, sizeof(char)),
+    };
+    // the snapshot has to contain everything, regardless of what is shown
+    jdic_t q = *p;
+    q.fast = 0;
+    // entries are only needed until they're added, a batch at a time
+    arena_t arena = arena_new(0);
+    int ret = 1;
+
+    // every entry has at least one reading
+    const char *sql = "SELECT DISTINCT seqnum FROM jmdict_reading ORDER BY seqnum";
+    if (sqlite3_prepare_v2(p->db, sql, -1, &st, NULL) != SQLITE_OK) {
+        fprintf(stderr, "ERR! Failed to prepare \"%s\": %s\n", sql, sqlite3_errmsg(p->db));
+
+        goto cleanup;
+    }
+
+    int seqnums[EXPORT_BATCH];
+    jmdict_entry_t entries[EXPORT_BATCH];
+    int n = 0;
+    int ec;
+    do {
+        ec = sqlite3_step(st);
+        if (ec == SQLITE_ROW) {
+            seqnums[n++] = sqlite3_column_int(st, 0);
+        }
+        if (n == 0 || (n < EXPORT_BATCH && ec == SQLITE_ROW)) {
+            continue;
+        }
+
+        if (jmdict_fetch_entries(&q, seqnums, n, NULL, entries, &arena)) {
+            goto cleanup;
+        }
+
+        int failed = 0;
+        for (int i = 0; i < n && !failed; i++) {
+            failed = add_entry(&b, &entries[i]);
+        }
+        arena_reset(&arena);
+        if (failed) {
+            fprintf(stderr, "ERR! Failed to allocate memory for snapshot\n");
+
+            goto cleanup;
+        }
+
+        if (p->verbose && b.entries.size / 10000 != (b.entries.size - (size_t)n) / 10000) {
+            printf("Exported %zu entries...\n", b.entries.size);
+        }
+        n = 0;
+    } while (ec == SQLITE_ROW);
+    if (ec != SQLITE_DONE) {
+        fprintf(stderr, "ERR! Failed to get entries: %i\n", ec);
+
+        goto cleanup;
+    }
+
+    // sentinels marking where the last entry and sense end
+    if (!array_reserve(&b.entries, 1) || !array_reserve(&b.senses, 1)) {
+        fprintf(stderr, "ERR! Failed to allocate memory for snapshot\n");
+
+        goto cleanup;
+    }
+    ARRAY((&b.entries), snap_entry_t)[b.entries.size++] = (snap_entry_t){
+        .seqnum = INT32_MAX,
+        .form = (uint32_t)b.forms.size,
+        .sense = (uint32_t)b.senses.size,
+    };
+    ARRAY((&b.senses), snap_sense_t)[b.senses.size++] = (snap_sense_t){
+        .gloss = (uint32_t)b.glosses.size,
+        .pos = SNAPSHOT_NONE,
+        .misc = SNAPSHOT_NONE,
+        .info = SNAPSHOT_NONE,
+        .xref = SNAPSHOT_NONE,
+    };
+
+    if (sort_keys(&b, &b.kanji) || sort_keys(&b, &b.readings)
+            || sort_keys(&b, &b.kanji_rev) || sort_keys(&b, &b.readings_rev)) {
+        fprintf(stderr, "ERR! Failed to allocate memory for snapshot index\n");
+
+        goto cleanup;
+    }
+
+    if (build_terms(&b)) {
+        fprintf(stderr, "ERR! Failed to allocate memory for snapshot gloss index\n");
+
+        goto cleanup;
+    }
+
+    ret = write_snapshot(&b, fn);
+    if (!ret) {
+        double secs = (double)(mstime() - start) / 1000.0;
+        printf("Exported %zu entries to %s in %.3fs (%zu bytes of strings)\n",
+                b.entries.size - 1, fn, secs, b.pool.size);
+    }
+
+cleanup:
+    sqlite3_finalize(st);
+    // the statements the copy prepared are finalized along with p's
+    memcpy(p->stmts, q.stmts, sizeof(p->stmts));
+    arena_free(&arena);
+    array_free(&b.entries, NULL);
+    array_free(&b.forms, NULL);
+    array_free(&b.senses, NULL);
+    array_free(&b.glosses, NULL);
+    array_free(&b.kanji, NULL);
+    array_free(&b.readings, NULL);
+    array_free(&b.kanji_rev, NULL);
+    array_free(&b.readings_rev, NULL);
+    array_free(&b.hits, NULL);
+    array_free(&b.terms, NULL);
+    array_free(&b.postings, NULL);
+    array_free(&b.pool, NULL);
+    free(b.strings);
+
+    return ret;
+}
+
+// whether count records of a given size starting at off fit in the snapshot
+static int section_ok(const snapshot_t *s, uint64_t off, uint64_t count, size_t size)
+{
+    return off % 8 == 0 && off <= s->size && count <= (s->size - off) / size;
+}
+
+snapshot_t *snapshot_open(const char *fn)
+{
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", fn);
+
+        return NULL;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(snap_header_t)) {
+        fprintf(stderr, "Not a snapshot: %s\n", fn);
+
+        close(fd);
+        return NULL;
+    }
+
+    snapshot_t *s = calloc(1, sizeof(snapshot_t));
+    if (s == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    s->size = (size_t)sb.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map snapshot: %s\n", fn);
+
+        free(s);
+        return NULL;
+    }
+
+    // lookups only ever touch a few pages, reading ahead is wasted effort
+    madvise(s->map, s->size, MADV_RANDOM);
+
+    // only the layout is checked, the records themselves are trusted
+    const snap_header_t *hdr = s->map;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) != 0
+            || hdr->version != SNAPSHOT_VERSION
+            || hdr->size != s->size
+            || !section_ok(s, hdr->entries, (uint64_t)hdr->nentries + 1, sizeof(snap_entry_t))
+            || !section_ok(s, hdr->forms, hdr->nforms, sizeof(snap_form_t))
+            || !section_ok(s, hdr->senses, (uint64_t)hdr->nsenses + 1, sizeof(snap_sense_t))
+            || !section_ok(s, hdr->glosses, hdr->nglosses, sizeof(snap_gloss_t))
+            || !section_ok(s, hdr->kanji, hdr->nkanji, sizeof(snap_key_t))
+            || !section_ok(s, hdr->readings, hdr->nreadings, sizeof(snap_key_t))
+            || !section_ok(s, hdr->kanji_rev, hdr->nkanji, sizeof(snap_key_t))
+            || !section_ok(s, hdr->readings_rev, hdr->nreadings, sizeof(snap_key_t))
+            || !section_ok(s, hdr->terms, hdr->nterms, sizeof(snap_term_t))
+            || !section_ok(s, hdr->postings, hdr->postings_size, sizeof(uint8_t))
+            || !section_ok(s, hdr->pool, hdr->pool_size, sizeof(char))
+            || hdr->pool_size == 0
+            || ((const char *)s->map)[hdr->pool + hdr->pool_size - 1] != '\0') {
+        fprintf(stderr, "Not a snapshot, or one from a different version: %s\n", fn);
+
+        snapshot_close(s);
+        return NULL;
+    }
+
+    s->hdr = hdr;
+    s->entries = (const snap_entry_t *)((const char *)s->map + hdr->entries);
+    s->forms = (const snap_form_t *)((const char *)s->map + hdr->forms);
+    s->senses = (const snap_sense_t *)((const char *)s->map + hdr->senses);
+    s->glosses = (const snap_gloss_t *)((const char *)s->map + hdr->glosses);
+    s->kanji = (const snap_key_t *)((const char *)s->map + hdr->kanji);
+    s->readings = (const snap_key_t *)((const char *)s->map + hdr->readings);
+    s->kanji_rev = (const snap_key_t *)((const char *)s->map + hdr->kanji_rev);
+    s->readings_rev = (const snap_key_t *)((const char *)s->map + hdr->readings_rev);
+    s->terms = (const snap_term_t *)((const char *)s->map + hdr->terms);
+    s->postings = (const uint8_t *)s->map + hdr->postings;
+    s->pool = (const char *)s->map + hdr->pool;
+
+    return s;
+}
+
+void snapshot_close(snapshot_t *s)
+{
+    if (s == NULL) {
+        return;
+    }
+
+    munmap(s->map, s->size);
+    free(s);
+}
+
+#define SNAP_STR(s, off) ((off) == SNAPSHOT_NONE ? NULL : (s)->pool + (off))
+
+// first of the keys not sorting before the first len bytes of text
+static uint32_t key_lower_bound(const snapshot_t *s, const snap_key_t *keys, uint32_t nkeys, const char *text, size_t len)
+{
+    uint32_t lo = 0;
+    uint32_t hi = nkeys;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strncmp(s->pool + keys[mid].text, text, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// first entry past the seqnum p->after
+static uint32_t first_entry(jdic_t *p)
+{
+    const snapshot_t *s = p->snap;
+
+    uint32_t lo = 0;
+    uint32_t hi = s->hdr->nentries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (s->entries[mid].seqnum <= p->after) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// finds keys matching a GLOB pattern, the same way the SQLite search does,
+// entries are found in seqnum order. Patterns are looked up by the literal
+// text they start with, or by the literal text they end with in the index
+// of reversed keys when that is longer, only a pattern that does neither
+// has to go through every key.
+static int search_index(jdic_t *p, const snap_key_t *keys, const snap_key_t *rkeys, uint32_t nkeys, const char *query, int *a)
+{
+    const snapshot_t *s = p->snap;
+    size_t len = strlen(query);
+    size_t plen = strcspn(query, "*?[");
+    uint32_t first = first_entry(p);
+    int skip = (p->page - 1) * p->limit;
+    int count = 0;
+
+    // the keys of the same text are sorted by entry already
+    if (plen == len) {
+        for (uint32_t i = key_lower_bound(s, keys, nkeys, query, len); i < nkeys && count < p->limit; i++) {
+            if (strcmp(s->pool + keys[i].text, query) != 0) {
+                break;
+            }
+            if (keys[i].entry < first) {
+                continue;
+            }
+
+            if (skip > 0) {
+                skip--;
+                continue;
+            }
+            a[count++] = s->entries[keys[i].entry].seqnum;
+        }
+
+        return count;
+    }
+
+    size_t slen = 0;
+    while (slen < len && strchr("*?[]", query[len - slen - 1]) == NULL) {
+        slen++;
+    }
+
+    // several keys can match for the same entry, the matches are collected
+    // in a bitmap of entries and read back in order
+    unsigned char *seen = calloc(s->hdr->nentries / 8 + 1, sizeof(unsigned char));
+    char *suffix = malloc(slen + 1);
+    char *text = NULL;
+    size_t size = 0;
+    uint32_t lo = UINT32_MAX;
+    uint32_t hi = 0;
+
+    if (seen == NULL || suffix == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for search\n");
+
+        goto cleanup;
+    }
+
+    if (slen > plen) {
+        utf8_reverse(query + len - slen, slen, suffix);
+
+        for (uint32_t i = key_lower_bound(s, rkeys, nkeys, suffix, slen); i < nkeys; i++) {
+            const char *rtext = s->pool + rkeys[i].text;
+            size_t tlen = strlen(rtext);
+            uint32_t entry = rkeys[i].entry;
+
+            if (strncmp(rtext, suffix, slen) != 0) {
+                break;
+            }
+
+            if (tlen + 1 > size) {
+                char *tmp = realloc(text, tlen + 1);
+                if (tmp == NULL) {
+                    fprintf(stderr, "ERR! Failed to allocate memory for search\n");
+
+                    goto cleanup;
+                }
+                text = tmp;
+                size = tlen + 1;
+            }
+            utf8_reverse(rtext, tlen, text);
+
+            if (entry >= first && sqlite3_strglob(query, text) == 0) {
+                seen[entry / 8] |= (unsigned char)(1 << (entry % 8));
+                if (entry < lo) lo = entry;
+                if (entry > hi) hi = entry;
+            }
+        }
+    } else {
+        for (uint32_t i = key_lower_bound(s, keys, nkeys, query, plen); i < nkeys; i++) {
+            const char *ktext = s->pool + keys[i].text;
+            uint32_t entry = keys[i].entry;
+
+            if (strncmp(ktext, query, plen) != 0) {
+                break;
+            }
+
+            if (entry >= first && sqlite3_strglob(query, ktext) == 0) {
+                seen[entry / 8] |= (unsigned char)(1 << (entry % 8));
+                if (entry < lo) lo = entry;
+                if (entry > hi) hi = entry;
+            }
+        }
+    }
+
+    for (uint32_t entry = lo; entry <= hi && count < p->limit; entry++) {
+        if (!(seen[entry / 8] & (1 << (entry % 8)))) {
+            continue;
+        }
+
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        a[count++] = s->entries[entry].seqnum;
+    }
+
+cleanup:
+    free(seen);
+    free(suffix);
+    free(text);
+
+    return count;
+}
+
+int snapshot_search_kanji(jdic_t *p, const char *query, int *a)
+{
+    return search_index(p, p->snap->kanji, p->snap->kanji_rev, p->snap->hdr->nkanji, query, a);
+}
+
+int snapshot_search_reading(jdic_t *p, const char *query, int *a)
+{
+    return search_index(p, p->snap->readings, p->snap->readings_rev, p->snap->hdr->nreadings, query, a);
+}
+
+// whether one of the senses of entry has a part of speech of a kind in type
+static int entry_pos_ok(const snapshot_t *s, uint32_t entry, unsigned type)
+{
+    for (uint32_t i = s->entries[entry].sense; i < s->entries[entry + 1].sense; i++) {
+        if (s->senses[i].pos != SNAPSHOT_NONE && deinflect_pos_ok(type, s->pool + s->senses[i].pos)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int add_deinflected(const snapshot_t *s, const snap_key_t *keys, uint32_t nkeys,
+                           const deinflection_t *d, int candidate, array_t *hits)
+{
+    for (uint32_t i = key_lower_bound(s, keys, nkeys, d->text, strlen(d->text)); i < nkeys; i++) {
+        if (strcmp(s->pool + keys[i].text, d->text) != 0) {
+            break;
+        }
+        if (!entry_pos_ok(s, keys[i].entry, d->type)) {
+            continue;
+        }
+
+        if (!array_reserve(hits, 1)) {
+            return 1;
+        }
+        ARRAY(hits, deinflect_hit_t)[hits->size++] = (deinflect_hit_t){ candidate, s->entries[keys[i].entry].seqnum };
+    }
+
+    return 0;
+}
+
+// the snapshot counterpart of jmdict_search_deinflected
+int snapshot_search_deinflected(jdic_t *p, const char *query, int *a)
+{
+    const snapshot_t *s = p->snap;
+    deinflection_t cands[DEINFLECT_MAX];
+    array_t hits = array_new(16, sizeof(deinflect_hit_t));
+    int count = 0;
+
+    int n = deinflect(query, cands);
+    for (int i = 1; i < n; i++) {
+        if (!(cands[i].type & DI_DICTIONARY)) {
+            continue;
+        }
+
+        if (add_deinflected(s, s->kanji, s->hdr->nkanji, &cands[i], i, &hits)
+                || add_deinflected(s, s->readings, s->hdr->nreadings, &cands[i], i, &hits)) {
+            fprintf(stderr, "ERR! Failed to allocate memory for results\n");
+
+            array_free(&hits, NULL);
+            return 0;
+        }
+    }
+
+    count = deinflect_rank(&hits, cands, p->trace, (p->page - 1) * p->limit, p->limit, a);
+
+    array_free(&hits, NULL);
+    return count;
+}
+
+typedef struct {
+    const snapshot_t *s;
+    uint32_t i;
+} reading_cursor_t;
+
+static const char *reading_next(void *ctx, int *id)
+{
+    reading_cursor_t *c = ctx;
+
+    if (c->i >= c->s->hdr->nreadings) {
+        return NULL;
+    }
+
+    *id = (int)c->s->readings[c->i].entry;
+    return c->s->pool + c->s->readings[c->i++].text;
+}
+
+static void reading_skip(void *ctx, const char *prefix, size_t len)
+{
+    reading_cursor_t *c = ctx;
+
+    // the keys left start with the prefix or sort after it
+    uint32_t lo = c->i;
+    uint32_t hi = c->s->hdr->nreadings;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strncmp(c->s->pool + c->s->readings[mid].text, prefix, len) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    c->i = lo;
+}
+
+// finds readings within p->distance edits of the query, closest first
+int snapshot_search_fuzzy(jdic_t *p, const char *query, int *a)
+{
+    reading_cursor_t cursor = { .s = p->snap };
+    key_source_t src = { &cursor, reading_next, reading_skip };
+    array_t hits = array_new(64, sizeof(fuzzy_hit_t));
+    int skip = (p->page - 1) * p->limit;
+    int count = 0;
+
+    if (fuzzy_walk(query, p->distance, &src, &hits)) {
+        fprintf(stderr, "ERR! Query is too long for a fuzzy search\n");
+
+        array_free(&hits, NULL);
+        return 0;
+    }
+    fuzzy_rank(&hits);
+
+    for (size_t i = (size_t)skip; i < hits.size && count < p->limit; i++) {
+        a[count++] = p->snap->entries[ARRAY((&hits), fuzzy_hit_t)[i].id].seqnum;
+    }
+
+    array_free(&hits, NULL);
+    return count;
+}
+
+// decodes the glosses containing term into a new list, or those containing
+// any term starting with it if prefix is set
+static uint32_t *term_postings(const snapshot_t *s, const char *term, int prefix, size_t *n)
+{
+    size_t len = strlen(term);
+
+    uint32_t lo = 0;
+    uint32_t hi = s->hdr->nterms;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (strcmp(s->pool + s->terms[mid].text, term) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    hi = lo;
+    size_t total = 0;
+    while (hi < s->hdr->nterms && (prefix
+                ? strncmp(s->pool + s->terms[hi].text, term, len) == 0
+                : strcmp(s->pool + s->terms[hi].text, term) == 0)) {
+        total += s->terms[hi++].count;
+    }
+
+    uint32_t *ids = malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+    if (ids == NULL) {
+        return NULL;
+    }
+
+    if (hi - lo <= 1) {
+        if (hi > lo) {
+            postings_decode(s->postings + s->terms[lo].postings, total, ids);
+        }
+        *n = total;
+
+        return ids;
+    }
+
+    // the lists of several terms are merged through a bitmap of glosses
+    unsigned char *seen = calloc(s->hdr->nglosses / 8 + 1, sizeof(unsigned char));
+    if (seen == NULL) {
+        free(ids);
+        return NULL;
+    }
+
+    for (uint32_t i = lo; i < hi; i++) {
+        const snap_term_t *t = &s->terms[i];
+
+        postings_decode(s->postings + t->postings, t->count, ids);
+        for (uint32_t j = 0; j < t->count; j++) {
+            seen[ids[j] / 8] |= (unsigned char)(1 << (ids[j] % 8));
+        }
+    }
+
+    *n = 0;
+    for (uint32_t g = 0; g < s->hdr->nglosses; g++) {
+        if (seen[g / 8] & (1 << (g % 8))) {
+            ids[(*n)++] = g;
+        }
+    }
+
+    free(seen);
+    return ids;
+}
+
+typedef struct {
+    uint32_t *ids;
+    size_t n;
+} posting_list_t;
+
+static int posting_list_cmp(const void *a, const void *b)
+{
+    size_t na = ((const posting_list_t *)a)->n;
+    size_t nb = ((const posting_list_t *)b)->n;
+
+    return na < nb ? -1 : na > nb;
+}
+
+// finds entries with a gloss in p->lang containing every word of the query,
+// words ending in * match as prefixes. Unlike the FTS search, results are
+// in seqnum order rather than ranked.
+int snapshot_search_definition(jdic_t *p, const char *query, int *a)
+{
+    const snapshot_t *s = p->snap;
+    // no query can have more terms than it has characters
+    posting_list_t *lists = calloc(strlen(query) + 1, sizeof(posting_list_t));
+    size_t nlists = 0;
+    uint32_t *ids = NULL;
+    int skip = (p->page - 1) * p->limit;
+    int count = 0;
+    char term[TERM_MAX];
+
+    if (lists == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for search\n");
+
+        return 0;
+    }
+
+    const char *c = query;
+    while (*c != '\0') {
+        size_t len = strcspn(c, " \t");
+        if (len == 0) {
+            c++;
+            continue;
+        }
+
+        const char *word = c;
+        const char *end = c + len;
+        int prefix = end[-1] == '*';
+        c = end;
+
+        while (next_term(&word, end, term) > 0) {
+            // the prefix applies to the last term of the word
+            const char *rest = word;
+            char next[TERM_MAX];
+            int last = next_term(&rest, end, next) == 0;
+
+            lists[nlists].ids = term_postings(s, term, prefix && last, &lists[nlists].n);
+            if (lists[nlists].ids == NULL) {
+                fprintf(stderr, "ERR! Failed to allocate memory for search\n");
+
+                goto cleanup;
+            }
+            nlists++;
+        }
+    }
+
+    if (nlists == 0) {
+        goto cleanup;
+    }
+
+    // intersecting the shortest lists first keeps the candidates few
+    qsort(lists, nlists, sizeof(posting_list_t), posting_list_cmp);
+
+    size_t nids = lists[0].n;
+    ids = malloc((nids > 0 ? nids : 1) * sizeof(uint32_t));
+    if (ids == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for search\n");
+
+        goto cleanup;
+    }
+    memcpy(ids, lists[0].ids, nids * sizeof(uint32_t));
+
+    for (size_t i = 1; i < nlists && nids > 0; i++) {
+        // the result is never longer than the input, so the first list can take it
+        nids = postings_intersect(ids, nids, lists[i].ids, lists[i].n, lists[0].ids);
+        memcpy(ids, lists[0].ids, nids * sizeof(uint32_t));
+    }
+
+    // glosses are stored in entry order, so the entries can be walked along
+    uint32_t entry = 0;
+    uint32_t last = UINT32_MAX;
+    for (size_t i = 0; i < nids && count < p->limit; i++) {
+        uint32_t g = ids[i];
+
+        while (s->senses[s->entries[entry + 1].sense].gloss <= g) {
+            entry++;
+        }
+        if (entry == last || strcmp(s->pool + s->glosses[g].lang, p->lang) != 0) {
+            continue;
+        }
+        last = entry;
+
+        if (skip > 0) {
+            skip--;
+            continue;
+        }
+        a[count++] = s->entries[entry].seqnum;
+    }
+
+cleanup:
+    for (size_t i = 0; i < nlists; i++) {
+        free(lists[i].ids);
+    }
+    free(lists);
+    free(ids);
+
+    return count;
+}
+
+// form with its text resolved, so it can be sorted without a global pool pointer
+typedef struct {
+    const char *text;
+    form_key_t key;
+} sort_form_t;
+
+static int sort_form_cmp(const void *a, const void *b)
+{
+    const sort_form_t *fa = a;
+    const sort_form_t *fb = b;
+
+    int cmp = strcmp(fa->text, fb->text);
+    if (cmp != 0) {
+        return cmp;
+    }
+
+    return fa->key.seqnum < fb->key.seqnum ? -1 : fa->key.seqnum > fb->key.seqnum;
+}
+
+// fills forms with every kanji and reading text once per entry, sorted by
+// text and seqnum, returns the pool the texts are in or NULL on failure.
+// These are the texts as written, the indices only have normalized ones.
+const char *snapshot_forms(jdic_t *p, array_t *forms)
+{
+    const snapshot_t *s = p->snap;
+    uint32_t nforms = s->hdr->nforms;
+
+    sort_form_t *tmp = calloc((size_t)nforms * 2 + 1, sizeof(sort_form_t));
+    if (tmp == NULL || !array_reserve(forms, (size_t)nforms * 2)) {
+        free(tmp);
+        return NULL;
+    }
+
+    size_t n = 0;
+    for (uint32_t i = 0; i < s->hdr->nentries; i++) {
+        int seqnum = s->entries[i].seqnum;
+
+        for (uint32_t j = s->entries[i].form; j < s->entries[i + 1].form; j++) {
+            const snap_form_t *f = &s->forms[j];
+
+            if (f->kanji != SNAPSHOT_NONE) {
+                tmp[n++] = (sort_form_t){ s->pool + f->kanji, { f->kanji, seqnum } };
+            }
+            tmp[n++] = (sort_form_t){ s->pool + f->reading, { f->reading, seqnum } };
+        }
+    }
+    qsort(tmp, n, sizeof(sort_form_t), sort_form_cmp);
+
+    // strings are interned, the same text is always at the same offset
+    form_key_t *f = ARRAY(forms, form_key_t);
+    size_t nf = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (nf > 0 && f[nf - 1].text == tmp[i].key.text && f[nf - 1].seqnum == tmp[i].key.seqnum) {
+            continue;
+        }
+        f[nf++] = tmp[i].key;
+    }
+    forms->size = nf;
+
+    free(tmp);
+    return s->pool;
+}
+
+// builds an entry pointing into the mapping
+static int fetch_entry(jdic_t *p, int seqnum, const char *lang, jmdict_entry_t *e, arena_t *arena)
+{
+    const snapshot_t *s = p->snap;
+
+    *e = (jmdict_entry_t){ .seqnum = seqnum };
+
+    uint32_t lo = 0;
+    uint32_t hi = s->hdr->nentries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (s->entries[mid].seqnum < seqnum) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == s->hdr->nentries || s->entries[lo].seqnum != seqnum) {
+        fprintf(stderr, "ERR! Entry #%i is not in the snapshot\n", seqnum);
+
+        return 1;
+    }
+
+    const snap_entry_t *se = &s->entries[lo];
+    uint32_t nforms = se[1].form - se->form;
+    uint32_t nsenses = se[1].sense - se->sense;
+    uint32_t nglosses = s->senses[se[1].sense].gloss - s->senses[se->sense].gloss;
+
+    if (arena == NULL) {
+        e->arena = arena_new(ENTRY_ARENA_BLOCK);
+        arena = &e->arena;
+    }
+    e->forms = arena_calloc(arena, nforms > 0 ? nforms : 1, sizeof(jmdict_form_t));
+    e->senses = arena_calloc(arena, nsenses > 0 ? nsenses : 1, sizeof(jmdict_sense_t));
+    e->glosses = arena_calloc(arena, nglosses > 0 ? nglosses : 1, sizeof(jmdict_gloss_t));
+    if (e->forms == NULL || e->senses == NULL || e->glosses == NULL) {
+        fprintf(stderr, "ERR! Failed to allocate memory for entry #%i\n", seqnum);
+
+        jmdict_entry_free(e);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < nforms; i++) {
+        const snap_form_t *sf = &s->forms[se->form + i];
+        jmdict_form_t *f = &e->forms[e->nforms++];
+
+        f->kanji = SNAP_STR(s, sf->kanji);
+        f->reading = SNAP_STR(s, sf->reading);
+        f->tags = SNAP_STR(s, sf->tags);
+    }
+
+    int nglossed = 0;
+    for (uint32_t i = 0; i < nsenses; i++) {
+        const snap_sense_t *ss = &s->senses[se->sense + i];
+        jmdict_sense_t *sense = &e->senses[e->nsenses];
+
+        sense->glosses = &e->glosses[nglossed];
+        for (uint32_t j = ss->gloss; j < ss[1].gloss; j++) {
+            const char *glang = s->pool + s->glosses[j].lang;
+
+            if (lang != NULL && strcmp(glang, lang) != 0) {
+                continue;
+            }
+
+            jmdict_gloss_t *g = &sense->glosses[sense->nglosses++];
+            g->lang = glang;
+            g->text = SNAP_STR(s, s->glosses[j].text);
+        }
+
+        // like the database, senses without glosses in lang aren't part of the entry
+        if (sense->nglosses == 0) {
+            continue;
+        }
+
+        sense->id = ss->id;
+        sense->pos = SNAP_STR(s, ss->pos);
+        sense->misc = SNAP_STR(s, ss->misc);
+        sense->info = SNAP_STR(s, ss->info);
+        sense->xref = SNAP_STR(s, ss->xref);
+        nglossed += sense->nglosses;
+        e->nsenses++;
+    }
+
+    return 0;
+}
+
+// the snapshot counterpart of jmdict_fetch_entries
+int snapshot_fetch_entries(jdic_t *p, const int *seqnums, int n, const char *lang, jmdict_entry_t *entries, arena_t *arena)
+{
+    for (int i = 0; i < n; i++) {
+        if (fetch_entry(p, seqnums[i], lang, &entries[i], arena)) {
+            while (i--) {
+                jmdict_entry_free(&entries[i]);
+            }
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
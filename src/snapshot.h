@@ -0,0 +1,29 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "array.h"
+#include "jdic.h"
+#include "jmdict.h"
+
+typedef struct snapshot snapshot_t;
+
+// kanji or reading text of an entry, the text is an offset into a pool
+typedef struct {
+    uint32_t text;
+    int seqnum;
+} form_key_t;
+
+int snapshot_export(jdic_t *, const char *);
+snapshot_t *snapshot_open(const char *);
+void snapshot_close(snapshot_t *);
+int snapshot_search_kanji(jdic_t *, const char *, int *);
+int snapshot_search_reading(jdic_t *, const char *, int *);
+int snapshot_search_definition(jdic_t *, const char *, int *);
+int snapshot_search_fuzzy(jdic_t *, const char *, int *);
+int snapshot_search_deinflected(jdic_t *, const char *, int *);
+const char *snapshot_forms(jdic_t *, array_t *);
+int snapshot_fetch_entries(jdic_t *, const int *, int, const char *, jmdict_entry_t *, arena_t *);
+
+#endif // __SNAPSHOT_H__
@@ -1,3 +1,5 @@
+#include <sys/time.h>
+
 #include "util.h"
 
 int antoi(const char *buf, size_t len)
@@ -11,3 +13,67 @@ int antoi(const char *buf, size_t len)
     return n;
 }
 
+long long mstime(void)
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    long long s1 = (long long)(time.tv_sec) * 1000;
+    long long s2 = (time.tv_usec / 1000);
+    return s1 + s2;
+}
+
+long long ustime(void)
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return (long long)(time.tv_sec) * 1000000 + time.tv_usec;
+}
+
+unsigned long long fnv1a(unsigned long long h, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+// decodes the character at *s and moves past it, bytes that don't start a
+// valid sequence are returned as they are
+uint32_t utf8_decode(const char **s)
+{
+    const unsigned char *c = (const unsigned char *)*s;
+    uint32_t cp;
+    int n;
+
+    if (c[0] < 0x80) {
+        *s += 1;
+        return c[0];
+    } else if ((c[0] & 0xe0) == 0xc0) {
+        cp = c[0] & 0x1f;
+        n = 1;
+    } else if ((c[0] & 0xf0) == 0xe0) {
+        cp = c[0] & 0x0f;
+        n = 2;
+    } else if ((c[0] & 0xf8) == 0xf0) {
+        cp = c[0] & 0x07;
+        n = 3;
+    } else {
+        *s += 1;
+        return c[0];
+    }
+
+    for (int i = 1; i <= n; i++) {
+        if ((c[i] & 0xc0) != 0x80) {
+            *s += 1;
+            return c[0];
+        }
+        cp = (cp << 6) | (c[i] & 0x3f);
+    }
+
+    *s += n + 1;
+    return cp;
+}
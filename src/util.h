@@ -2,8 +2,15 @@
 #define __UTIL_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 
 int antoi(const char *buf, size_t len);
+long long mstime(void);
+long long ustime(void);
 
-#endif // __UTIL_H__
+#define FNV1A_INIT 0xcbf29ce484222325ULL
+unsigned long long fnv1a(unsigned long long h, const void *buf, size_t len);
+
+uint32_t utf8_decode(const char **s);
 
+#endif // __UTIL_H__